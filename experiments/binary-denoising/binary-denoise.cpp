@@ -254,7 +254,7 @@ int main(int argc, char** argv) {
         if (method == std::string("submodular-ibfs")) {
             SubmodularIBFSParams params;
             bool ubFnFound = false;
-            for (const auto& tuple : SoSGraph::ubParamList) {
+            for (const auto& tuple : SoSGraphBase::ubParamList) {
                 if (ubType == std::get<1>(tuple)) {
                     params.ub = std::get<0>(tuple);
                     ubFnFound = true;
@@ -264,7 +264,7 @@ int main(int argc, char** argv) {
                 std::cout << "Unrecognized Upper Bound Function\n";
                 exit(-1);
             }
-            SubmodularIBFS crf {params};
+            SubmodularIBFS<> crf {params};
             result = SolveDenoise(crf, inputImages[i], unaryScale, cliqueScale);
         }
         double loss = Loss(result, groundTruthImages[i]);
@@ -130,9 +130,9 @@ int main(int argc, char **argv) {
 
     SubmodularIBFSParams sosParams;
     if (ubFnName == "cvpr14" || ubFnName == "") {
-        sosParams.ub = SoSGraph::UBfn::cvpr14;
+        sosParams.ub = SoSGraphBase::UBfn::cvpr14;
     } else if (ubFnName == "chen") {
-        sosParams.ub = SoSGraph::UBfn::chen;
+        sosParams.ub = SoSGraphBase::UBfn::chen;
     } else {
         std::cout << "Unknown UB name\n";
         exit(-1);
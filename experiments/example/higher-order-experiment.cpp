@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <iostream>
 #include <chrono>
 #include "energy-common.hpp"
@@ -20,7 +21,8 @@ int main(int argc, char **argv) {
     // Run IBFS on random instance
     TimePt ibfsStart = Clock::now();
 
-    SubmodularIBFS ibfs;
+    SubmodularIBFS<> ibfs;
+    ibfs.Reserve(n, m, m*k, m << k);
     GenRandom(ibfs, n, k, m, (REAL)100, (REAL)800, (REAL)1600, 0);
     ibfs.Solve();
 
@@ -60,6 +62,13 @@ int main(int argc, char **argv) {
     std::cout << "IBFS Energy: " << ibfs.ComputeEnergy() << "\n";
     std::cout << "HO time:     " << hoTime.count() << " seconds\n";
     std::cout << "IBFS time:   " << ibfsTime.count() << " seconds\n";
+    // Per push timings, to compare changes to the clique code across
+    // instances that need different numbers of pushes
+    const FlowStats& stats = ibfs.Stats();
+    const double pushes = std::max<size_t>(stats.cliquePushes, 1);
+    std::cout << "Pushes:      " << stats.cliquePushes << "\n";
+    std::cout << "Time/push:   " << stats.totalTime / pushes * 1e9 << " ns\n";
+    std::cout << "Aug/push:    " << stats.augmentTime / pushes * 1e9 << " ns\n";
     
     ASSERT(qr.ComputeTwiceEnergy() == ibfs.ComputeEnergy()*2);
 
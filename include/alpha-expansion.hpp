@@ -4,6 +4,7 @@
 #include "energy-common.hpp"
 #include <vector>
 
+template <typename R>
 class SubmodularIBFS;
 
 class MultiLabelCRF {
@@ -55,7 +56,7 @@ class MultiLabelCRF {
         };
 
     protected:
-        void SetupAlphaEnergy(Label alpha, SubmodularIBFS& crf) const;
+        void SetupAlphaEnergy(Label alpha, SubmodularIBFS<REAL>& crf) const;
         void InitialLabeling();
         const size_t m_num_labels;
         REAL m_constant_term;
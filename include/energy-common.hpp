@@ -15,6 +15,21 @@
 #define ASSERT(cond) (void)0
 #endif
 
+/* Energy type of the multilabel layers, and the default capacity type of
+ * SoSGraph and SubmodularIBFS. 64 bit by default; build with
+ * SOS_REAL_TYPE=int32_t (see the CMake option of the same name) to halve the
+ * size of the clique tables when the energies fit in 32 bits. Binary
+ * problems can also pick the width per solver, as SubmodularIBFS<int32_t>.
+ */
+#ifdef SOS_REAL_TYPE
+typedef SOS_REAL_TYPE REAL;
+#else
 typedef int64_t REAL;
+#endif
+
+// SoSPD splits energies over the nodes of a clique with integer division
+// and remainders, and the flow code compares capacities exactly
+static_assert(std::numeric_limits<REAL>::is_integer && std::numeric_limits<REAL>::is_signed,
+        "REAL must be a signed integer type");
 
 #endif
@@ -1,11 +1,18 @@
 #ifndef _FLOW_SOLVER_HPP_
 #define _FLOW_SOLVER_HPP_
 
-#include "sos-graph.hpp"
+#include <atomic>
+#include <limits>
+#include <utility>
+#include <vector>
 
-class SubmodularIBFS;
-struct SubmodularIBFSParams;
+#include "sos-graph.hpp"
+#include "submodular-ibfs.hpp"
 
+/** Base of the flow solvers, templated like SoSGraph on the capacity
+ * type R
+ */
+template <typename R>
 class FlowSolver {
     public:
         FlowSolver() = default;
@@ -13,7 +20,13 @@ class FlowSolver {
 
         static std::unique_ptr<FlowSolver> GetSolver(const SubmodularIBFSParams& params);
 
-        virtual void Solve(SubmodularIBFS* energy) = 0;
+        virtual void Solve(SubmodularIBFS<R>* energy) = 0;
+
+        // Stats of the last solve, which each solver resets as it starts
+        const FlowStats& Stats() const { return m_stats; }
+
+    protected:
+        FlowStats m_stats;
 
     private:
         // Make non-copyable, non-movable
@@ -23,183 +36,406 @@ class FlowSolver {
         FlowSolver& operator=(FlowSolver&&) = delete;
 };
 
-class BidirectionalIBFS : public FlowSolver {
+template <typename R>
+class BidirectionalIBFS : public FlowSolver<R> {
     public:
         BidirectionalIBFS() { }
         virtual ~BidirectionalIBFS() = default;
 
-        virtual void Solve(SubmodularIBFS* energy);
+        virtual void Solve(SubmodularIBFS<R>* energy);
 
         void IBFS();
         void ComputeMinCut();
 
     private:
         // Typedefs
-        typedef SoSGraph::NodeId NodeId;
-        typedef SoSGraph::CliqueId CliqueId;
-        typedef SoSGraph::Node Node;
-        typedef SoSGraph::NodeState NodeState;
-        typedef SoSGraph::NeighborList NeighborList;
-        typedef SoSGraph::ArcIterator ArcIterator;
-        typedef SoSGraph::NodeQueue NodeQueue;
-        typedef SoSGraph::OrphanList OrphanList;
-        typedef SoSGraph::CliqueVec CliqueVec;
+        typedef typename SoSGraph<R>::NodeId NodeId;
+        typedef typename SoSGraph<R>::CliqueId CliqueId;
+        typedef typename SoSGraph<R>::Node Node;
+        typedef typename SoSGraph<R>::NodeState NodeState;
+        typedef typename SoSGraph<R>::ArcIterator ArcIterator;
+        typedef typename SoSGraph<R>::NodeLayers NodeLayers;
+        typedef typename SoSGraph<R>::OrphanList OrphanList;
+        typedef typename SoSGraph<R>::CliqueVec CliqueVec;
+        using FlowSolver<R>::m_stats;
 
         // Helper functions
-        void Push(ArcIterator& arc, bool forwardArc, REAL delta);
-        void Augment(ArcIterator& arc);
-        void Adopt();
+        // K is the fixed clique size, or 0 (see SoSGraph::FixedCliqueSize)
+        template <int K> void RunIBFS();
+        template <int K> void Push(const ArcIterator& arc, bool forwardArc, R delta);
+        template <int K> void Augment(const ArcIterator& arc);
+        template <int K> void Adopt();
+        template <int K> void GrowLayer();
         void MakeOrphan(NodeId i);
         void RemoveFromLayer(NodeId i);
         void AddToLayer(NodeId i);
-        void AdvanceSearchNode();
+        void AdvanceSearchNode(size_t slot);
+        // The layer being scanned: source layers going forward, sink
+        // layers going backward
+        NodeLayers& SearchLayers() { return m_forward_search ? m_source_layers : m_sink_layers; }
+        int SearchDis() const { return m_forward_search ? m_source_tree_d : m_sink_tree_d; }
 
         void IBFSInit();
 
         /* Algorithm data */ 
 
-        SoSGraph* m_graph;
-        SubmodularIBFS* m_energy;
+        SoSGraph<R>* m_graph;
+        SubmodularIBFS<R>* m_energy;
         // Layers store vertices by distance.
-        std::vector<NodeQueue> m_source_layers;
-        std::vector<NodeQueue> m_sink_layers;
+        NodeLayers m_source_layers;
+        NodeLayers m_sink_layers;
         OrphanList m_source_orphans;
         OrphanList m_sink_orphans;
         int m_source_tree_d;
         int m_sink_tree_d;
-        typedef typename NodeQueue::iterator queue_iterator;
-        queue_iterator m_search_node_iter;
-        queue_iterator m_search_node_end;
+        // Slot of the node being scanned, or NodeLayers::npos once the
+        // layer is done
+        size_t m_search_slot;
         ArcIterator m_search_arc;
         ArcIterator m_search_arc_end;
         bool m_forward_search;
 
-        // Statistics
-
-        double m_totalTime = 0;
-        double m_initTime = 0;
-        double m_augmentTime = 0;
-        double m_adoptTime = 0;
-        size_t m_num_clique_pushes = 0;
+        /* Parallel tree growth (see GrowLayer) */
+
+        // Layers smaller than this are left to the serial search
+        static constexpr size_t kMinParallelLayer = 256;
+        int m_num_threads = 1;
+        // Set for the nodes GrowLayer scanned in full, so that the serial
+        // search skips them
+        std::vector<char> m_grown;
+        // Lowest slot of the layer that reached each node while GrowLayer
+        // runs, or kUnclaimed
+        static constexpr long kUnclaimed = std::numeric_limits<long>::max();
+        std::vector<std::atomic<long>> m_claimed;
+        // Nodes each thread reached, with the slot and the parent arc they
+        // were reached from
+        struct GrownNode {
+            NodeId node;
+            long slot;
+            ArcIterator parent_arc;
+        };
+        std::vector<std::vector<GrownNode>> m_grown_nodes;
+        std::vector<typename SoSGraph<R>::SharedScanScratch> m_scan_scratch;
 };
 
 
-class SourceIBFS : public FlowSolver {
+template <typename R>
+class SourceIBFS : public FlowSolver<R> {
     public:
         SourceIBFS() { }
         virtual ~SourceIBFS() = default;
 
-        virtual void Solve(SubmodularIBFS* energy);
+        virtual void Solve(SubmodularIBFS<R>* energy);
 
         void IBFS();
         void ComputeMinCut();
 
     protected:
         // Typedefs
-        typedef SoSGraph::NodeId NodeId;
-        typedef SoSGraph::CliqueId CliqueId;
-        typedef SoSGraph::Node Node;
-        typedef SoSGraph::NodeState NodeState;
-        typedef SoSGraph::NeighborList NeighborList;
-        typedef SoSGraph::ArcIterator ArcIterator;
-        typedef SoSGraph::NodeQueue NodeQueue;
-        typedef SoSGraph::OrphanList OrphanList;
-        typedef SoSGraph::CliqueVec CliqueVec;
+        typedef typename SoSGraph<R>::NodeId NodeId;
+        typedef typename SoSGraph<R>::CliqueId CliqueId;
+        typedef typename SoSGraph<R>::Node Node;
+        typedef typename SoSGraph<R>::NodeState NodeState;
+        typedef typename SoSGraph<R>::ArcIterator ArcIterator;
+        typedef typename SoSGraph<R>::NodeLayers NodeLayers;
+        typedef typename SoSGraph<R>::OrphanList OrphanList;
+        typedef typename SoSGraph<R>::CliqueVec CliqueVec;
+        using FlowSolver<R>::m_stats;
 
         // Helper functions
-        void Push(ArcIterator& arc, bool forwardArc, REAL delta);
-        void Augment(ArcIterator& arc);
-        void Adopt();
+        // K is the fixed clique size, or 0 (see SoSGraph::FixedCliqueSize)
+        template <int K> void RunIBFS();
+        template <int K> void Push(const ArcIterator& arc, bool forwardArc, R delta);
+        template <int K> void Augment(const ArcIterator& arc);
+        template <int K> void Adopt();
         void MakeOrphan(NodeId i);
         void RemoveFromLayer(NodeId i);
         void AddToLayer(NodeId i);
-        void AdvanceSearchNode();
+        void AdvanceSearchNode(size_t slot);
 
         void IBFSInit();
 
         /* Algorithm data */ 
 
-        SoSGraph* m_graph;
-        SubmodularIBFS* m_energy;
+        SoSGraph<R>* m_graph;
+        SubmodularIBFS<R>* m_energy;
         // Layers store vertices by distance.
-        std::vector<NodeQueue> m_source_layers;
+        NodeLayers m_source_layers;
         OrphanList m_source_orphans;
         int m_source_tree_d;
-        typedef typename NodeQueue::iterator queue_iterator;
-        queue_iterator m_search_node_iter;
-        queue_iterator m_search_node_end;
+        // Slot of the node being scanned, or NodeLayers::npos once the
+        // layer is done
+        size_t m_search_slot;
         ArcIterator m_search_arc;
         ArcIterator m_search_arc_end;
-
-        /* Statistics */
-
-        double m_totalTime = 0;
-        double m_initTime = 0;
-        double m_augmentTime = 0;
-        double m_adoptTime = 0;
-        size_t m_num_clique_pushes = 0;
 };
 
-class ParametricIBFS : public FlowSolver {
+/** Source-tree IBFS, which can also sweep the parametric unaries of the
+ * energy (see SubmodularIBFS::AddParametricUnaryTerm) over increasing
+ * values of lambda, in the manner of Gallo, Grigoriadis and Tarjan.
+ * Raising lambda only raises the source capacities and lowers the sink
+ * ones, so the flow of one lambda is kept as the start of the next, and
+ * the source sides of the cuts are nested.
+ */
+template <typename R>
+class ParametricIBFS : public FlowSolver<R> {
     public:
         ParametricIBFS() { }
         virtual ~ParametricIBFS() = default;
 
-        virtual void Solve(SubmodularIBFS* energy);
+        virtual void Solve(SubmodularIBFS<R>* energy);
+        // See SubmodularIBFS::SolveParametric
+        void SolveParametric(SubmodularIBFS<R>* energy, const std::vector<R>& lambdas, std::vector<size_t>& breakpoints);
 
         void IBFS();
         void ComputeMinCut();
 
     protected:
         // Typedefs
-        typedef SoSGraph::NodeId NodeId;
-        typedef SoSGraph::CliqueId CliqueId;
-        typedef SoSGraph::Node Node;
-        typedef SoSGraph::NodeState NodeState;
-        typedef SoSGraph::NeighborList NeighborList;
-        typedef SoSGraph::ArcIterator ArcIterator;
-        typedef SoSGraph::NodeQueue NodeQueue;
-        typedef SoSGraph::OrphanList OrphanList;
-        typedef SoSGraph::CliqueVec CliqueVec;
+        typedef typename SoSGraph<R>::NodeId NodeId;
+        typedef typename SoSGraph<R>::CliqueId CliqueId;
+        typedef typename SoSGraph<R>::Node Node;
+        typedef typename SoSGraph<R>::NodeState NodeState;
+        typedef typename SoSGraph<R>::ArcIterator ArcIterator;
+        typedef typename SoSGraph<R>::NodeLayers NodeLayers;
+        typedef typename SoSGraph<R>::OrphanList OrphanList;
+        typedef typename SoSGraph<R>::CliqueVec CliqueVec;
+        using FlowSolver<R>::m_stats;
 
         // Helper functions
-        void Push(ArcIterator& arc, bool forwardArc, REAL delta);
-        void Augment(ArcIterator& arc);
-        void Adopt();
+        // K is the fixed clique size, or 0 (see SoSGraph::FixedCliqueSize)
+        template <int K> void RunIBFS();
+        template <int K> void Push(const ArcIterator& arc, bool forwardArc, R delta);
+        template <int K> void Augment(const ArcIterator& arc);
+        template <int K> void Adopt();
         void MakeOrphan(NodeId i);
         void RemoveFromLayer(NodeId i);
         void AddToLayer(NodeId i);
-        void AdvanceSearchNode();
+        void AdvanceSearchNode(size_t slot);
+        // Set the terminal capacities to those at lambda, keeping the flow
+        // feasible
+        void SetLambda(R lambda);
 
         void IBFSInit();
 
         /* Algorithm data */ 
 
-        SoSGraph* m_graph;
-        SubmodularIBFS* m_energy;
+        SoSGraph<R>* m_graph;
+        SubmodularIBFS<R>* m_energy;
         // Layers store vertices by distance.
-        std::vector<NodeQueue> m_source_layers;
+        NodeLayers m_source_layers;
         OrphanList m_source_orphans;
         int m_source_tree_d;
-        typedef typename NodeQueue::iterator queue_iterator;
-        queue_iterator m_search_node_iter;
-        queue_iterator m_search_node_end;
+        // Slot of the node being scanned, or NodeLayers::npos once the
+        // layer is done
+        size_t m_search_slot;
         ArcIterator m_search_arc;
         ArcIterator m_search_arc_end;
 
-        /* Statistics */
+        /* Parametric flow data */
 
-        double m_totalTime = 0;
-        double m_initTime = 0;
-        double m_augmentTime = 0;
-        double m_adoptTime = 0;
-        size_t m_num_clique_pushes = 0;
+        // Terminal capacities without the parametric unaries, restored
+        // after a sweep
+        std::vector<R> m_orig_c_si;
+        std::vector<R> m_orig_c_it;
+};
 
-        /* Parametric flow data */
+/** Excesses IBFS: like BidirectionalIBFS, but on a pseudoflow, with the
+ * nodes left with an excess or a deficit as the roots of the trees.
+ */
+template <typename R>
+class ExcessIBFS : public FlowSolver<R> {
+    public:
+        ExcessIBFS() { }
+        virtual ~ExcessIBFS() = default;
+
+        virtual void Solve(SubmodularIBFS<R>* energy);
+
+        void IBFS();
+        void ComputeMinCut();
+
+    private:
+        // Typedefs
+        typedef typename SoSGraph<R>::NodeId NodeId;
+        typedef typename SoSGraph<R>::CliqueId CliqueId;
+        typedef typename SoSGraph<R>::Node Node;
+        typedef typename SoSGraph<R>::NodeState NodeState;
+        typedef typename SoSGraph<R>::ArcIterator ArcIterator;
+        typedef typename SoSGraph<R>::NodeLayers NodeLayers;
+        typedef typename SoSGraph<R>::OrphanList OrphanList;
+        typedef typename SoSGraph<R>::CliqueVec CliqueVec;
+        using FlowSolver<R>::m_stats;
 
-        std::vector<REAL> m_orig_c_si;
-        std::vector<REAL> m_orig_c_it;
-        std::vector<REAL> m_parametricUnaries;
+        // Helper functions
+        // K is the fixed clique size, or 0 (see SoSGraph::FixedCliqueSize)
+        template <int K> void RunIBFS();
+        template <int K> void Push(const ArcIterator& arc, bool forwardArc, R delta);
+        template <int K> void Augment(const ArcIterator& arc);
+        template <int K> void Adopt();
+        void MakeOrphan(NodeId i);
+        void RemoveFromLayer(NodeId i);
+        void AddToLayer(NodeId i);
+        void AdvanceSearchNode(size_t slot);
+        // The layer being scanned: source layers going forward, sink
+        // layers going backward
+        NodeLayers& SearchLayers() { return m_forward_search ? m_source_layers : m_sink_layers; }
+        int SearchDis() const { return m_forward_search ? m_source_tree_d : m_sink_tree_d; }
+
+        void IBFSInit();
+
+        /* Algorithm data */ 
+
+        SoSGraph<R>* m_graph;
+        SubmodularIBFS<R>* m_energy;
+        // Layers store vertices by distance.
+        NodeLayers m_source_layers;
+        NodeLayers m_sink_layers;
+        OrphanList m_source_orphans;
+        OrphanList m_sink_orphans;
+        // Flow into each node minus flow out. The roots of the source
+        // tree have an excess, those of the sink tree a deficit.
+        std::vector<R> m_excess;
+        int m_source_tree_d;
+        int m_sink_tree_d;
+        // Slot of the node being scanned, or NodeLayers::npos once the
+        // layer is done
+        size_t m_search_slot;
+        ArcIterator m_search_arc;
+        ArcIterator m_search_arc_end;
+        bool m_forward_search;
+};
+
+/** Highest-label push-relabel on the exchange arcs of the cliques, with
+ * global relabelling and the gap heuristic
+ */
+template <typename R>
+class PushRelabel : public FlowSolver<R> {
+    public:
+        PushRelabel() { }
+        virtual ~PushRelabel() = default;
+
+        virtual void Solve(SubmodularIBFS<R>* energy);
+
+        void MaxFlow();
+        void ComputeMinCut();
+
+    private:
+        // Typedefs
+        typedef typename SoSGraph<R>::NodeId NodeId;
+        typedef typename SoSGraph<R>::CliqueId CliqueId;
+        typedef typename SoSGraph<R>::ArcIterator ArcIterator;
+        typedef typename SoSGraph<R>::NodeLayers NodeLayers;
+        using FlowSolver<R>::m_stats;
+
+        // Relabel work, as a fraction of 6n + (number of arcs), after
+        // which we do a global relabel
+        static constexpr double kGlobalRelabelFreq = 0.5;
+
+        // Helper functions
+        // K is the fixed clique size, or 0 (see SoSGraph::FixedCliqueSize)
+        template <int K> void RunPushRelabel();
+        template <int K> void Discharge(NodeId i);
+        template <int K> void Push(const ArcIterator& arc, R delta);
+        template <int K> void Relabel(NodeId i);
+        template <int K> void GlobalRelabel();
+        void Gap(int gap);
+        void Activate(NodeId i);
+
+        void Init();
+
+        /* Algorithm data */
+
+        SoSGraph<R>* m_graph;
+        SubmodularIBFS<R>* m_energy;
+        // Flow into each node minus flow out. Nodes with a deficit act as
+        // the sink.
+        std::vector<R> m_excess;
+        // Nodes below label n, by label, for the gap heuristic
+        NodeLayers m_label_nodes;
+        int m_max_label;
+        // Active nodes by label. May hold stale entries, which are skipped.
+        std::vector<std::vector<NodeId>> m_active;
+        int m_max_active;
+        std::vector<NodeId> m_bfs_queue;
+        double m_global_relabel_work;
+        size_t m_work;
+};
+
+/** Region push-relabel, after Delong and Boykov: the nodes are split into
+ * blocks of consecutive ids, and each block is discharged on its own
+ * thread, with pushes across the blocks done in between.
+ */
+template <typename R>
+class RegionPushRelabel : public FlowSolver<R> {
+    public:
+        RegionPushRelabel() { }
+        virtual ~RegionPushRelabel() = default;
+
+        virtual void Solve(SubmodularIBFS<R>* energy);
+
+        void MaxFlow();
+        void ComputeMinCut();
+
+    private:
+        // Typedefs
+        typedef typename SoSGraph<R>::NodeId NodeId;
+        typedef typename SoSGraph<R>::CliqueId CliqueId;
+        typedef typename SoSGraph<R>::ArcIterator ArcIterator;
+        using FlowSolver<R>::m_stats;
+
+        struct Region {
+            NodeId begin;
+            NodeId end;
+            // Nodes to discharge, first in first out. May hold nodes
+            // that are no longer active, which are skipped.
+            std::vector<NodeId> queue;
+            // Active nodes that can only push out of the region
+            std::vector<NodeId> blocked;
+            // Relabel work this round, and how much the region may do
+            // before it waits for the next global relabel
+            size_t work;
+            double max_work;
+            // Counts of this round, added to m_stats once the regions
+            // are done
+            FlowStats stats;
+        };
+
+        // Relabel work per round, as a fraction of 6n + (number of arcs)
+        // of the region
+        static constexpr double kGlobalRelabelFreq = 0.5;
+
+        // Helper functions
+        // K is the fixed clique size, or 0 (see SoSGraph::FixedCliqueSize)
+        template <int K> void RunRegions();
+        template <int K> void DischargeRegion(Region& region);
+        template <int K> void Discharge(Region& region, NodeId i);
+        template <int K> bool Relabel(Region& region, NodeId i);
+        template <int K> void PushBoundary(NodeId i);
+        template <int K> size_t GlobalRelabel();
+        int RegionOf(NodeId i) const { return i / m_region_size; }
+
+        void Init();
+
+        /* Algorithm data */
+
+        SoSGraph<R>* m_graph;
+        SubmodularIBFS<R>* m_energy;
+        int m_num_threads = 1;
+        int m_num_regions = 1;
+        NodeId m_region_size;
+        std::vector<Region> m_regions;
+        // Whether each clique lies within one region. Only the owner of an
+        // interior clique pushes on it or fills its caches; boundary
+        // cliques are pushed on between the parallel phases.
+        std::vector<char> m_interior;
+        std::vector<CliqueId> m_boundary_cliques;
+        // Flow into each node minus flow out. Nodes with a deficit act as
+        // the sink.
+        std::vector<R> m_excess;
+        // Labels as of the start of the parallel phase, which is what a
+        // region sees of the others while they run
+        std::vector<int> m_snapshot;
+        std::vector<NodeId> m_bfs_queue;
 };
 
 #endif
@@ -138,7 +138,7 @@ void FusionMove<MaxDegree>::FusionStep() {
         }
         case Method::SOS_UB:
         {
-            SubmodularIBFS ibfs;
+            SubmodularIBFS<> ibfs;
             LabelVec proposed(m_labels.size());
             m_pc(m_iter, m_labels, proposed);
             SetupFusionEnergy(proposed, ibfs);
@@ -53,7 +53,7 @@ void AddVars(PBF<REAL, D>& opt, size_t numVars) {
 }
 
 template <>
-void AddVars(SubmodularIBFS& opt, size_t numVars) {
+void AddVars(SubmodularIBFS<>& opt, size_t numVars) {
     opt.AddNode(numVars);
 }
 
@@ -95,7 +95,7 @@ void AddClique(PBF<REAL, D>& opt, int d, const REAL *coeffs, const int *vars) {
 }
 
 template <>
-void AddClique(SubmodularIBFS& opt, int d, const REAL* coeffs, const int* vars) {
+void AddClique(SubmodularIBFS<>& opt, int d, const REAL* coeffs, const int* vars) {
     auto varVec = std::vector<int>{vars, vars+d};
     auto energyTable = std::vector<REAL>{coeffs, coeffs+(1<<d)};
     opt.AddClique(varVec, energyTable);
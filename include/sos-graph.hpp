@@ -7,41 +7,109 @@
  */
 
 #include "energy-common.hpp"
+#include <algorithm>
 #include <array>
 #include <iostream>
+#include <tuple>
 #include <vector>
-#include <boost/intrusive/list.hpp>
 #include <boost/intrusive/slist.hpp>
 #include <boost/intrusive/options.hpp>
 
 #include "submodular-functions.hpp"
+#include "subset-kernels.hpp"
 
 
-/** Graph structure and algorithm for sum-of-submodular IBFS 
+/** Non-owning view of a contiguous range, used to hand out slices of the
+ * clique arena in SoSGraph
  */
-class SoSGraph {
+template <typename T>
+class Span {
+    public:
+        Span() : m_data(nullptr), m_size(0) { }
+        Span(T* data, size_t size) : m_data(data), m_size(size) { }
+
+        T* data() const { return m_data; }
+        size_t size() const { return m_size; }
+        bool empty() const { return m_size == 0; }
+        T& operator[](size_t i) const { return m_data[i]; }
+        T* begin() const { return m_data; }
+        T* end() const { return m_data + m_size; }
+
+    private:
+        T* m_data;
+        size_t m_size;
+};
+
+/** The types of SoSGraph that don't depend on its capacity type, shared by
+ * all of its instantiations (and so by SubmodularIBFSParams)
+ */
+class SoSGraphBase {
     public:
         typedef int NodeId;
         typedef int CliqueId;
-        typedef std::vector<CliqueId> NeighborList;
+        // A subset of the nodes of a clique, as a bitmask over its slots
+        typedef uint32_t Assignment;
+        /** One entry of the node-clique incidence: node i is at position
+         * slot of clique
+         */
+        struct Incidence {
+            CliqueId clique;
+            int slot;
+        };
         enum class NodeState : char {
             S, T, S_orphan, T_orphan, N
         };
-        class IBFSEnergyTableClique;
+        /** The kinds of clique the graph can hold. Each family is stored in
+         * its own array, and operations on an arc switch on the family of
+         * its clique (see CliqueRef).
+         */
+        enum class CliqueFamily : char {
+            table, potts, cardinality, pairwise
+        };
         enum class UBfn {
             chen,
             cvpr14,
         };
-        typedef std::tuple<UBfn, std::string, UpperBoundFunction> UBParam;
+        typedef std::tuple<UBfn, std::string, UpperBoundFunction<REAL>> UBParam;
         static const std::vector<UBParam> ubParamList;
+        struct NormStats {
+            double L1 = 0;
+            double L2 = 0;
+            double LInfty = 0;
+        };
+};
+
+/** Graph structure and algorithm for sum-of-submodular IBFS, with
+ * capacities and energies of type R. Instantiated for int32_t and int64_t:
+ * 32 bits halve the clique tables, when the energies fit.
+ */
+template <typename R = REAL>
+class SoSGraph : public SoSGraphBase {
+    static_assert(std::numeric_limits<R>::is_integer && std::numeric_limits<R>::is_signed,
+            "R must be a signed integer type");
+    public:
+        class IBFSEnergyTableClique;
+        class PottsClique;
+        class CardinalityClique;
+        class PairwiseClique;
 
         SoSGraph()
             : m_num_nodes(0),
             s(-1), 
             t(-1),
-            m_num_cliques(0)
+            m_num_cliques(0),
+            m_node_offsets(1, 0),
+            m_table_offsets(1, 0),
+            m_cardinality_offsets(1, 0)
         { }
 
+        // Cliques point into the graph's arena, so copies would alias the
+        // original. Moving is fine, the arena buffers move with the graph.
+        SoSGraph(const SoSGraph&) = delete;
+        SoSGraph& operator=(const SoSGraph&) = delete;
+        SoSGraph(SoSGraph&&) = default;
+        SoSGraph& operator=(SoSGraph&&) = default;
+
         /** Add n new nodes to the base set V
          *
          * \return Index of first created node
@@ -50,46 +118,86 @@ class SoSGraph {
 
         /** Add weights to s-i and i-t edges, respectively
          */
-        void AddTerminalWeights(NodeId n, REAL sCap, REAL tCap);
+        void AddTerminalWeights(NodeId n, R sCap, R tCap);
 
-        /** Zero the capacities on the s-i and i-t edges
+        /** Zero the capacities on the s-i and i-t edges. The flow on them
+         * is left for RepairFlow, and cleared by ResetFlow.
          */
         void ClearTerminals();
         
         // Add Clique defined by nodes and energy table given
-        IBFSEnergyTableClique& AddClique(const std::vector<NodeId>& nodes, const std::vector<REAL>& energyTable);
+        IBFSEnergyTableClique& AddClique(const std::vector<NodeId>& nodes, const std::vector<R>& energyTable);
+        // Same, for a clique of k nodes and an energy table of 2^k entries
+        // stored anywhere
+        IBFSEnergyTableClique& AddClique(const NodeId* nodes, size_t k, const R* energyTable);
+        /** Add a Potts clique, with energy lambda unless all k nodes have
+         * the same label, and 0 if they do. lambda must be >= 0. Stores no
+         * table, so k may exceed 31.
+         */
+        PottsClique& AddPottsClique(const NodeId* nodes, size_t k, R lambda);
+        /** Add a clique whose energy depends only on how many of its k nodes
+         * are labeled 1: h[c] for c of them, where h has k+1 entries. h must
+         * be concave, with h[0] = 0. Stores no table, so k may exceed 31.
+         */
+        CardinalityClique& AddCardinalityClique(const NodeId* nodes, size_t k, const R* h);
+        /** Add a submodular pairwise term on nodes i and j, as a single arc
+         * with a residual capacity each way. The energies are laid out as
+         * in an energy table on {i, j}, so E01 is the energy with only i
+         * labeled 1. Requires E01 + E10 >= E00 + E11.
+         */
+        PairwiseClique& AddPairwiseClique(NodeId i, NodeId j, R E00, R E01, R E10, R E11);
 
-        /* Clique: abstract base class for user-defined clique functions
+        /** Reserve space for num_nodes nodes and num_cliques cliques, with
+         * num_clique_nodes nodes and num_table_entries energy table entries
+         * over all cliques. Saves regrowing the arena (and re-pointing
+         * every clique into it) while adding cliques.
+         */
+        void Reserve(NodeId num_nodes, CliqueId num_cliques, size_t num_clique_nodes, size_t num_table_entries);
+
+        /** Optional pass before Finalize, shrinking the set of cliques:
+         *  - table cliques on the same set of nodes (in any order) are
+         *    merged into one, summing their tables, and likewise for
+         *    pairwise cliques;
+         *  - cliques with modular energy, c + the sum of a weight per node
+         *    in S, are folded into the terminal weights and dropped.
+         * Cliques are re-added family by family, so clique ids, indices
+         * and references all change.
          *
-         * Clique stores the list of nodes associated with a clique.
-         * Actual functionality is provided by the user writing a derived
-         * class with Clique as the base, and which implements the
-         * ComputeEnergy and ExchangeCapacity functions
+         * \return The constant part of the folded energy, which the
+         * caller must add to its own constant term
+         */
+        R CompactCliques();
+
+        /** Finish construction: add the source and sink, and build the
+         * node-clique incidence in one pass. No nodes or cliques can be
+         * added afterwards. The first ResetFlow does this if needed.
+         */
+        void Finalize();
+        bool Finalized() const { return s != -1; }
+
+        /* Clique: the nodes of a clique and its reparameterization
+         * variables alpha_Ci, one per node.
+         *
+         * Cliques don't own any storage: all of their arrays are slices of
+         * the arena kept by the SoSGraph that created them (see AddClique).
          */
         class Clique {
             public:
-            typedef std::vector<NodeId> NodeVec;
-            Clique() : m_nodes(), m_alpha_Ci() { }
-            Clique(const NodeVec& nodes)
-                : m_nodes(nodes),
-                m_alpha_Ci(nodes.size(), 0)
-            { }
-            ~Clique() = default;
-
-            // Returns the energy of the given labeling for this clique function
-            virtual REAL ComputeEnergy(const std::vector<int>& labels) const = 0;
-
-            const NodeVec& Nodes() const { return m_nodes; }
-            size_t Size() const { return m_nodes.size(); }
-            std::vector<REAL>& AlphaCi() { return m_alpha_Ci; }
-            const std::vector<REAL>& AlphaCi() const { return m_alpha_Ci; }
+            Clique() : m_nodes(nullptr), m_alpha_Ci(nullptr), m_size(0) { }
+
+            Span<const NodeId> Nodes() const { return {m_nodes, m_size}; }
+            size_t Size() const { return m_size; }
+            Span<R> AlphaCi() { return {m_alpha_Ci, m_size}; }
+            Span<const R> AlphaCi() const { return {m_alpha_Ci, m_size}; }
             size_t GetIndex(NodeId i) const {
-                return std::find(this->m_nodes.begin(), this->m_nodes.end(), i) - this->m_nodes.begin();
+                return std::find(m_nodes, m_nodes + m_size, i) - m_nodes;
             }
 
             protected:
-            NodeVec m_nodes; // The list of nodes in the clique
-            std::vector<REAL> m_alpha_Ci; // The reparameterization variables for this clique
+            friend class SoSGraph;
+            const NodeId* m_nodes; // The list of nodes in the clique
+            R* m_alpha_Ci; // The reparameterization variables for this clique
+            size_t m_size;
 
         };
         /*
@@ -97,43 +205,293 @@ class SoSGraph {
          */
         class IBFSEnergyTableClique : public Clique {
             public:
-                typedef uint32_t Assignment;
-
-                IBFSEnergyTableClique() : Clique(), m_energy(), m_alpha_energy(), m_min_tight_set() { }
-                IBFSEnergyTableClique(const std::vector<NodeId>& nodes,
-                                  const std::vector<REAL>& energy)
-                    : Clique(nodes),
-                    m_energy(energy),
-                    m_alpha_energy(energy),
-                    m_min_tight_set(nodes.size(), (1 << nodes.size()) - 1)
-                { 
-                    ASSERT(nodes.size() <= 31); 
-                }
+                IBFSEnergyTableClique()
+                    : Clique(),
+                    m_energy(nullptr),
+                    m_alpha_energy(nullptr),
+                    m_min_tight_set(nullptr),
+                    m_tight_set_transpose(nullptr),
+                    m_min_tight_set_valid(false),
+                    m_capacities(nullptr),
+                    m_known_capacities(nullptr),
+                    m_bounded_energy(nullptr),
+                    m_psi(nullptr),
+                    m_dirty(true),
+                    m_touched(false),
+                    m_fixed_set(0)
+                { }
+
+                R ComputeEnergy(const std::vector<int>& labels) const;
+                R ComputeAlphaEnergy(const std::vector<int>& labels) const;
 
-                virtual REAL ComputeEnergy(const std::vector<int>& labels) const;
-                REAL ComputeAlphaEnergy(const std::vector<int>& labels) const;
-                REAL ExchangeCapacity(size_t u_idx, size_t v_idx) const;
+                /* The hot-path operations below are templated on the clique
+                 * size K. K = 0 reads the size at runtime; any other K must
+                 * equal Size(), and lets the compiler unroll the subset
+                 * loops. See SoSGraph::FixedCliqueSize().
+                 */
+                template <int K = 0>
+                R ExchangeCapacity(size_t u_idx, size_t v_idx) const;
+                template <int K = 0>
                 bool NonzeroCapacity(size_t u_idx, size_t v_idx) const;
-                void NormalizeEnergy(std::vector<REAL>& psi, REAL& constantTerm);
+                template <int K = 0>
+                void Push(size_t u_idx, size_t v_idx, R delta);
+                template <int K = 0>
+                void ComputeMinTightSets() const;
+                // The same, but into min_tight_set and transpose (Size()
+                // entries each) rather than the cache
+                template <int K = 0>
+                void ComputeMinTightSets(Assignment* min_tight_set, Assignment* transpose) const;
+                /* Residual arcs at slot u_idx, as a bitmask over the slots
+                 * of the clique. With forwardArc, bit v is set iff u -> v
+                 * has nonzero capacity; otherwise iff v -> u does. The arc
+                 * from u_idx to itself is never included.
+                 */
+                template <int K = 0>
+                Assignment ResidualArcs(size_t u_idx, bool forwardArc) const;
+                // First slot v >= from with a residual arc at u_idx (as
+                // for ResidualArcs), or Size() if there is none
+                template <int K = 0>
+                size_t NextResidual(size_t u_idx, size_t from, bool forwardArc) const;
+                // Mark the min tight sets and cached exchange capacities as
+                // stale, they get recomputed when next asked for. Needed
+                // after writing to AlphaEnergy() directly.
+                void InvalidateCaches();
+                // Getting the table for writing marks the clique dirty, so
+                // that the next UpperBoundCliques bounds it afresh
+                Span<R> EnergyTable() { m_dirty = true; return {m_energy, TableSize()}; }
+                Span<const R> EnergyTable() const { return {m_energy, TableSize()}; }
+                // Whether the table changed since UpperBoundCliques last
+                // bounded it
+                bool Dirty() const { return m_dirty; }
+                // Whether the flow moved off the start since the last
+                // ResetFlow or UpperBoundCliques, and so needs restoring
+                bool Touched() const { return m_touched; }
+                // Getting alpha for writing marks the clique touched
+                Span<R> AlphaEnergy() { m_touched = true; return {m_alpha_energy, TableSize()}; }
+                Span<const R> AlphaEnergy() const { return {m_alpha_energy, TableSize()}; }
+
+                void ResetAlpha();
+
+            protected:
+                friend class SoSGraph;
+
+                // Below this size the subset loops are too short to be
+                // worth handing to the vectorized kernels
+                static const size_t kMinKernelSize = 5;
+
+                // Insert zero bits into t at the positions given by
+                // lo_mask = 2^lo - 1 and hi_mask = 2^hi - 1 (lo < hi). As t
+                // runs over [0, 2^(n-2)) this yields every subset of [0, n)
+                // without lo or hi.
+                static Assignment SpliceZeroBits(Assignment t, Assignment lo_mask, Assignment hi_mask) {
+                    t = ((t & ~lo_mask) << 1) | (t & lo_mask);
+                    return ((t & ~hi_mask) << 1) | (t & hi_mask);
+                }
+
+                template <int K>
+                size_t FixedSize() const {
+                    ASSERT(K == 0 || static_cast<size_t>(K) == this->m_size);
+                    return (K == 0) ? this->m_size : K;
+                }
+
+                size_t TableSize() const { return size_t(1) << this->m_size; }
+
+                // ExchangeCapacity, bypassing the capacity cache
+                template <int K>
+                R ComputeExchangeCapacity(size_t u_idx, size_t v_idx) const;
+
+                R* m_energy;
+                R* m_alpha_energy;
+                // Cache of the smallest tight set containing each node,
+                // maintained lazily (see InvalidateCaches)
+                Assignment* m_min_tight_set;
+                // The same k x k bit matrix transposed: bit u of
+                // m_tight_set_transpose[v] is bit v of m_min_tight_set[u]
+                Assignment* m_tight_set_transpose;
+                mutable bool m_min_tight_set_valid;
+                // Optional k x k cache of exchange capacities, row major.
+                // Entry (u, v) is valid iff bit v of m_known_capacities[u]
+                // is set. Null unless enabled with SetCapacityCache.
+                R* m_capacities;
+                Assignment* m_known_capacities;
+                // Result of the last UpperBoundCliques: the bounded and
+                // normalized table and its psi, valid unless m_dirty, for
+                // the fixed nodes in m_fixed_set. Null until the first one.
+                R* m_bounded_energy;
+                R* m_psi;
+                bool m_dirty;
+                bool m_touched;
+                Assignment m_fixed_set;
+                NormStats m_norm_stats;
+
+        };
+        /*
+         * PottsClique: energy lambda if the nodes of the clique don't all
+         * have the same label, 0 otherwise.
+         *
+         * Every set S with u in S and v not in S is a proper nonempty
+         * subset, so the exchange capacity from u to v is lambda - alpha_u
+         * minus the sum of the positive alpha_i over the rest of the
+         * clique. Keeping that sum up to date makes capacities O(1).
+         */
+        class PottsClique : public Clique {
+            public:
+                PottsClique()
+                    : Clique(),
+                    m_lambda(0),
+                    m_positive_alpha(0)
+                { }
+
+                R Lambda() const { return m_lambda; }
+                R ComputeEnergy(const std::vector<int>& labels) const;
+
+                R ExchangeCapacity(size_t u_idx, size_t v_idx) const;
+                bool NonzeroCapacity(size_t u_idx, size_t v_idx) const {
+                    return ExchangeCapacity(u_idx, v_idx) > 0;
+                }
+                void Push(size_t u_idx, size_t v_idx, R delta);
+                size_t NextResidual(size_t u_idx, size_t from, bool forwardArc) const;
+
+                void ResetAlpha();
+
+            protected:
+                friend class SoSGraph;
+
+                static R Positive(R a) { return std::max(a, R(0)); }
+
+                R m_lambda;
+                // Sum of max(alpha_i, 0) over the clique
+                R m_positive_alpha;
+        };
+        /*
+         * CardinalityClique: energy h(c) when c of the nodes of the clique
+         * are labeled 1, for a concave h with h(0) = 0. Robust P^n cliques
+         * are the truncated linear case.
+         *
+         * The cheapest set S of a given size with u in S and v not in S
+         * holds the largest alpha_i, so the exchange capacity is a minimum
+         * over the k sizes once the slots are sorted by alpha. Sorting is
+         * redone lazily after a push, and the minima over sizes are cached
+         * for one source slot at a time, which makes every capacity about
+         * that slot O(1).
+         */
+        class CardinalityClique : public Clique {
+            public:
+                CardinalityClique()
+                    : Clique(),
+                    m_h(nullptr),
+                    m_order(nullptr),
+                    m_position(nullptr),
+                    m_prefix_min(nullptr),
+                    m_suffix_min(nullptr),
+                    m_sorted(false),
+                    m_cached_slot(kNoSlot)
+                { }
 
-                void Push(size_t u_idx, size_t v_idx, REAL delta);
-                void ComputeMinTightSets();
-                std::vector<REAL>& EnergyTable() { return m_energy; }
-                const std::vector<REAL>& EnergyTable() const { return m_energy; }
-                std::vector<REAL>& AlphaEnergy() { return m_alpha_energy; }
-                const std::vector<REAL>& AlphaEnergy() const { return m_alpha_energy; }
+                // h(0), ..., h(k)
+                Span<const R> CardinalityEnergy() const { return {m_h, this->m_size + 1}; }
+                R ComputeEnergy(const std::vector<int>& labels) const;
+
+                R ExchangeCapacity(size_t u_idx, size_t v_idx) const;
+                bool NonzeroCapacity(size_t u_idx, size_t v_idx) const {
+                    return ExchangeCapacity(u_idx, v_idx) > 0;
+                }
+                void Push(size_t u_idx, size_t v_idx, R delta);
+                size_t NextResidual(size_t u_idx, size_t from, bool forwardArc) const;
+                // Needed after writing to AlphaCi() directly
+                void InvalidateCaches() {
+                    m_sorted = false;
+                    m_cached_slot = kNoSlot;
+                }
 
                 void ResetAlpha();
 
             protected:
-                std::vector<REAL> m_energy;
-                std::vector<REAL> m_alpha_energy;
-                std::vector<Assignment> m_min_tight_set;
+                friend class SoSGraph;
+
+                static const size_t kNoSlot = size_t(-1);
 
+                // Sort the slots by decreasing alpha if needed, and fill
+                // in the minima below for source slot u_idx
+                void PrepareSlot(size_t u_idx) const;
+                // Position of slot v_idx in the order with u_idx left out
+                size_t QueuePosition(size_t u_idx, size_t v_idx) const {
+                    const size_t p = m_position[v_idx];
+                    return p - (p > m_position[u_idx]);
+                }
+
+                R* m_h;
+                // Slots by decreasing alpha, and the inverse permutation
+                uint32_t* m_order;
+                uint32_t* m_position;
+                // With Q the order without m_cached_slot, and Pre(j) the
+                // sum of alpha over the first j slots of Q:
+                //   m_prefix_min[p] = min over j <= p of h(j+1) - Pre(j)
+                //   m_suffix_min[p] = min over p < j <= k-2 of h(j+1) - Pre(j+1)
+                // so the capacities between u and the slot at position p
+                // of Q only need these two entries.
+                R* m_prefix_min;
+                R* m_suffix_min;
+                mutable bool m_sorted;
+                mutable size_t m_cached_slot;
+        };
+        /*
+         * PairwiseClique: a submodular term on two nodes, stored as an arc
+         * in the style of Boykov-Kolmogorov. The only set holding one slot
+         * and not the other is that slot alone, so the exchange capacity
+         * from slot u is the reparameterized energy of {u}, kept directly
+         * as m_residual[u].
+         */
+        class PairwiseClique : public Clique {
+            public:
+                PairwiseClique()
+                    : Clique(),
+                    m_energy{0, 0, 0, 0},
+                    m_residual{0, 0}
+                { }
+
+                Span<const R> EnergyTable() const { return {m_energy, 4}; }
+                R ComputeEnergy(const std::vector<int>& labels) const {
+                    return m_energy[(labels[this->m_nodes[0]] == 1) | ((labels[this->m_nodes[1]] == 1) << 1)];
+                }
+
+                R ExchangeCapacity(size_t u_idx, size_t v_idx) const {
+                    ASSERT(u_idx < 2 && v_idx == 1 - u_idx);
+                    return m_residual[u_idx];
+                }
+                bool NonzeroCapacity(size_t u_idx, size_t v_idx) const {
+                    return ExchangeCapacity(u_idx, v_idx) > 0;
+                }
+                void Push(size_t u_idx, size_t v_idx, R delta) {
+                    ASSERT(u_idx < 2 && v_idx == 1 - u_idx);
+                    this->m_alpha_Ci[u_idx] += delta;
+                    this->m_alpha_Ci[v_idx] -= delta;
+                    m_residual[u_idx] -= delta;
+                    m_residual[v_idx] += delta;
+                }
+                size_t NextResidual(size_t u_idx, size_t from, bool forwardArc) const {
+                    ASSERT(u_idx < 2);
+                    const size_t v_idx = 1 - u_idx;
+                    return (from <= v_idx && m_residual[forwardArc ? u_idx : v_idx] > 0) ? v_idx : 2;
+                }
+
+                void ResetAlpha();
+
+            protected:
+                friend class SoSGraph;
+
+                // Recompute the residuals from the energies and alpha
+                void UpdateResiduals() {
+                    m_residual[0] = m_energy[1] - m_energy[0] - this->m_alpha_Ci[0];
+                    m_residual[1] = m_energy[2] - m_energy[0] - this->m_alpha_Ci[1];
+                }
+
+                R m_energy[4];
+                R m_residual[2];
         };
         struct ArcIterator {
             NodeId source;
-            NeighborList::iterator cIter;
+            const Incidence* cIter;
             int cliqueIdx;
             int cliqueSize;
             SoSGraph* graph;
@@ -150,68 +508,150 @@ class SoSGraph {
             }
 
             ArcIterator& operator++() {
-                //ASSERT(*cIter < static_cast<int>(graph->m_cliques.size()));
                 cliqueIdx++;
-                if (cliqueIdx == cliqueSize) {
-                    cliqueIdx = 0;
-                    cIter++;
-                    if (cIter != graph->m_neighbors[source].end())
-                        cliqueSize = graph->m_cliques[*cIter].Size();
-                    else
-                        cliqueSize = 0;
-                }
-                //ASSERT(cIter == graph->m_neighbors[source].end() || *cIter < static_cast<int>(graph->m_cliques.size()));
-                //ASSERT(cIter == graph->m_neighbors[source].end() || cliqueIdx < static_cast<int>(graph->m_cliques[*cIter].Nodes().size()));
+                if (cliqueIdx == cliqueSize)
+                    NextClique();
                 return *this;
             }
             NodeId Source() const {
                 return source;
             }
             NodeId Target() const {
-                //ASSERT(*cIter < static_cast<int>(graph->m_cliques.size()));
-                //ASSERT(cliqueIdx < static_cast<int>(graph->m_cliques[*cIter].Nodes().size()));
-                return graph->m_cliques[*cIter].Nodes()[cliqueIdx];
+                return graph->m_clique_nodes[graph->m_node_offsets[cIter->clique] + cliqueIdx];
             }
-            int SourceIdx() const { return graph->m_cliques[*cIter].GetIndex(source); }
+            int SourceIdx() const { return cIter->slot; }
             int TargetIdx() const { return cliqueIdx; }
-            CliqueId cliqueId() const { return *cIter; }
+            CliqueId cliqueId() const { return cIter->clique; }
+            // Skip the rest of the current clique
+            void NextClique() {
+                cliqueIdx = 0;
+                cIter++;
+                if (cIter != graph->IncidenceEnd(source))
+                    cliqueSize = graph->CliqueSize(cIter->clique);
+                else
+                    cliqueSize = 0;
+            }
             ArcIterator Reverse() const {
-                auto newSource = Target();
-                auto newCIter = std::find(graph->m_neighbors[newSource].begin(), graph->m_neighbors[newSource].end(), *cIter);
-                auto newCliqueIdx = graph->GetCliques()[*newCIter].GetIndex(source);
-                return {newSource, newCIter, static_cast<int>(newCliqueIdx), static_cast<int>(graph->m_cliques[*newCIter].Size()), graph};
+                const size_t target_entry = graph->m_node_offsets[cIter->clique] + cliqueIdx;
+                auto newSource = graph->m_clique_nodes[target_entry];
+                auto newCIter = graph->m_incidence.data() + graph->m_slot_incidence[target_entry];
+                return {newSource, newCIter, cIter->slot, cliqueSize, graph};
             }
         };
 
-        typedef boost::intrusive::list_base_hook<boost::intrusive::link_mode<boost::intrusive::normal_link>> ListHook;
         typedef boost::intrusive::slist_base_hook<boost::intrusive::link_mode<boost::intrusive::normal_link>> OrphanListHook;
-        struct Node : public ListHook, OrphanListHook {
+        /* Queue entry for a node, linked into the orphan lists of the
+         * solvers. The rest of the per-node state lives in parallel
+         * arrays (see State, Dis and ParentArc), so that scanning and
+         * adoption don't drag the list links through the cache.
+         */
+        struct Node : public OrphanListHook {
             NodeId id;
-            NodeState state;
-            int dis;
-            ArcIterator parent_arc;
-            NodeId parent;
-            NeighborList cliques;
-            Node(NodeId _id) 
-                : id(_id)
-                , state(NodeState::N)
-                , dis(std::numeric_limits<int>::max())
-                , parent_arc()
-                , cliques() { }
+            Node(NodeId _id) : id(_id) { }
         };
 
-        typedef boost::intrusive::list<Node> NodeQueue;
         typedef boost::intrusive::slist<Node, boost::intrusive::base_hook<OrphanListHook>, boost::intrusive::cache_last<true>> OrphanList;
 
+        /** Bucket queue of nodes by distance, for the layers of the
+         * solvers. Each layer is a contiguous array of node ids, so a layer
+         * scan is a sequential read.
+         *
+         * Removal is lazy: a node remembers the layer and slot it was last
+         * added at, and entries that don't match are stale and get skipped
+         * (see NextLive). Reset keeps the arrays around, so repeated solves
+         * don't allocate.
+         */
+        class NodeLayers {
+            public:
+                static const size_t npos = static_cast<size_t>(-1);
+
+                /** Remove every node, and make room for layers
+                 * [0, num_layers) and node ids [0, num_ids)
+                 */
+                void Reset(int num_layers, NodeId num_ids) {
+                    for (int d = 0; d <= m_max_layer; ++d)
+                        m_layers[d].clear();
+                    if (static_cast<int>(m_layers.size()) < num_layers)
+                        m_layers.resize(num_layers);
+                    m_live.assign(num_layers, 0);
+                    m_layer.assign(num_ids, -1);
+                    m_slot.resize(num_ids);
+                    m_max_layer = -1;
+                }
+                void Add(NodeId i, int d) {
+                    ASSERT(d >= 0 && d < static_cast<int>(m_live.size()));
+                    ASSERT(m_layer[i] == -1);
+                    m_layer[i] = d;
+                    m_slot[i] = m_layers[d].size();
+                    m_layers[d].push_back(i);
+                    m_live[d]++;
+                    m_max_layer = std::max(m_max_layer, d);
+                }
+                void Remove(NodeId i) {
+                    ASSERT(m_layer[i] != -1);
+                    m_live[m_layer[i]]--;
+                    m_layer[i] = -1;
+                }
+                /** Remove every node in layer d */
+                void Clear(int d) {
+                    for (NodeId i : m_layers[d]) {
+                        if (m_layer[i] == d)
+                            m_layer[i] = -1;
+                    }
+                    m_layers[d].clear();
+                    m_live[d] = 0;
+                }
+                bool Empty(int d) const { return m_live[d] == 0; }
+                /** Number of entries in layer d, stale ones included. Slots
+                 * past the end of a layer are filled in order by Add.
+                 */
+                size_t Size(int d) const { return m_layers[d].size(); }
+                NodeId At(int d, size_t slot) const { return m_layers[d][slot]; }
+                bool Live(int d, size_t slot) const {
+                    NodeId i = m_layers[d][slot];
+                    return m_layer[i] == d && m_slot[i] == slot;
+                }
+                /** First live slot of layer d at or after slot, or Size(d) */
+                size_t NextLive(int d, size_t slot) const {
+                    while (slot < m_layers[d].size() && !Live(d, slot))
+                        ++slot;
+                    return slot;
+                }
+                /** Highest layer anything was added to since Reset */
+                int MaxLayer() const { return m_max_layer; }
+
+            private:
+                std::vector<std::vector<NodeId>> m_layers;
+                std::vector<int> m_live;
+                std::vector<int> m_layer;
+                std::vector<size_t> m_slot;
+                int m_max_layer = -1;
+        };
+
         ArcIterator ArcsBegin(NodeId i) {
-            auto cIter = m_neighbors[i].begin();
-            if (cIter == m_neighbors[i].end())
+            auto cIter = IncidenceBegin(i);
+            if (cIter == IncidenceEnd(i))
                 return ArcsEnd(i);
-            return {i, cIter, 0, static_cast<int>(m_cliques[*cIter].Size()), this};
+            return {i, cIter, 0, CliqueSize(cIter->clique), this};
         }
         ArcIterator ArcsEnd(NodeId i) {
-            auto& neighborList = m_neighbors[i];
-            return {i, neighborList.end(), 0, 0, this};
+            return {i, IncidenceEnd(i), 0, 0, this};
+        }
+
+        /** The cliques containing node i, as a contiguous range of
+         * Incidence entries. Only available once the graph has been
+         * finalized by ResetFlow.
+         */
+        const Incidence* IncidenceBegin(NodeId i) const {
+            ASSERT(s != -1);
+            return m_incidence.data() + m_incidence_offsets[i];
+        }
+        const Incidence* IncidenceEnd(NodeId i) const {
+            ASSERT(s != -1);
+            return m_incidence.data() + m_incidence_offsets[i+1];
+        }
+        Span<const Incidence> Incidences(NodeId i) const {
+            return {IncidenceBegin(i), static_cast<size_t>(IncidenceEnd(i) - IncidenceBegin(i))};
         }
 
         typedef std::vector<IBFSEnergyTableClique> CliqueVec;
@@ -221,183 +661,1020 @@ class SoSGraph {
         NodeId GetT() const { return t; }
         Node& node(NodeId i) { return m_nodes[i]; }
         const Node& node(NodeId i) const { return m_nodes[i]; }
-        IBFSEnergyTableClique& clique(CliqueId c) { return m_cliques[c]; }
-        const IBFSEnergyTableClique& clique(CliqueId c) const { return m_cliques[c]; }
-        const std::vector<REAL>& GetC_si() const { return m_c_si; }
-        const std::vector<REAL>& GetC_it() const { return m_c_it; }
-        const std::vector<REAL>& GetPhi_si() const { return m_phi_si; }
-        const std::vector<REAL>& GetPhi_it() const { return m_phi_it; }
+        NodeState& State(NodeId i) { return m_state[i]; }
+        NodeState State(NodeId i) const { return m_state[i]; }
+        int& Dis(NodeId i) { return m_dis[i]; }
+        int Dis(NodeId i) const { return m_dis[i]; }
+
+        /** Arc from node i to its parent in the search tree, or ArcsEnd(i)
+         * if the parent is the source or sink.
+         */
+        ArcIterator ParentArc(NodeId i);
+        void SetParentArc(NodeId i, const ArcIterator& arc);
+        /** Parent of node i in the search tree. Derived from ParentArc, with
+         * the terminal on i's side of the cut if i has no parent arc.
+         */
+        NodeId Parent(NodeId i) const;
+        /** Where clique c is stored: its family, and its index in the array
+         * of that family (GetCliques(), GetPottsCliques(),
+         * GetCardinalityCliques(), GetPairwiseCliques())
+         */
+        struct CliqueRef {
+            CliqueFamily family;
+            CliqueId index;
+        };
+        CliqueRef Ref(CliqueId c) const { return m_clique_refs[c]; }
+        CliqueFamily Family(CliqueId c) const { return m_clique_refs[c].family; }
+        int CliqueSize(CliqueId c) const { return m_node_offsets[c+1] - m_node_offsets[c]; }
+        Span<const NodeId> CliqueNodes(CliqueId c) const {
+            return {m_clique_nodes.data() + m_node_offsets[c], static_cast<size_t>(CliqueSize(c))};
+        }
+        // Explicit table clique with id c, which must be of that family
+        IBFSEnergyTableClique& clique(CliqueId c) {
+            ASSERT(Family(c) == CliqueFamily::table);
+            return m_cliques[m_clique_refs[c].index];
+        }
+        const IBFSEnergyTableClique& clique(CliqueId c) const {
+            ASSERT(Family(c) == CliqueFamily::table);
+            return m_cliques[m_clique_refs[c].index];
+        }
+        const std::vector<R>& GetC_si() const { return m_c_si; }
+        const std::vector<R>& GetC_it() const { return m_c_it; }
+        const std::vector<R>& GetPhi_si() const { return m_phi_si; }
+        const std::vector<R>& GetPhi_it() const { return m_phi_it; }
+        // Number of cliques of all families
         CliqueId GetNumCliques() const { return m_num_cliques; }
+        // The explicit table cliques
         const CliqueVec& GetCliques() const { return m_cliques; }
         CliqueVec& GetCliques() { return m_cliques; }
-        const std::vector<NeighborList>& GetNeighbors() const { return m_neighbors; }
-        std::vector<Node>& GetNodes() { return m_nodes; }
-        const std::vector<Node>& GetNodes() const { return m_nodes; }
+        const std::vector<PottsClique>& GetPottsCliques() const { return m_potts_cliques; }
+        const std::vector<CardinalityClique>& GetCardinalityCliques() const { return m_cardinality_cliques; }
+        const std::vector<PairwiseClique>& GetPairwiseCliques() const { return m_pairwise_cliques; }
+        // Sum of the energies of all cliques, of every family
+        R ComputeCliqueEnergy(const std::vector<int>& labels) const;
 
-        REAL ResCap(const ArcIterator& arc, bool forwardArc);
+        /** Cache exchange capacities per clique, so repeated ResCap queries
+         * on a clique that hasn't been pushed on since are O(1). Costs
+         * k^2 words per clique of size k. Takes effect on the next
+         * ResetFlow.
+         */
+        void SetCapacityCache(bool enable) { m_cache_capacities = enable; }
+        bool CapacityCacheEnabled() const { return m_cache_capacities; }
+
+        /** If every explicit table clique has the same size, and that size
+         * is one of the sizes we generate specialized code for (2, 3, 4 or
+         * 9), returns it. Otherwise returns 0. Other families ignore K.
+         * Solvers branch on this once per solve, and pass it as the K
+         * parameter of ResCap, NonzeroCap and Push.
+         */
+        int FixedCliqueSize() const;
+
+        template <int K = 0>
+        R ResCap(const ArcIterator& arc, bool forwardArc);
+        template <int K = 0>
         bool NonzeroCap(const ArcIterator& arc, bool forwardArc);
-        void Push(ArcIterator& arc, bool forwardArc, REAL delta);
+        template <int K = 0>
+        void Push(const ArcIterator& arc, bool forwardArc, R delta);
+        /** Advance arc to the first arc at or after it with nonzero
+         * capacity (in the given direction), skipping arcs back to the
+         * source node itself. Saturated cliques are skipped whole.
+         *
+         * \return false if there is no such arc, and arc is then at
+         * ArcsEnd(arc.Source())
+         */
+        template <int K = 0>
+        bool NextResidualArc(ArcIterator& arc, bool forwardArc);
+        /** Scratch space for NextResidualArcShared, one per thread. Reset
+         * it whenever flow may have been pushed since it was last used.
+         */
+        struct SharedScanScratch {
+            CliqueId clique = -1;
+            std::vector<Assignment> tight_sets;
+            void Reset() { clique = -1; }
+        };
+        /** NextResidualArc for several threads at once. It only reads the
+         * graph, so it's safe as long as nothing pushes flow meanwhile:
+         * table cliques whose min tight sets aren't cached get them
+         * computed into scratch instead. Cardinality cliques can't be
+         * queried without filling their cache, so there mustn't be any
+         * (see SharedScanSafe).
+         */
+        template <int K = 0>
+        bool NextResidualArcShared(ArcIterator& arc, bool forwardArc, SharedScanScratch& scratch) const;
+        bool SharedScanSafe() const { return m_cardinality_cliques.empty(); }
+        /** Fill the caches that NextResidualArc reads for clique c, so
+         * that several threads can scan its arcs at once until the next
+         * push on it. Not for cardinality cliques, which fill theirs
+         * query by query (see SharedScanSafe).
+         */
+        template <int K = 0>
+        void PrepareResidualQueries(CliqueId c);
 
+        /** Take all flow off the graph, for UpperBoundCliques to start
+         * again. Table cliques go back to their last bound, or to their
+         * tables before the first one, and only those pushed on since
+         * cost any time.
+         */
         void ResetFlow();
-        typedef void(*BoundFn)(int, const std::vector<REAL>&, std::vector<REAL>&);
-        struct NormStats {
-            double L1 = 0;
-            double L2 = 0;
-            double LInfty = 0;
-        };
+        // Clear the search trees: every node goes back to state N
+        void ResetTrees();
+        typedef UpperBoundFunction<R> BoundFn;
         template <BoundFn fn>
         void UpperBoundCliques(const std::vector<bool>& fixedVars, NormStats* stats);
         void UpperBoundCliques(UBfn ub, NormStats* stats = 0);
         void UpperBoundCliques(UBfn ub, const std::vector<bool>& fixedVars, const std::vector<int>& labels, NormStats* stats = 0);
+        /** Whether the graph holds a feasible flow, which it does from
+         * UpperBoundCliques until the next ResetFlow or DropFlow
+         */
+        bool HasFlow() const { return m_has_flow; }
+        // Mark the flow as no longer feasible, e.g. after merging clique
+        // flows without their terminal flows (see MergeComponentFlow)
+        void DropFlow() { m_has_flow = false; }
+        /** Make the flow of the last solve feasible again after the
+         * capacities changed, instead of starting over with ResetFlow and
+         * UpperBoundCliques, as in the dynamic graph cuts of Kohli and
+         * Torr. Only table cliques whose tables or fixed nodes changed are
+         * bounded again, and only their flow is restarted. Terminal arcs
+         * carrying more flow than their new capacity are reparametrized,
+         * by taking the excess off both terminal arcs of the node, which
+         * changes every cut by the same amount. Also resets the search
+         * trees, which solvers grow again over the residual graph.
+         */
+        template <BoundFn fn>
+        void RepairFlow(const std::vector<bool>& fixedVars, NormStats* stats);
+        void RepairFlow(UBfn ub, const std::vector<bool>& fixedVars, NormStats* stats = 0);
+
+        /** Split the nodes into the components of the flow network set up
+         * by UpperBoundCliques: two nodes are connected if some clique can
+         * carry flow between them. A clique carries no flow at a node
+         * whose marginal in its normalized table is zero, which is the
+         * case for fixed nodes, and for every node of a modular clique.
+         *
+         * \return The number of components. component[i] is the component
+         * of node i, or -1 if no clique carries flow to or from i.
+         */
+        int FindComponents(std::vector<int>& component);
+        /** Copy the flow network on nodes, a union of components found by
+         * FindComponents, into g, a graph with nodes.size() nodes and no
+         * cliques. Node nodes[j] becomes node j of g, and local[nodes[j]]
+         * must be j. Tables are cut down to the nodes they carry flow at,
+         * and the terminal weights of g leave each node the excess it has
+         * here, so that solving g solves that part of this graph.
+         */
+        void ExtractComponents(const std::vector<NodeId>& nodes, const std::vector<NodeId>& local, SoSGraph& g) const;
+        /** Take back the clique flows of g, after solving the graph that
+         * ExtractComponents built for nodes. Terminal flows aren't merged,
+         * so call DropFlow once all components are in.
+         */
+        void MergeComponentFlow(const std::vector<NodeId>& nodes, const SoSGraph& g);
+        // Capacity left on the source arc of node i, minus that left on its
+        // sink arc
+        R Excess(NodeId i) const {
+            return (m_c_si[i] - m_phi_si[i]) - (m_c_it[i] - m_phi_it[i]);
+        }
 
         NodeId m_num_nodes;
         NodeId s,t;
-        std::vector<REAL> m_c_si;
-        std::vector<REAL> m_c_it;
-        std::vector<REAL> m_phi_si;
-        std::vector<REAL> m_phi_it;
+        std::vector<R> m_c_si;
+        std::vector<R> m_c_it;
+        std::vector<R> m_phi_si;
+        std::vector<R> m_phi_it;
 
         CliqueId m_num_cliques;
         CliqueVec m_cliques;
-        std::vector<NeighborList> m_neighbors;
+        std::vector<PottsClique> m_potts_cliques;
+        std::vector<CardinalityClique> m_cardinality_cliques;
+        std::vector<PairwiseClique> m_pairwise_cliques;
+        // Size shared by all table cliques, 0 if there are none, -1 if mixed
+        int m_clique_size = 0;
+        bool m_cache_capacities = false;
+        bool m_has_flow = false;
 
     protected:
+        // Parent arcs are packed as (incidence entry << kSlotBits) | target
+        // slot. Table cliques have at most 31 nodes, other families can
+        // be larger, up to 2^kSlotBits - 1 nodes.
+        typedef uint64_t PackedArc;
+        static const int kSlotBits = 16;
+        static const PackedArc kSlotMask = (1 << kSlotBits) - 1;
+
+        // Append a clique's nodes to the arena and record where it's stored
+        void AddCliqueNodes(const NodeId* nodes, size_t k, CliqueRef ref);
+        // Point the arrays of clique c at its slices of the arena
+        void BindClique(CliqueId c);
+        // Bind the clique just added. If adding it moved any pool, every
+        // existing clique must be re-pointed as well.
+        typedef std::array<const void*, 10> PoolPointers;
+        PoolPointers ArenaPools() const;
+        void BindNewClique(const PoolPointers& old_pools);
+
+        // Family and index of each clique, by CliqueId
+        std::vector<CliqueRef> m_clique_refs;
+
+        /* Per-node state, indexed by NodeId (including s and t) */
+        std::vector<NodeState> m_state;
+        std::vector<int> m_dis;
+        std::vector<PackedArc> m_parent_arc;
         std::vector<Node> m_nodes;
+
+        /* Clique arena: the per-clique arrays of all cliques, stored back to
+         * back in clique order, one pool per array. Clique c owns
+         * [m_node_offsets[c], m_node_offsets[c+1]) of the node-sized pools.
+         * The table pools only hold explicit table cliques: the one with
+         * family index j owns [m_table_offsets[j], m_table_offsets[j+1]).
+         */
+        std::vector<NodeId> m_clique_nodes;
+        std::vector<R> m_clique_alpha_Ci;
+        std::vector<Assignment> m_clique_tight_sets;
+        std::vector<Assignment> m_clique_tight_set_transpose;
+        std::vector<R> m_clique_energy;
+        std::vector<R> m_clique_alpha_energy;
+        std::vector<size_t> m_node_offsets;
+        std::vector<size_t> m_table_offsets;
+        // Pools of the cardinality cliques. The one with family index j
+        // owns [m_cardinality_offsets[j], m_cardinality_offsets[j+1]) of
+        // the order and position pools, twice that range of the minima
+        // pool, and one more entry than that range of the energy pool.
+        std::vector<R> m_cardinality_energy;
+        std::vector<uint32_t> m_cardinality_order;
+        std::vector<uint32_t> m_cardinality_position;
+        std::vector<R> m_cardinality_minima;
+        std::vector<size_t> m_cardinality_offsets;
+
+        // Allocate the capacity cache pools and point the cliques at
+        // them, or free them, according to m_cache_capacities
+        void BindCapacityCache();
+        // Exchange capacity cache, one k x k slice per clique, and the
+        // matching bitmasks of valid entries. Empty unless enabled.
+        std::vector<R> m_clique_capacities;
+        std::vector<Assignment> m_clique_known_capacities;
+
+        // Allocate the pools below on first use, and mark every clique
+        // dirty if the bound function changed
+        void BindBoundCache(BoundFn fn);
+        // Bounded tables and psi of the table cliques, laid out like the
+        // energy and node pools, and the bound function they were made with
+        std::vector<R> m_clique_bounded_energy;
+        std::vector<R> m_clique_psi;
+        BoundFn m_bound_fn = nullptr;
+        // Sum of the psi above over the table cliques of each node, which
+        // is all the flow on its sink arc at the start
+        std::vector<R> m_psi_sum;
+        // Bound and normalize the table of c into the cache above, unless
+        // neither the table nor its fixed nodes changed since the last
+        // time. Returns whether it was bounded again.
+        template <BoundFn fn>
+        bool BoundClique(IBFSEnergyTableClique& c, const std::vector<bool>& fixedVars,
+                std::vector<R>& energy, std::vector<R>& newEnergy, std::vector<R>& psi);
+        // Start the flow of c at its cached bound, with alpha = -psi
+        void StartCliqueFlow(IBFSEnergyTableClique& c);
+        // Put the alpha of c back at its cached bound, or at the table if
+        // it has none yet, leaving the sink arcs to the caller
+        void RestartClique(IBFSEnergyTableClique& c);
+
+        // Set by FindComponents: whether clique slots carry flow, laid out
+        // like the node pool, and the first slot of each clique that does,
+        // or -1 if none
+        std::vector<char> m_carries_flow;
+        std::vector<int> m_first_carrier;
+        // Call fn(c) for each clique carrying flow between nodes (a union
+        // of components), in the order ExtractComponents adds them
+        template <typename Fn>
+        void ForEachComponentClique(const std::vector<NodeId>& nodes, Fn fn) const;
+        // Slots of clique c that carry flow
+        void CarrierSlots(CliqueId c, std::vector<size_t>& slots) const;
+
+        // Build the node-clique incidence from the clique arena
+        void BuildIncidence();
+        // Remove every clique, leaving the nodes and terminal weights
+        void ClearCliques();
+        // Add energy weight to node i when labeled 1, through the terminal
+        // arcs. Returns the constant needed to keep them nonnegative.
+        R FoldUnary(NodeId i, R weight);
+
+        /* Node-clique incidence in compressed sparse row form: the entries
+         * for node i are [m_incidence_offsets[i], m_incidence_offsets[i+1])
+         * of m_incidence, in increasing clique order.
+         */
+        std::vector<Incidence> m_incidence;
+        std::vector<size_t> m_incidence_offsets;
+        // Inverse of m_incidence, laid out like the node pool: where in
+        // m_incidence the entry for (clique c, slot j) is stored, at
+        // m_node_offsets[c] + j. Makes ArcIterator::Reverse O(1).
+        std::vector<size_t> m_slot_incidence;
 };
 
-inline SoSGraph::NodeId SoSGraph::AddNode(int n) {
+template <typename R>
+inline typename SoSGraph<R>::NodeId SoSGraph<R>::AddNode(int n) {
     ASSERT(n >= 1);
     ASSERT(s == -1);
     NodeId first_node = m_num_nodes;
-    for (int i = 0; i < n; ++i) {
-        m_nodes.push_back(Node(m_num_nodes));
-        m_c_si.push_back(0);
-        m_c_it.push_back(0);
-        m_phi_si.push_back(0);
-        m_phi_it.push_back(0);
-        m_neighbors.push_back(NeighborList());
-        m_num_nodes++;
-    }
+    m_num_nodes += n;
+    m_state.resize(m_num_nodes, NodeState::N);
+    m_dis.resize(m_num_nodes, std::numeric_limits<int>::max());
+    m_parent_arc.resize(m_num_nodes, 0);
+    m_nodes.reserve(m_num_nodes);
+    for (NodeId i = first_node; i < m_num_nodes; ++i)
+        m_nodes.emplace_back(i);
+    m_c_si.resize(m_num_nodes, 0);
+    m_c_it.resize(m_num_nodes, 0);
+    m_phi_si.resize(m_num_nodes, 0);
+    m_phi_it.resize(m_num_nodes, 0);
     return first_node;
 }
 
-inline void SoSGraph::AddTerminalWeights(NodeId n, REAL sCap, REAL tCap) {
+template <typename R>
+inline void SoSGraph<R>::Reserve(NodeId num_nodes, CliqueId num_cliques, size_t num_clique_nodes, size_t num_table_entries) {
+    ASSERT(s == -1);
+    // Leave room for s and t, which Finalize adds to the per-node arrays
+    const size_t node_capacity = num_nodes + 2;
+    m_state.reserve(node_capacity);
+    m_dis.reserve(node_capacity);
+    m_parent_arc.reserve(node_capacity);
+    m_nodes.reserve(node_capacity);
+    m_c_si.reserve(num_nodes);
+    m_c_it.reserve(num_nodes);
+    m_phi_si.reserve(num_nodes);
+    m_phi_it.reserve(num_nodes);
+
+    m_cliques.reserve(num_cliques);
+    m_clique_refs.reserve(num_cliques);
+    m_node_offsets.reserve(num_cliques + 1);
+    m_table_offsets.reserve(num_cliques + 1);
+    m_clique_nodes.reserve(num_clique_nodes);
+    m_clique_alpha_Ci.reserve(num_clique_nodes);
+    m_clique_tight_sets.reserve(num_clique_nodes);
+    m_clique_tight_set_transpose.reserve(num_clique_nodes);
+    m_clique_energy.reserve(num_table_entries);
+    m_clique_alpha_energy.reserve(num_table_entries);
+}
+
+template <typename R>
+inline void SoSGraph<R>::AddTerminalWeights(NodeId n, R sCap, R tCap) {
     m_c_si[n] += sCap;
     m_c_it[n] += tCap;
 }
 
-inline void SoSGraph::ClearTerminals() {
-    for (NodeId i = 0; i < m_num_nodes; ++i) {
+template <typename R>
+inline void SoSGraph<R>::ClearTerminals() {
+    for (NodeId i = 0; i < m_num_nodes; ++i)
         m_c_si[i] = m_c_it[i] = 0;
-        m_phi_si[i] = m_phi_it[i] = 0;
-    }
 }
         
-inline SoSGraph::IBFSEnergyTableClique& SoSGraph::AddClique(const std::vector<NodeId>& nodes, const std::vector<REAL>& energyTable) {
+template <typename R>
+inline typename SoSGraph<R>::IBFSEnergyTableClique& SoSGraph<R>::AddClique(const std::vector<NodeId>& nodes, const std::vector<R>& energyTable) {
+    ASSERT(energyTable.size() == (size_t(1) << nodes.size()));
+    return AddClique(nodes.data(), nodes.size(), energyTable.data());
+}
+
+template <typename R>
+inline typename SoSGraph<R>::IBFSEnergyTableClique& SoSGraph<R>::AddClique(const NodeId* nodes, size_t k, const R* energyTable) {
+    ASSERT(k <= 31);
+    const size_t table_size = size_t(1) << k;
+    const int size = k;
+    if (m_cliques.empty())
+        m_clique_size = size;
+    else if (m_clique_size != size)
+        m_clique_size = -1;
+
+    const PoolPointers old_pools = ArenaPools();
+    AddCliqueNodes(nodes, k, {CliqueFamily::table, static_cast<CliqueId>(m_cliques.size())});
+    m_clique_energy.insert(m_clique_energy.end(), energyTable, energyTable + table_size);
+    m_clique_alpha_energy.insert(m_clique_alpha_energy.end(), energyTable, energyTable + table_size);
+    m_table_offsets.push_back(m_clique_energy.size());
+    m_cliques.emplace_back();
+    BindNewClique(old_pools);
+    return m_cliques.back();
+}
+
+template <typename R>
+inline typename SoSGraph<R>::PottsClique& SoSGraph<R>::AddPottsClique(const NodeId* nodes, size_t k, R lambda) {
+    ASSERT(k < (size_t(1) << kSlotBits));
+    ASSERT(lambda >= 0);
+    const PoolPointers old_pools = ArenaPools();
+    AddCliqueNodes(nodes, k, {CliqueFamily::potts, static_cast<CliqueId>(m_potts_cliques.size())});
+    m_potts_cliques.emplace_back();
+    m_potts_cliques.back().m_lambda = lambda;
+    BindNewClique(old_pools);
+    return m_potts_cliques.back();
+}
+
+template <typename R>
+inline typename SoSGraph<R>::CardinalityClique& SoSGraph<R>::AddCardinalityClique(const NodeId* nodes, size_t k, const R* h) {
+    ASSERT(k < (size_t(1) << kSlotBits));
+    ASSERT(h[0] == 0);
+    for (size_t c = 1; c < k; ++c)
+        ASSERT(h[c+1] - h[c] <= h[c] - h[c-1]);
+    const PoolPointers old_pools = ArenaPools();
+    AddCliqueNodes(nodes, k, {CliqueFamily::cardinality, static_cast<CliqueId>(m_cardinality_cliques.size())});
+    m_cardinality_energy.insert(m_cardinality_energy.end(), h, h + k + 1);
+    m_cardinality_order.resize(m_cardinality_order.size() + k, 0);
+    m_cardinality_position.resize(m_cardinality_position.size() + k, 0);
+    m_cardinality_minima.resize(m_cardinality_minima.size() + 2*k, 0);
+    m_cardinality_offsets.push_back(m_cardinality_order.size());
+    m_cardinality_cliques.emplace_back();
+    BindNewClique(old_pools);
+    return m_cardinality_cliques.back();
+}
+
+template <typename R>
+inline typename SoSGraph<R>::PairwiseClique& SoSGraph<R>::AddPairwiseClique(NodeId i, NodeId j, R E00, R E01, R E10, R E11) {
+    ASSERT(i != j);
+    ASSERT(E01 + E10 >= E00 + E11);
+    const NodeId nodes[] = {i, j};
+    const PoolPointers old_pools = ArenaPools();
+    AddCliqueNodes(nodes, 2, {CliqueFamily::pairwise, static_cast<CliqueId>(m_pairwise_cliques.size())});
+    m_pairwise_cliques.emplace_back();
+    PairwiseClique& c = m_pairwise_cliques.back();
+    c.m_energy[0] = E00;
+    c.m_energy[1] = E01;
+    c.m_energy[2] = E10;
+    c.m_energy[3] = E11;
+    BindNewClique(old_pools);
+    c.UpdateResiduals();
+    return c;
+}
+
+template <typename R>
+inline void SoSGraph<R>::AddCliqueNodes(const NodeId* nodes, size_t k, CliqueRef ref) {
     ASSERT(s == -1);
-    m_cliques.emplace_back(nodes, energyTable);
-    for (NodeId i : nodes) {
-        ASSERT(0 <= i && i < m_num_nodes);
-        m_neighbors[i].push_back(m_num_cliques);
+    for (size_t i = 0; i < k; ++i)
+        ASSERT(0 <= nodes[i] && nodes[i] < m_num_nodes);
+    m_clique_nodes.insert(m_clique_nodes.end(), nodes, nodes + k);
+    m_clique_alpha_Ci.resize(m_clique_alpha_Ci.size() + k, 0);
+    // Tight sets start out invalid, so their initial value doesn't matter
+    m_clique_tight_sets.resize(m_clique_tight_sets.size() + k, 0);
+    m_clique_tight_set_transpose.resize(m_clique_tight_set_transpose.size() + k, 0);
+    m_node_offsets.push_back(m_clique_nodes.size());
+    m_clique_refs.push_back(ref);
+    m_num_cliques++;
+}
+
+template <typename R>
+inline typename SoSGraph<R>::PoolPointers SoSGraph<R>::ArenaPools() const {
+    return {{ m_clique_nodes.data(), m_clique_alpha_Ci.data(),
+        m_clique_tight_sets.data(), m_clique_tight_set_transpose.data(),
+        m_clique_energy.data(), m_clique_alpha_energy.data(),
+        m_cardinality_energy.data(), m_cardinality_order.data(),
+        m_cardinality_position.data(), m_cardinality_minima.data() }};
+}
+
+template <typename R>
+inline void SoSGraph<R>::BindNewClique(const PoolPointers& old_pools) {
+    if (ArenaPools() == old_pools) {
+        BindClique(m_num_cliques - 1);
+    } else {
+        for (CliqueId c = 0; c < m_num_cliques; ++c)
+            BindClique(c);
     }
-    return m_cliques[m_num_cliques++];
 }
 
-inline void SoSGraph::ResetFlow() {
-    // Initialize source, sink (only do once)
-    if (s == -1) {
-        s = m_num_nodes; t = m_num_nodes + 1;
-        m_nodes.push_back(Node(s));
-        m_nodes.push_back(Node(t));
+template <typename R>
+inline void SoSGraph<R>::BindClique(CliqueId c) {
+    const CliqueRef ref = m_clique_refs[c];
+    const size_t node_offset = m_node_offsets[c];
+    Clique* clique = nullptr;
+    switch (ref.family) {
+        case CliqueFamily::table: {
+            auto& table_clique = m_cliques[ref.index];
+            const size_t table_offset = m_table_offsets[ref.index];
+            table_clique.m_min_tight_set = m_clique_tight_sets.data() + node_offset;
+            table_clique.m_tight_set_transpose = m_clique_tight_set_transpose.data() + node_offset;
+            table_clique.m_energy = m_clique_energy.data() + table_offset;
+            table_clique.m_alpha_energy = m_clique_alpha_energy.data() + table_offset;
+            clique = &table_clique;
+            break;
+        }
+        case CliqueFamily::potts:
+            clique = &m_potts_cliques[ref.index];
+            break;
+        case CliqueFamily::pairwise:
+            clique = &m_pairwise_cliques[ref.index];
+            break;
+        case CliqueFamily::cardinality: {
+            auto& card_clique = m_cardinality_cliques[ref.index];
+            const size_t offset = m_cardinality_offsets[ref.index];
+            const size_t k = m_cardinality_offsets[ref.index+1] - offset;
+            card_clique.m_h = m_cardinality_energy.data() + offset + ref.index;
+            card_clique.m_order = m_cardinality_order.data() + offset;
+            card_clique.m_position = m_cardinality_position.data() + offset;
+            card_clique.m_prefix_min = m_cardinality_minima.data() + 2*offset;
+            card_clique.m_suffix_min = card_clique.m_prefix_min + k;
+            card_clique.InvalidateCaches();
+            clique = &card_clique;
+            break;
+        }
     }
-    // reset distance, state and parent
-    for (int i = 0; i < m_num_nodes + 2; ++i) {
-        Node& node = m_nodes[i];
-        node.dis = std::numeric_limits<int>::max();
-        node.state = NodeState::N;
-        node.parent = i;
-        m_phi_si[i] = m_phi_it[i] = 0;
+    clique->m_nodes = m_clique_nodes.data() + node_offset;
+    clique->m_alpha_Ci = m_clique_alpha_Ci.data() + node_offset;
+    clique->m_size = m_node_offsets[c+1] - node_offset;
+}
+
+template <typename R>
+inline void SoSGraph<R>::BuildIncidence() {
+    // Counting sort of the (clique, slot) pairs by node. Cliques are
+    // visited in order, so each node's entries end up sorted by clique.
+    m_incidence_offsets.assign(m_num_nodes + 1, 0);
+    for (NodeId i : m_clique_nodes)
+        m_incidence_offsets[i+1]++;
+    for (NodeId i = 0; i < m_num_nodes; ++i)
+        m_incidence_offsets[i+1] += m_incidence_offsets[i];
+    m_incidence.resize(m_clique_nodes.size());
+    m_slot_incidence.resize(m_clique_nodes.size());
+    std::vector<size_t> next(m_incidence_offsets.begin(), m_incidence_offsets.end() - 1);
+    for (CliqueId c = 0; c < m_num_cliques; ++c) {
+        for (size_t slot = m_node_offsets[c]; slot < m_node_offsets[c+1]; ++slot) {
+            const size_t entry = next[m_clique_nodes[slot]]++;
+            m_incidence[entry] = {c, static_cast<int>(slot - m_node_offsets[c])};
+            m_slot_incidence[slot] = entry;
+        }
+    }
+}
+
+template <typename R>
+inline void SoSGraph<R>::BindCapacityCache() {
+    if (m_cache_capacities == !m_clique_capacities.empty())
+        return;
+    m_clique_capacities.clear();
+    m_clique_known_capacities.clear();
+    if (m_cache_capacities) {
+        size_t num_capacities = 0;
+        size_t num_rows = 0;
+        for (const auto& c : m_cliques) {
+            num_capacities += c.Size() * c.Size();
+            num_rows += c.Size();
+        }
+        m_clique_capacities.resize(num_capacities);
+        m_clique_known_capacities.resize(num_rows);
+    }
+    size_t offset = 0;
+    size_t row_offset = 0;
+    for (auto& clique : m_cliques) {
+        if (m_cache_capacities) {
+            clique.m_capacities = m_clique_capacities.data() + offset;
+            clique.m_known_capacities = m_clique_known_capacities.data() + row_offset;
+            offset += clique.Size() * clique.Size();
+            row_offset += clique.Size();
+        } else {
+            clique.m_capacities = nullptr;
+            clique.m_known_capacities = nullptr;
+        }
+    }
+}
+
+template <typename R>
+inline void SoSGraph<R>::ClearCliques() {
+    m_num_cliques = 0;
+    m_clique_size = 0;
+    m_cliques.clear();
+    m_potts_cliques.clear();
+    m_cardinality_cliques.clear();
+    m_pairwise_cliques.clear();
+    m_clique_refs.clear();
+    m_clique_nodes.clear();
+    m_clique_alpha_Ci.clear();
+    m_clique_tight_sets.clear();
+    m_clique_tight_set_transpose.clear();
+    m_clique_energy.clear();
+    m_clique_alpha_energy.clear();
+    m_clique_bounded_energy.clear();
+    m_clique_psi.clear();
+    m_node_offsets.assign(1, 0);
+    m_table_offsets.assign(1, 0);
+    m_cardinality_energy.clear();
+    m_cardinality_order.clear();
+    m_cardinality_position.clear();
+    m_cardinality_minima.clear();
+    m_cardinality_offsets.assign(1, 0);
+}
+
+template <typename R>
+inline R SoSGraph<R>::FoldUnary(NodeId i, R weight) {
+    if (weight >= 0) {
+        m_c_it[i] += weight;
+        return 0;
+    }
+    m_c_si[i] -= weight;
+    return weight;
+}
+
+template <typename R>
+inline R SoSGraph<R>::CompactCliques() {
+    ASSERT(s == -1);
+    R constant = 0;
+
+    // Table cliques, each with its nodes sorted and its table permuted to
+    // match, so that equal node sets compare equal
+    struct TableTerm {
+        std::vector<NodeId> nodes;
+        std::vector<R> table;
+        size_t first; // Index of the first clique merged into this one
+    };
+    std::vector<TableTerm> tables;
+    tables.reserve(m_cliques.size());
+    std::vector<size_t> order;
+    for (size_t c = 0; c < m_cliques.size(); ++c) {
+        const auto& clique = m_cliques[c];
+        const size_t k = clique.Size();
+        order.resize(k);
+        for (size_t j = 0; j < k; ++j)
+            order[j] = j;
+        std::sort(order.begin(), order.end(),
+                [&](size_t a, size_t b) { return clique.Nodes()[a] < clique.Nodes()[b]; });
+        TableTerm term;
+        term.first = c;
+        for (size_t j = 0; j < k; ++j)
+            term.nodes.push_back(clique.Nodes()[order[j]]);
+        term.table.resize(size_t(1) << k);
+        for (Assignment a = 0; a < term.table.size(); ++a) {
+            Assignment original = 0;
+            for (size_t j = 0; j < k; ++j)
+                original |= ((a >> j) & 1) << order[j];
+            term.table[a] = clique.EnergyTable()[original];
+        }
+        tables.push_back(std::move(term));
+    }
+    std::sort(tables.begin(), tables.end(), [](const TableTerm& a, const TableTerm& b) {
+        return (a.nodes == b.nodes) ? (a.first < b.first) : (a.nodes < b.nodes);
+    });
+    std::vector<TableTerm> merged_tables;
+    for (auto& term : tables) {
+        if (!merged_tables.empty() && merged_tables.back().nodes == term.nodes) {
+            auto& table = merged_tables.back().table;
+            for (size_t a = 0; a < table.size(); ++a)
+                table[a] += term.table[a];
+        } else {
+            merged_tables.push_back(std::move(term));
+        }
+    }
+    std::sort(merged_tables.begin(), merged_tables.end(),
+            [](const TableTerm& a, const TableTerm& b) { return a.first < b.first; });
+
+    // Pairwise cliques, with the lower node first
+    struct PairwiseTerm {
+        NodeId i, j;
+        R energy[4];
+        size_t first;
+    };
+    std::vector<PairwiseTerm> pairs;
+    pairs.reserve(m_pairwise_cliques.size());
+    for (size_t c = 0; c < m_pairwise_cliques.size(); ++c) {
+        const auto& clique = m_pairwise_cliques[c];
+        const auto e = clique.EnergyTable();
+        if (clique.Nodes()[0] < clique.Nodes()[1])
+            pairs.push_back({clique.Nodes()[0], clique.Nodes()[1], {e[0], e[1], e[2], e[3]}, c});
+        else
+            pairs.push_back({clique.Nodes()[1], clique.Nodes()[0], {e[0], e[2], e[1], e[3]}, c});
+    }
+    std::sort(pairs.begin(), pairs.end(), [](const PairwiseTerm& a, const PairwiseTerm& b) {
+        return std::make_tuple(a.i, a.j, a.first) < std::make_tuple(b.i, b.j, b.first);
+    });
+    std::vector<PairwiseTerm> merged_pairs;
+    for (const auto& term : pairs) {
+        if (!merged_pairs.empty() && merged_pairs.back().i == term.i && merged_pairs.back().j == term.j) {
+            for (int a = 0; a < 4; ++a)
+                merged_pairs.back().energy[a] += term.energy[a];
+        } else {
+            merged_pairs.push_back(term);
+        }
+    }
+    std::sort(merged_pairs.begin(), merged_pairs.end(),
+            [](const PairwiseTerm& a, const PairwiseTerm& b) { return a.first < b.first; });
+
+    // The other families are only checked for being modular (or zero)
+    std::vector<std::pair<std::vector<NodeId>, R>> potts;
+    for (const auto& clique : m_potts_cliques) {
+        if (clique.Lambda() != 0)
+            potts.emplace_back(std::vector<NodeId>(clique.Nodes().begin(), clique.Nodes().end()), clique.Lambda());
+    }
+    std::vector<std::pair<std::vector<NodeId>, std::vector<R>>> cardinality;
+    for (const auto& clique : m_cardinality_cliques) {
+        const auto h = clique.CardinalityEnergy();
+        bool modular = true;
+        for (size_t c = 1; c < clique.Size() && modular; ++c)
+            modular = (h[c+1] - h[c] == h[1]);
+        if (modular) {
+            for (NodeId i : clique.Nodes())
+                constant += FoldUnary(i, h[1]);
+        } else {
+            cardinality.emplace_back(std::vector<NodeId>(clique.Nodes().begin(), clique.Nodes().end()),
+                    std::vector<R>(h.begin(), h.end()));
+        }
+    }
+
+    ClearCliques();
+    for (const auto& term : merged_tables) {
+        // Modular iff adding any node i to a set costs the same as adding
+        // it to the empty set
+        const auto& table = term.table;
+        bool modular = true;
+        for (Assignment a = 1; a < table.size() && modular; ++a) {
+            const Assignment low_bit = a & (~a + 1);
+            modular = (table[a] - table[a ^ low_bit] == table[low_bit] - table[0]);
+        }
+        if (modular) {
+            constant += table[0];
+            for (size_t j = 0; j < term.nodes.size(); ++j)
+                constant += FoldUnary(term.nodes[j], table[Assignment(1) << j] - table[0]);
+        } else {
+            AddClique(term.nodes.data(), term.nodes.size(), table.data());
+        }
+    }
+    for (const auto& term : merged_pairs) {
+        const R* e = term.energy;
+        if (e[1] + e[2] == e[0] + e[3]) {
+            constant += e[0] + FoldUnary(term.i, e[1] - e[0]) + FoldUnary(term.j, e[2] - e[0]);
+        } else {
+            AddPairwiseClique(term.i, term.j, e[0], e[1], e[2], e[3]);
+        }
     }
+    for (const auto& term : potts)
+        AddPottsClique(term.first.data(), term.first.size(), term.second);
+    for (const auto& term : cardinality)
+        AddCardinalityClique(term.first.data(), term.first.size(), term.second.data());
+    return constant;
+}
+
+template <typename R>
+inline void SoSGraph<R>::BindBoundCache(BoundFn fn) {
+    if (m_clique_bounded_energy.size() != m_clique_energy.size()) {
+        m_clique_bounded_energy.resize(m_clique_energy.size());
+        m_clique_psi.resize(m_clique_nodes.size());
+        for (CliqueId c = 0; c < m_num_cliques; ++c) {
+            const CliqueRef ref = m_clique_refs[c];
+            if (ref.family != CliqueFamily::table)
+                continue;
+            auto& clique = m_cliques[ref.index];
+            clique.m_bounded_energy = m_clique_bounded_energy.data() + m_table_offsets[ref.index];
+            clique.m_psi = m_clique_psi.data() + m_node_offsets[c];
+            clique.m_dirty = true;
+        }
+        m_psi_sum.assign(m_num_nodes, 0);
+        for (auto& clique : m_cliques) {
+            for (size_t i = 0; i < clique.Size(); ++i)
+                m_psi_sum[clique.Nodes()[i]] += clique.m_psi[i];
+        }
+    }
+    if (fn != m_bound_fn) {
+        for (auto& clique : m_cliques)
+            clique.m_dirty = true;
+        m_bound_fn = fn;
+    }
+}
+
+template <typename R>
+inline void SoSGraph<R>::Finalize() {
+    ASSERT(s == -1);
+    s = m_num_nodes; t = m_num_nodes + 1;
+    for (NodeId i : { s, t }) {
+        m_state.push_back(NodeState::N);
+        m_dis.push_back(std::numeric_limits<int>::max());
+        m_parent_arc.push_back(0);
+        m_nodes.push_back(Node(i));
+    }
+    BuildIncidence();
+}
+
+template <typename R>
+inline void SoSGraph<R>::ResetFlow() {
+    // Initialize source, sink (only do once)
+    if (s == -1)
+        Finalize();
+    BindCapacityCache();
+    ResetTrees();
+    // Table cliques start at their last bound, which puts psi on the sink
+    // arcs. Only the ones that pushed since then need their alpha back.
+    for (int i = 0; i < m_num_nodes; ++i) {
+        m_phi_si[i] = 0;
+        m_phi_it[i] = m_psi_sum.empty() ? 0 : m_psi_sum[i];
+    }
+    m_has_flow = false;
     
-    // Reset Clique parameters
-    for (int cid = 0; cid < m_num_cliques; ++cid) {
-        auto& c = m_cliques[cid];
+    for (auto& c : m_cliques) {
+        if (c.m_touched)
+            RestartClique(c);
+    }
+    for (auto& c : m_potts_cliques)
         c.ResetAlpha();
-        c.ComputeMinTightSets();
-    }
-
-}
-
-inline REAL SoSGraph::ResCap(const ArcIterator& arc, bool forwardArc) {
-    ASSERT(arc.cliqueId() >= 0 && arc.cliqueId() < static_cast<int>(m_cliques.size()));
-    if (forwardArc)
-        return m_cliques[arc.cliqueId()].ExchangeCapacity(arc.SourceIdx(), arc.TargetIdx());
-    else
-        return m_cliques[arc.cliqueId()].ExchangeCapacity(arc.TargetIdx(), arc.SourceIdx());
-}
-
-inline bool SoSGraph::NonzeroCap(const ArcIterator& arc, bool forwardArc) {
-    if (forwardArc)
-        return m_cliques[arc.cliqueId()].NonzeroCapacity(arc.SourceIdx(), arc.TargetIdx());
-    else
-        return m_cliques[arc.cliqueId()].NonzeroCapacity(arc.TargetIdx(), arc.SourceIdx());
-}
-
-inline void CheckSubmodular(size_t n, const std::vector<REAL>& m_energy) {
-    typedef int32_t Assignment;
-    Assignment max_assgn = 1 << n;
-    for (Assignment s = 0; s < max_assgn; ++s) {
-        for (size_t i = 0; i < n; ++i) {
-            Assignment si = s | (1 << i);
-            if (si != s) {
-                for (size_t j = i+1; j < n; ++j) {
-                    Assignment t = s | (1 << j);
-                    if (t != s && j != i) {
-                        Assignment ti = t | (1 << i);
-                        // Decreasing marginal costs, so we require
-                        // f(ti) - f(t) <= f(si) - f(s)
-                        // i.e. f(si) - f(s) - f(ti) + f(t) >= 0
-                        REAL violation = -m_energy[si] - m_energy[t]
-                            + m_energy[s] + m_energy[ti];
-                        //if (violation > 0) std::cout << violation << std::endl;
-                        ASSERT(violation <= 0);
-                    }
-                }
-            }
-        }
+    for (auto& c : m_cardinality_cliques)
+        c.ResetAlpha();
+    for (auto& c : m_pairwise_cliques)
+        c.ResetAlpha();
+}
+
+template <typename R>
+inline void SoSGraph<R>::ResetTrees() {
+    // reset distance, state and parent
+    std::fill(m_state.begin(), m_state.end(), NodeState::N);
+    std::fill(m_dis.begin(), m_dis.end(), std::numeric_limits<int>::max());
+    for (NodeId i = 0; i < m_num_nodes; ++i)
+        m_parent_arc[i] = PackedArc(m_incidence_offsets[i+1]) << kSlotBits;
+}
+
+template <typename R>
+inline typename SoSGraph<R>::ArcIterator SoSGraph<R>::ParentArc(NodeId i) {
+    ASSERT(0 <= i && i < m_num_nodes);
+    const PackedArc arc = m_parent_arc[i];
+    const Incidence* cIter = m_incidence.data() + (arc >> kSlotBits);
+    if (cIter == IncidenceEnd(i))
+        return ArcsEnd(i);
+    return {i, cIter, static_cast<int>(arc & kSlotMask), CliqueSize(cIter->clique), this};
+}
+
+template <typename R>
+inline void SoSGraph<R>::SetParentArc(NodeId i, const ArcIterator& arc) {
+    ASSERT(arc.source == i);
+    m_parent_arc[i] = (PackedArc(arc.cIter - m_incidence.data()) << kSlotBits) | arc.cliqueIdx;
+}
+
+template <typename R>
+inline typename SoSGraph<R>::NodeId SoSGraph<R>::Parent(NodeId i) const {
+    ASSERT(0 <= i && i < m_num_nodes);
+    const PackedArc arc = m_parent_arc[i];
+    const size_t entry = arc >> kSlotBits;
+    if (entry == m_incidence_offsets[i+1])
+        return (m_state[i] == NodeState::S || m_state[i] == NodeState::S_orphan) ? s : t;
+    return m_clique_nodes[m_node_offsets[m_incidence[entry].clique] + (arc & kSlotMask)];
+}
+
+template <typename R>
+inline int SoSGraph<R>::FixedCliqueSize() const {
+    switch (m_clique_size) {
+        case 2: case 3: case 4: case 9:
+            return m_clique_size;
+        default:
+            return 0;
+    }
+}
+
+template <typename R>
+template <int K>
+inline R SoSGraph<R>::ResCap(const ArcIterator& arc, bool forwardArc) {
+    ASSERT(arc.cliqueId() >= 0 && arc.cliqueId() < m_num_cliques);
+    const size_t u_idx = forwardArc ? arc.SourceIdx() : arc.TargetIdx();
+    const size_t v_idx = forwardArc ? arc.TargetIdx() : arc.SourceIdx();
+    const CliqueRef ref = m_clique_refs[arc.cliqueId()];
+    switch (ref.family) {
+        case CliqueFamily::table:
+            return m_cliques[ref.index].template ExchangeCapacity<K>(u_idx, v_idx);
+        case CliqueFamily::potts:
+            return m_potts_cliques[ref.index].ExchangeCapacity(u_idx, v_idx);
+        case CliqueFamily::cardinality:
+            return m_cardinality_cliques[ref.index].ExchangeCapacity(u_idx, v_idx);
+        case CliqueFamily::pairwise:
+            return m_pairwise_cliques[ref.index].ExchangeCapacity(u_idx, v_idx);
     }
+    ASSERT(false);
+    return 0;
 }
 
-inline void SoSGraph::IBFSEnergyTableClique::NormalizeEnergy(std::vector<REAL>& psi, REAL& constantTerm) {
-    ASSERT(false /* Should not be calling this function*/);
-    const size_t n = this->m_nodes.size();
-    CheckSubmodular(n, m_energy);
-    const Assignment num_assignments = 1 << n;
-    REAL allOnes = m_energy[num_assignments - 1];
-    constantTerm += allOnes;
-    psi.resize(n);
-    Assignment assgn = num_assignments - 1; // The all 1 assignment
-    for (size_t i = 0; i < n; ++i) {
-        Assignment next_assgn = assgn ^ (1 << i);
-        psi[i] = (m_energy[assgn] - m_energy[next_assgn]);
-        assgn = next_assgn;
+template <typename R>
+template <int K>
+inline bool SoSGraph<R>::NonzeroCap(const ArcIterator& arc, bool forwardArc) {
+    const size_t u_idx = forwardArc ? arc.SourceIdx() : arc.TargetIdx();
+    const size_t v_idx = forwardArc ? arc.TargetIdx() : arc.SourceIdx();
+    const CliqueRef ref = m_clique_refs[arc.cliqueId()];
+    switch (ref.family) {
+        case CliqueFamily::table:
+            return m_cliques[ref.index].template NonzeroCapacity<K>(u_idx, v_idx);
+        case CliqueFamily::potts:
+            return m_potts_cliques[ref.index].NonzeroCapacity(u_idx, v_idx);
+        case CliqueFamily::cardinality:
+            return m_cardinality_cliques[ref.index].NonzeroCapacity(u_idx, v_idx);
+        case CliqueFamily::pairwise:
+            return m_pairwise_cliques[ref.index].NonzeroCapacity(u_idx, v_idx);
     }
+    ASSERT(false);
+    return false;
+}
 
-    for (Assignment a = 0; a < num_assignments; ++a) {
-        m_energy[a] -= allOnes;
-        for (size_t i = 0; i < n; ++i) {
-            if (!(a & (1 << i))) m_energy[a] += psi[i];
+template <typename R>
+template <int K>
+inline void SoSGraph<R>::Push(const ArcIterator& arc, bool forwardArc, R delta) {
+    const size_t u_idx = forwardArc ? arc.SourceIdx() : arc.TargetIdx();
+    const size_t v_idx = forwardArc ? arc.TargetIdx() : arc.SourceIdx();
+    const CliqueRef ref = m_clique_refs[arc.cliqueId()];
+    switch (ref.family) {
+        case CliqueFamily::table:
+            m_cliques[ref.index].template Push<K>(u_idx, v_idx, delta);
+            break;
+        case CliqueFamily::potts:
+            m_potts_cliques[ref.index].Push(u_idx, v_idx, delta);
+            break;
+        case CliqueFamily::cardinality:
+            m_cardinality_cliques[ref.index].Push(u_idx, v_idx, delta);
+            break;
+        case CliqueFamily::pairwise:
+            m_pairwise_cliques[ref.index].Push(u_idx, v_idx, delta);
+            break;
+    }
+}
+
+template <typename R>
+template <int K>
+inline bool SoSGraph<R>::NextResidualArc(ArcIterator& arc, bool forwardArc) {
+    ASSERT(arc.source >= 0 && arc.source < m_num_nodes);
+    const Incidence* end = IncidenceEnd(arc.source);
+    while (arc.cIter != end) {
+        const CliqueRef ref = m_clique_refs[arc.cliqueId()];
+        size_t next = arc.cliqueSize;
+        switch (ref.family) {
+            case CliqueFamily::table:
+                next = m_cliques[ref.index].template NextResidual<K>(arc.SourceIdx(), arc.cliqueIdx, forwardArc);
+                break;
+            case CliqueFamily::potts:
+                next = m_potts_cliques[ref.index].NextResidual(arc.SourceIdx(), arc.cliqueIdx, forwardArc);
+                break;
+            case CliqueFamily::cardinality:
+                next = m_cardinality_cliques[ref.index].NextResidual(arc.SourceIdx(), arc.cliqueIdx, forwardArc);
+                break;
+            case CliqueFamily::pairwise:
+                next = m_pairwise_cliques[ref.index].NextResidual(arc.SourceIdx(), arc.cliqueIdx, forwardArc);
+                break;
+        }
+        if (next < static_cast<size_t>(arc.cliqueSize)) {
+            arc.cliqueIdx = next;
+            return true;
+        }
+        arc.NextClique();
+    }
+    return false;
+}
+
+template <typename R>
+template <int K>
+inline bool SoSGraph<R>::NextResidualArcShared(ArcIterator& arc, bool forwardArc, SharedScanScratch& scratch) const {
+    ASSERT(arc.source >= 0 && arc.source < m_num_nodes);
+    const Incidence* end = IncidenceEnd(arc.source);
+    while (arc.cIter != end) {
+        const CliqueRef ref = m_clique_refs[arc.cliqueId()];
+        const size_t u_idx = arc.SourceIdx();
+        size_t next = arc.cliqueSize;
+        switch (ref.family) {
+            case CliqueFamily::table: {
+                const auto& c = m_cliques[ref.index];
+                if (c.m_min_tight_set_valid) {
+                    next = c.template NextResidual<K>(u_idx, arc.cliqueIdx, forwardArc);
+                    break;
+                }
+                const size_t k = c.Size();
+                if (scratch.clique != arc.cliqueId()) {
+                    scratch.tight_sets.resize(2*k);
+                    c.template ComputeMinTightSets<K>(scratch.tight_sets.data(), scratch.tight_sets.data() + k);
+                    scratch.clique = arc.cliqueId();
+                }
+                const Assignment arcs = forwardArc ? scratch.tight_sets[u_idx] : scratch.tight_sets[k + u_idx];
+                const Assignment residual = arcs & ~(Assignment(1) << u_idx)
+                    & ~((Assignment(1) << arc.cliqueIdx) - 1);
+                next = (residual != 0) ? __builtin_ctz(residual) : k;
+                break;
+            }
+            case CliqueFamily::potts:
+                next = m_potts_cliques[ref.index].NextResidual(u_idx, arc.cliqueIdx, forwardArc);
+                break;
+            case CliqueFamily::cardinality:
+                ASSERT(false);
+                break;
+            case CliqueFamily::pairwise:
+                next = m_pairwise_cliques[ref.index].NextResidual(u_idx, arc.cliqueIdx, forwardArc);
+                break;
         }
-        ASSERT(m_energy[a] >= 0);
-        m_alpha_energy[a] = m_energy[a];
+        if (next < static_cast<size_t>(arc.cliqueSize)) {
+            arc.cliqueIdx = next;
+            return true;
+        }
+        arc.NextClique();
     }
-    ComputeMinTightSets();
-    CheckSubmodular(n, m_energy);
+    return false;
+}
+
+template <typename R>
+template <int K>
+inline void SoSGraph<R>::PrepareResidualQueries(CliqueId c) {
+    const CliqueRef ref = m_clique_refs[c];
+    ASSERT(ref.family != CliqueFamily::cardinality);
+    if (ref.family == CliqueFamily::table && !m_cliques[ref.index].m_min_tight_set_valid)
+        m_cliques[ref.index].template ComputeMinTightSets<K>();
+}
+
+template <typename R>
+inline R SoSGraph<R>::ComputeCliqueEnergy(const std::vector<int>& labels) const {
+    R total = 0;
+    for (const auto& c : m_cliques)
+        total += c.ComputeEnergy(labels);
+    for (const auto& c : m_potts_cliques)
+        total += c.ComputeEnergy(labels);
+    for (const auto& c : m_cardinality_cliques)
+        total += c.ComputeEnergy(labels);
+    for (const auto& c : m_pairwise_cliques)
+        total += c.ComputeEnergy(labels);
+    return total;
 }
 
-inline REAL SoSGraph::IBFSEnergyTableClique::ComputeEnergy(const std::vector<int>& labels) const {
+template <typename R>
+inline R SoSGraph<R>::IBFSEnergyTableClique::ComputeEnergy(const std::vector<int>& labels) const {
     Assignment assgn = 0;
-    for (size_t i = 0; i < this->m_nodes.size(); ++i) {
+    for (size_t i = 0; i < this->m_size; ++i) {
         NodeId n = this->m_nodes[i];
         if (labels[n] == 1) {
             assgn |= 1 << i;
@@ -406,9 +1683,10 @@ inline REAL SoSGraph::IBFSEnergyTableClique::ComputeEnergy(const std::vector<int
     return m_energy[assgn];
 }
 
-inline REAL SoSGraph::IBFSEnergyTableClique::ComputeAlphaEnergy(const std::vector<int>& labels) const {
+template <typename R>
+inline R SoSGraph<R>::IBFSEnergyTableClique::ComputeAlphaEnergy(const std::vector<int>& labels) const {
     Assignment assgn = 0;
-    for (size_t i = 0; i < this->m_nodes.size(); ++i) {
+    for (size_t i = 0; i < this->m_size; ++i) {
         NodeId n = this->m_nodes[i];
         if (labels[n] == 1) {
             assgn |= 1 << i;
@@ -417,15 +1695,47 @@ inline REAL SoSGraph::IBFSEnergyTableClique::ComputeAlphaEnergy(const std::vecto
     return m_alpha_energy[assgn];
 }
 
-inline REAL SoSGraph::IBFSEnergyTableClique::ExchangeCapacity(size_t u_idx, size_t v_idx) const {
-    const size_t n = this->m_nodes.size();
+template <typename R>
+template <int K>
+inline R SoSGraph<R>::IBFSEnergyTableClique::ExchangeCapacity(size_t u_idx, size_t v_idx) const {
+    const size_t n = FixedSize<K>();
     ASSERT(u_idx < n);
     ASSERT(v_idx < n);
+    if (m_capacities) {
+        const Assignment v_mask = 1 << v_idx;
+        R& capacity = m_capacities[u_idx*n + v_idx];
+        if (!(m_known_capacities[u_idx] & v_mask)) {
+            capacity = ComputeExchangeCapacity<K>(u_idx, v_idx);
+            m_known_capacities[u_idx] |= v_mask;
+        }
+        return capacity;
+    }
+    return ComputeExchangeCapacity<K>(u_idx, v_idx);
+}
+
+template <typename R>
+template <int K>
+inline R SoSGraph<R>::IBFSEnergyTableClique::ComputeExchangeCapacity(size_t u_idx, size_t v_idx) const {
+    const size_t n = FixedSize<K>();
+    if (n >= kMinKernelSize)
+        return SubsetMin(m_alpha_energy, n, u_idx, v_idx);
+
+    R min_energy = std::numeric_limits<R>::max();
+    const Assignment u_mask = 1 << u_idx;
+    if (K != 0) {
+        // Fixed size: the trip count is a compile-time constant, so let
+        // the compiler unroll the loop completely
+        const Assignment lo_mask = (1 << std::min(u_idx, v_idx)) - 1;
+        const Assignment hi_mask = (1 << std::max(u_idx, v_idx)) - 1;
+        for (Assignment t = 0; t < (Assignment(1) << (n - 2)); ++t) {
+            R energy = m_alpha_energy[SpliceZeroBits(t, lo_mask, hi_mask) | u_mask];
+            min_energy = std::min(min_energy, energy);
+        }
+        return min_energy;
+    }
 
-    REAL min_energy = std::numeric_limits<REAL>::max();
     Assignment num_assgns = 1 << n;
     const Assignment bound = num_assgns-1;
-    const Assignment u_mask = 1 << u_idx;
     const Assignment v_mask = 1 << v_idx;
     const Assignment uv_mask = u_mask | v_mask;
     const Assignment subset_mask = bound & ~uv_mask;
@@ -434,7 +1744,7 @@ inline REAL SoSGraph::IBFSEnergyTableClique::ExchangeCapacity(size_t u_idx, size
     Assignment assgn = subset_mask;
     do {
         Assignment u_sep = assgn | u_mask;
-        REAL energy = m_alpha_energy[u_sep];
+        R energy = m_alpha_energy[u_sep];
         if (energy < min_energy) min_energy = energy;
         assgn = ((assgn - 1) & subset_mask);
     } while (assgn != subset_mask);
@@ -442,16 +1752,38 @@ inline REAL SoSGraph::IBFSEnergyTableClique::ExchangeCapacity(size_t u_idx, size
     return min_energy;
 }
 
-inline void SoSGraph::IBFSEnergyTableClique::Push(size_t u_idx, size_t v_idx, REAL delta) {
-    ASSERT(u_idx >= 0 && u_idx < this->m_nodes.size());
-    ASSERT(v_idx >= 0 && v_idx < this->m_nodes.size());
-    m_alpha_Ci[u_idx] += delta;
-    m_alpha_Ci[v_idx] -= delta;
-    const size_t n = this->m_nodes.size();
-    Assignment num_assgns = 1 << n;
-    const Assignment bound = num_assgns-1;
+template <typename R>
+template <int K>
+inline void SoSGraph<R>::IBFSEnergyTableClique::Push(size_t u_idx, size_t v_idx, R delta) {
+    const size_t n = FixedSize<K>();
+    ASSERT(u_idx < n);
+    ASSERT(v_idx < n);
+    this->m_alpha_Ci[u_idx] += delta;
+    this->m_alpha_Ci[v_idx] -= delta;
+    m_touched = true;
+    // Most pushes are followed by further pushes on the same clique before 
+    // anyone asks about residual arcs, so defer the O(2^k) rescan
+    InvalidateCaches();
+    if (n >= kMinKernelSize) {
+        SubsetPush(m_alpha_energy, n, u_idx, v_idx, delta);
+        return;
+    }
+
     const Assignment u_mask = 1 << u_idx;
     const Assignment v_mask = 1 << v_idx;
+    if (K != 0) {
+        const Assignment lo_mask = (1 << std::min(u_idx, v_idx)) - 1;
+        const Assignment hi_mask = (1 << std::max(u_idx, v_idx)) - 1;
+        for (Assignment t = 0; t < (Assignment(1) << (n - 2)); ++t) {
+            Assignment assgn = SpliceZeroBits(t, lo_mask, hi_mask);
+            m_alpha_energy[assgn | u_mask] -= delta;
+            m_alpha_energy[assgn | v_mask] += delta;
+        }
+        return;
+    }
+
+    Assignment num_assgns = 1 << n;
+    const Assignment bound = num_assgns-1;
     const Assignment uv_mask = u_mask | v_mask;
     const Assignment subset_mask = bound & ~uv_mask;
     // Terrible bit-hacks to optimize the living hell out of this function
@@ -464,91 +1796,353 @@ inline void SoSGraph::IBFSEnergyTableClique::Push(size_t u_idx, size_t v_idx, RE
         m_alpha_energy[v_sep] += delta;
         assgn = ((assgn - 1) & subset_mask);
     } while (assgn != subset_mask);
+}
 
-    ComputeMinTightSets();
+template <typename R>
+template <int K>
+inline void SoSGraph<R>::IBFSEnergyTableClique::ComputeMinTightSets() const {
+    ComputeMinTightSets<K>(m_min_tight_set, m_tight_set_transpose);
+    m_min_tight_set_valid = true;
 }
 
-inline void SoSGraph::IBFSEnergyTableClique::ComputeMinTightSets() {
-    size_t n = this->m_nodes.size();
+template <typename R>
+template <int K>
+inline void SoSGraph<R>::IBFSEnergyTableClique::ComputeMinTightSets(Assignment* min_tight_set, Assignment* transpose) const {
+    const size_t n = FixedSize<K>();
     Assignment num_assgns = 1 << n;
     const Assignment bound = num_assgns-1;
-    for (auto& a : m_min_tight_set)
-        a = bound;
-    for (Assignment assgn = bound-1; assgn >= 1; --assgn) {
+    // The min tight set for i is the numerically smallest tight set 
+    // containing i, so scan upwards and stop once every node has one
+    Assignment remaining = bound;
+    for (Assignment assgn = 1; assgn < bound && remaining != 0; ++assgn) {
         if (m_alpha_energy[assgn] == 0) {
-            for (size_t i = 0; i < n; ++i) {
-                //ASSERT(m_alpha_energy[m_min_tight_set[i] & assgn] == 0);
-                //ASSERT(m_alpha_energy[m_min_tight_set[i] | assgn] == 0);
-                if ((assgn & (1 << i)) != 0)
-                    m_min_tight_set[i] = assgn;
+            Assignment newly_tight = assgn & remaining;
+            while (newly_tight != 0) {
+                min_tight_set[__builtin_ctz(newly_tight)] = assgn;
+                newly_tight &= newly_tight - 1;
             }
+            remaining &= ~assgn;
+        }
+    }
+    while (remaining != 0) {
+        min_tight_set[__builtin_ctz(remaining)] = bound;
+        remaining &= remaining - 1;
+    }
+    std::fill(transpose, transpose + n, 0);
+    for (size_t u = 0; u < n; ++u) {
+        Assignment row = min_tight_set[u];
+        while (row != 0) {
+            transpose[__builtin_ctz(row)] |= Assignment(1) << u;
+            row &= row - 1;
         }
     }
 }
 
-inline bool SoSGraph::IBFSEnergyTableClique::NonzeroCapacity(size_t u_idx, size_t v_idx) const {
+template <typename R>
+template <int K>
+inline bool SoSGraph<R>::IBFSEnergyTableClique::NonzeroCapacity(size_t u_idx, size_t v_idx) const {
+    if (!m_min_tight_set_valid)
+        ComputeMinTightSets<K>();
     Assignment min_set = m_min_tight_set[u_idx];
     return (min_set & (1 << v_idx)) != 0;
 }
 
-inline void SoSGraph::IBFSEnergyTableClique::ResetAlpha() {
-    for (auto& a : this->m_alpha_Ci) {
-        a = 0;
+template <typename R>
+template <int K>
+inline typename SoSGraph<R>::Assignment
+SoSGraph<R>::IBFSEnergyTableClique::ResidualArcs(size_t u_idx, bool forwardArc) const {
+    ASSERT(u_idx < FixedSize<K>());
+    if (!m_min_tight_set_valid)
+        ComputeMinTightSets<K>();
+    const Assignment arcs = forwardArc ? m_min_tight_set[u_idx] : m_tight_set_transpose[u_idx];
+    return arcs & ~(Assignment(1) << u_idx);
+}
+
+template <typename R>
+template <int K>
+inline size_t SoSGraph<R>::IBFSEnergyTableClique::NextResidual(size_t u_idx, size_t from, bool forwardArc) const {
+    ASSERT(from < FixedSize<K>());
+    const Assignment residual = ResidualArcs<K>(u_idx, forwardArc) & ~((Assignment(1) << from) - 1);
+    return (residual != 0) ? __builtin_ctz(residual) : FixedSize<K>();
+}
+
+template <typename R>
+inline void SoSGraph<R>::IBFSEnergyTableClique::ResetAlpha() {
+    std::fill(this->m_alpha_Ci, this->m_alpha_Ci + this->m_size, 0);
+    std::copy(m_energy, m_energy + TableSize(), m_alpha_energy);
+    InvalidateCaches();
+}
+
+template <typename R>
+inline R SoSGraph<R>::PottsClique::ComputeEnergy(const std::vector<int>& labels) const {
+    size_t ones = 0;
+    for (size_t i = 0; i < this->m_size; ++i)
+        ones += (labels[this->m_nodes[i]] == 1);
+    return (ones == 0 || ones == this->m_size) ? 0 : m_lambda;
+}
+
+template <typename R>
+inline R SoSGraph<R>::PottsClique::ExchangeCapacity(size_t u_idx, size_t v_idx) const {
+    ASSERT(u_idx < this->m_size && v_idx < this->m_size && u_idx != v_idx);
+    const R alpha_u = this->m_alpha_Ci[u_idx];
+    const R alpha_v = this->m_alpha_Ci[v_idx];
+    return m_lambda - alpha_u - (m_positive_alpha - Positive(alpha_u) - Positive(alpha_v));
+}
+
+template <typename R>
+inline void SoSGraph<R>::PottsClique::Push(size_t u_idx, size_t v_idx, R delta) {
+    ASSERT(u_idx < this->m_size && v_idx < this->m_size && u_idx != v_idx);
+    R& alpha_u = this->m_alpha_Ci[u_idx];
+    R& alpha_v = this->m_alpha_Ci[v_idx];
+    m_positive_alpha -= Positive(alpha_u) + Positive(alpha_v);
+    alpha_u += delta;
+    alpha_v -= delta;
+    m_positive_alpha += Positive(alpha_u) + Positive(alpha_v);
+}
+
+template <typename R>
+inline size_t SoSGraph<R>::PottsClique::NextResidual(size_t u_idx, size_t from, bool forwardArc) const {
+    ASSERT(u_idx < this->m_size);
+    const R alpha_u = this->m_alpha_Ci[u_idx];
+    // Sum of the positive alpha_i, other than u's
+    const R rest = m_positive_alpha - Positive(alpha_u);
+    // ExchangeCapacity(u, v) = lambda - alpha_u - rest + max(alpha_v, 0)
+    // ExchangeCapacity(v, u) = lambda - rest + max(-alpha_v, 0)
+    const R base = forwardArc ? m_lambda - alpha_u - rest : m_lambda - rest;
+    for (size_t v = from; v < this->m_size; ++v) {
+        if (v == u_idx)
+            continue;
+        const R alpha_v = this->m_alpha_Ci[v];
+        if (base + Positive(forwardArc ? alpha_v : -alpha_v) > 0)
+            return v;
+    }
+    return this->m_size;
+}
+
+template <typename R>
+inline void SoSGraph<R>::PottsClique::ResetAlpha() {
+    std::fill(this->m_alpha_Ci, this->m_alpha_Ci + this->m_size, 0);
+    m_positive_alpha = 0;
+}
+
+template <typename R>
+inline R SoSGraph<R>::CardinalityClique::ComputeEnergy(const std::vector<int>& labels) const {
+    size_t ones = 0;
+    for (size_t i = 0; i < this->m_size; ++i)
+        ones += (labels[this->m_nodes[i]] == 1);
+    return m_h[ones];
+}
+
+template <typename R>
+inline void SoSGraph<R>::CardinalityClique::PrepareSlot(size_t u_idx) const {
+    const size_t k = this->m_size;
+    const R* alpha = this->m_alpha_Ci;
+    if (!m_sorted) {
+        for (size_t i = 0; i < k; ++i)
+            m_order[i] = i;
+        std::sort(m_order, m_order + k,
+                [alpha](uint32_t a, uint32_t b) { return alpha[a] > alpha[b]; });
+        for (size_t i = 0; i < k; ++i)
+            m_position[m_order[i]] = i;
+        m_sorted = true;
+        m_cached_slot = kNoSlot;
+    }
+    if (m_cached_slot == u_idx)
+        return;
+    // Prefix minima going forward through Q. The suffix minima are built
+    // from the terms h(j+1) - Pre(j+1), stored in place on the way.
+    R prefix_sum = 0;
+    R running_min = std::numeric_limits<R>::max();
+    size_t j = 0;
+    for (size_t i = 0; i < k; ++i) {
+        const size_t slot = m_order[i];
+        if (slot == u_idx)
+            continue;
+        running_min = std::min(running_min, m_h[j+1] - prefix_sum);
+        m_prefix_min[j] = running_min;
+        prefix_sum += alpha[slot];
+        m_suffix_min[j] = m_h[j+1] - prefix_sum;
+        ++j;
     }
-    const size_t n = this->m_nodes.size();
-    const Assignment num_assignments = 1 << n;
-    for (Assignment a = 0; a < num_assignments; ++a) {
-        m_alpha_energy[a] = m_energy[a];
+    R suffix = std::numeric_limits<R>::max();
+    for (size_t p = j; p-- > 0;) {
+        const R term = m_suffix_min[p];
+        m_suffix_min[p] = suffix;
+        suffix = std::min(suffix, term);
     }
+    m_cached_slot = u_idx;
 }
 
-template <SoSGraph::BoundFn UB>
-void SoSGraph::UpperBoundCliques(const std::vector<bool>& fixedVars, NormStats* stats) {
-    std::vector<REAL> psi;
-    //int nCliques = m_cliques.size();
-    int cliquesDone = 0;
-    /*
-     *std::cout << "Upper Bounding Cliques: ";
-     *std::cout.flush();
-     */
-    for (auto& c : m_cliques) {
-        /*
-         *if (cliquesDone % (nCliques/10) == 0) {
-         *    std::cout << ".";
-         *    std::cout.flush();
-         *}
-         */
-        cliquesDone++;
-        auto& newEnergy = c.AlphaEnergy();
-        int k = c.Size();
-        psi.resize(k);
-        // Compute upper bound g of clique energy
-        UB(k, c.EnergyTable(), newEnergy);
+template <typename R>
+inline R SoSGraph<R>::CardinalityClique::ExchangeCapacity(size_t u_idx, size_t v_idx) const {
+    ASSERT(u_idx < this->m_size && v_idx < this->m_size && u_idx != v_idx);
+    PrepareSlot(u_idx);
+    const size_t p = QueuePosition(u_idx, v_idx);
+    const R alpha_v = this->m_alpha_Ci[v_idx];
+    R min_energy = m_prefix_min[p];
+    if (m_suffix_min[p] != std::numeric_limits<R>::max())
+        min_energy = std::min(min_energy, m_suffix_min[p] + alpha_v);
+    return min_energy - this->m_alpha_Ci[u_idx];
+}
 
-        if (!fixedVars.empty()) {
-            uint32_t fixedSet = 0;
-            for (int i = 0; i < k; ++i)
-                fixedSet |= (fixedVars[c.Nodes()[i]] << i);
-            ZeroMarginalSet(k, newEnergy, fixedSet);
+template <typename R>
+inline void SoSGraph<R>::CardinalityClique::Push(size_t u_idx, size_t v_idx, R delta) {
+    ASSERT(u_idx < this->m_size && v_idx < this->m_size && u_idx != v_idx);
+    this->m_alpha_Ci[u_idx] += delta;
+    this->m_alpha_Ci[v_idx] -= delta;
+    InvalidateCaches();
+}
+
+template <typename R>
+inline size_t SoSGraph<R>::CardinalityClique::NextResidual(size_t u_idx, size_t from, bool forwardArc) const {
+    ASSERT(u_idx < this->m_size);
+    if (this->m_size < 2)
+        return this->m_size;
+    PrepareSlot(u_idx);
+    const R alpha_u = this->m_alpha_Ci[u_idx];
+    for (size_t v = from; v < this->m_size; ++v) {
+        if (v == u_idx)
+            continue;
+        const size_t p = QueuePosition(u_idx, v);
+        const R alpha_v = this->m_alpha_Ci[v];
+        const bool bounded_suffix = m_suffix_min[p] != std::numeric_limits<R>::max();
+        // ExchangeCapacity(u, v) = min(prefix, suffix + alpha_v) - alpha_u
+        // ExchangeCapacity(v, u) = min(prefix - alpha_v, suffix)
+        if (forwardArc) {
+            if (m_prefix_min[p] > alpha_u
+                    && (!bounded_suffix || m_suffix_min[p] + alpha_v > alpha_u))
+                return v;
+        } else {
+            if (m_prefix_min[p] > alpha_v && m_suffix_min[p] > 0)
+                return v;
         }
+    }
+    return this->m_size;
+}
 
+template <typename R>
+inline void SoSGraph<R>::CardinalityClique::ResetAlpha() {
+    std::fill(this->m_alpha_Ci, this->m_alpha_Ci + this->m_size, 0);
+    InvalidateCaches();
+}
+
+template <typename R>
+inline void SoSGraph<R>::PairwiseClique::ResetAlpha() {
+    this->m_alpha_Ci[0] = this->m_alpha_Ci[1] = 0;
+    UpdateResiduals();
+}
+
+template <typename R>
+inline void SoSGraph<R>::IBFSEnergyTableClique::InvalidateCaches() {
+    m_min_tight_set_valid = false;
+    if (m_known_capacities)
+        std::fill(m_known_capacities, m_known_capacities + this->m_size, 0);
+}
+
+template <typename R>
+template <typename SoSGraph<R>::BoundFn UB>
+bool SoSGraph<R>::BoundClique(IBFSEnergyTableClique& c, const std::vector<bool>& fixedVars,
+        std::vector<R>& energy, std::vector<R>& newEnergy, std::vector<R>& psi) {
+    int k = c.Size();
+    Assignment fixedSet = 0;
+    if (!fixedVars.empty()) {
+        for (int i = 0; i < k; ++i)
+            fixedSet |= (fixedVars[c.Nodes()[i]] << i);
+    }
+    // Only cliques whose table or fixed nodes changed since the last
+    // call need bounding again, the rest reuse the result from then
+    if (!c.m_dirty && fixedSet == c.m_fixed_set)
+        return false;
+    psi.resize(k);
+    // The bound functions work on vectors, so copy the table out of
+    // the arena and the result back in
+    const auto table = static_cast<const IBFSEnergyTableClique&>(c).EnergyTable();
+    energy.assign(table.begin(), table.end());
+    newEnergy.resize(table.size());
+    // Compute upper bound g of clique energy
+    UB(k, energy, newEnergy);
+
+    if (!fixedVars.empty())
+        ZeroMarginalSet(k, newEnergy, fixedSet);
+
+    c.m_norm_stats.L1 = DiffL1(energy, newEnergy);
+    c.m_norm_stats.L2 = DiffL2(energy, newEnergy);
+    c.m_norm_stats.LInfty = DiffLInfty(energy, newEnergy);
+    // Modify g, find psi so that g'(S) = g(S) + psi(S) >= 0
+    Normalize(k, newEnergy, psi);
+    std::copy(newEnergy.begin(), newEnergy.end(), c.m_bounded_energy);
+    for (int i = 0; i < k; ++i) {
+        m_psi_sum[c.Nodes()[i]] += psi[i] - c.m_psi[i];
+        c.m_psi[i] = psi[i];
+    }
+    c.m_fixed_set = fixedSet;
+    c.m_dirty = false;
+    return true;
+}
+
+template <typename R>
+inline void SoSGraph<R>::StartCliqueFlow(IBFSEnergyTableClique& c) {
+    RestartClique(c);
+    for (size_t i = 0; i < c.Size(); ++i)
+        m_phi_it[c.Nodes()[i]] += c.m_psi[i];
+}
+
+template <typename R>
+inline void SoSGraph<R>::RestartClique(IBFSEnergyTableClique& c) {
+    if (!c.m_bounded_energy) {
+        c.ResetAlpha();
+        c.m_touched = false;
+        return;
+    }
+    std::copy(c.m_bounded_energy, c.m_bounded_energy + c.TableSize(), c.m_alpha_energy);
+    for (size_t i = 0; i < c.Size(); ++i)
+        c.m_alpha_Ci[i] = -c.m_psi[i];
+    // The min tight sets are recomputed the first time they're needed
+    c.InvalidateCaches();
+    c.m_touched = false;
+}
+
+template <typename R>
+template <typename SoSGraph<R>::BoundFn UB>
+void SoSGraph<R>::UpperBoundCliques(const std::vector<bool>& fixedVars, NormStats* stats) {
+    std::vector<R> psi;
+    std::vector<R> energy;
+    std::vector<R> newEnergy;
+    BindBoundCache(UB);
+    m_has_flow = true;
+    // ResetFlow left the other table cliques at their last bound already
+    for (auto& c : m_cliques) {
+        if (BoundClique<UB>(c, fixedVars, energy, newEnergy, psi) || c.m_touched) {
+            auto alpha_Ci = c.AlphaCi();
+            for (size_t i = 0; i < c.Size(); ++i)
+                m_phi_it[c.Nodes()[i]] += alpha_Ci[i];
+            StartCliqueFlow(c);
+        }
         if (stats) {
-            stats->L1 += DiffL1(c.EnergyTable(), newEnergy);
-            stats->L2 += DiffL2(c.EnergyTable(), newEnergy);
-            stats->LInfty += DiffLInfty(c.EnergyTable(), newEnergy);
+            stats->L1 += c.m_norm_stats.L1;
+            stats->L2 += c.m_norm_stats.L2;
+            stats->LInfty += c.m_norm_stats.LInfty;
         }
-        // Modify g, find psi so that g'(S) = g(S) + psi(S) >= 0
-        Normalize(k, newEnergy, psi);
-        /*
-         *AddLinear(k, c.EnergyTable(), psi);
-         */
-
-        auto& alpha_Ci = c.AlphaCi();
-        for (int i = 0; i < k; ++i) {
-            alpha_Ci[i] = -psi[i];
-            m_phi_it[c.Nodes()[i]] += psi[i];
+    }
+    // Cardinality cliques are submodular already, and are only normalized,
+    // with alpha at the same vertex of the base polytope as Normalize
+    // picks: alpha_i = h(i+1) - h(i). The bound and fixedVars don't apply.
+    for (auto& c : m_cardinality_cliques) {
+        auto alpha_Ci = c.AlphaCi();
+        for (size_t i = 0; i < c.Size(); ++i) {
+            alpha_Ci[i] = c.m_h[i+1] - c.m_h[i];
+            m_phi_it[c.Nodes()[i]] -= alpha_Ci[i];
         }
-        c.ComputeMinTightSets();
+        c.InvalidateCaches();
+    }
+    // Likewise for pairwise cliques, which leaves all of
+    // E01 + E10 - E00 - E11 on the arc from the second node to the first
+    for (auto& c : m_pairwise_cliques) {
+        c.m_alpha_Ci[0] = c.m_energy[1] - c.m_energy[0];
+        c.m_alpha_Ci[1] = c.m_energy[3] - c.m_energy[1];
+        m_phi_it[c.m_nodes[0]] -= c.m_alpha_Ci[0];
+        m_phi_it[c.m_nodes[1]] -= c.m_alpha_Ci[1];
+        c.UpdateResiduals();
     }
     /*
      *std::cout << "\n";
@@ -556,15 +2150,283 @@ void SoSGraph::UpperBoundCliques(const std::vector<bool>& fixedVars, NormStats*
      */
 }
 
-inline void SoSGraph::UpperBoundCliques(UBfn ub, NormStats* stats) {
+template <typename R>
+template <typename SoSGraph<R>::BoundFn UB>
+void SoSGraph<R>::RepairFlow(const std::vector<bool>& fixedVars, NormStats* stats) {
+    ASSERT(m_has_flow);
+    std::vector<R> psi;
+    std::vector<R> energy;
+    std::vector<R> newEnergy;
+    BindCapacityCache();
+    BindBoundCache(UB);
+    ResetTrees();
+    for (auto& c : m_cliques) {
+        if (BoundClique<UB>(c, fixedVars, energy, newEnergy, psi)) {
+            // Take the old flow of the clique back to the sink, before
+            // starting it over
+            auto alpha_Ci = c.AlphaCi();
+            for (size_t i = 0; i < c.Size(); ++i)
+                m_phi_it[c.Nodes()[i]] += alpha_Ci[i];
+            StartCliqueFlow(c);
+        }
+        if (stats) {
+            stats->L1 += c.m_norm_stats.L1;
+            stats->L2 += c.m_norm_stats.L2;
+            stats->LInfty += c.m_norm_stats.LInfty;
+        }
+    }
+    // The other families can't change, so keep their flow as is
+    for (NodeId i = 0; i < m_num_nodes; ++i) {
+        R excess = m_phi_si[i] - m_c_si[i];
+        if (excess > 0) {
+            m_phi_si[i] -= excess;
+            m_phi_it[i] -= excess;
+        }
+        excess = m_phi_it[i] - m_c_it[i];
+        if (excess > 0) {
+            m_phi_si[i] -= excess;
+            m_phi_it[i] -= excess;
+        }
+    }
+}
+
+template <typename R>
+inline void SoSGraph<R>::RepairFlow(UBfn ub, const std::vector<bool>& fixedVars, NormStats* stats) {
+    switch (ub) {
+        case UBfn::chen: RepairFlow<ChenUpperBound<R>>(fixedVars, stats);
+                    break;
+        case UBfn::cvpr14: RepairFlow<UpperBoundCVPR14<R>>(fixedVars, stats);
+                    break;
+    }
+}
+
+template <typename R>
+inline int SoSGraph<R>::FindComponents(std::vector<int>& component) {
+    ASSERT(m_has_flow);
+    m_carries_flow.assign(m_clique_nodes.size(), 0);
+    m_first_carrier.assign(m_num_cliques, -1);
+    // Union-find over the nodes, with path halving
+    std::vector<NodeId> parent(m_num_nodes);
+    std::vector<char> carried(m_num_nodes, 0);
+    for (NodeId i = 0; i < m_num_nodes; ++i)
+        parent[i] = i;
+    auto find = [&parent](NodeId i) {
+        while (parent[i] != i) {
+            parent[i] = parent[parent[i]];
+            i = parent[i];
+        }
+        return i;
+    };
+    for (CliqueId c = 0; c < m_num_cliques; ++c) {
+        const auto nodes = CliqueNodes(c);
+        const size_t k = nodes.size();
+        char* carries = m_carries_flow.data() + m_node_offsets[c];
+        const CliqueRef ref = m_clique_refs[c];
+        bool all = false;
+        switch (ref.family) {
+            case CliqueFamily::table: {
+                // The bounded table is normalized, so a node's marginal is
+                // zero everywhere if it doesn't depend on the rest of S
+                const auto& clique = m_cliques[ref.index];
+                const R* table = clique.m_bounded_energy;
+                for (size_t j = 0; j < k; ++j) {
+                    const Assignment bit = Assignment(1) << j;
+                    for (Assignment a = 0; a < clique.TableSize() && !carries[j]; ++a)
+                        carries[j] = !(a & bit) && table[a | bit] != table[a];
+                }
+                break;
+            }
+            case CliqueFamily::potts:
+                all = (m_potts_cliques[ref.index].Lambda() != 0);
+                break;
+            case CliqueFamily::cardinality: {
+                // Modular iff h is linear, as in CompactCliques
+                const auto h = m_cardinality_cliques[ref.index].CardinalityEnergy();
+                for (size_t j = 1; j < k && !all; ++j)
+                    all = (h[j+1] - h[j] != h[1]);
+                break;
+            }
+            case CliqueFamily::pairwise: {
+                const auto e = m_pairwise_cliques[ref.index].EnergyTable();
+                all = (e[1] + e[2] != e[0] + e[3]);
+                break;
+            }
+        }
+        NodeId root = -1;
+        for (size_t j = 0; j < k; ++j) {
+            if (all)
+                carries[j] = 1;
+            if (!carries[j])
+                continue;
+            carried[nodes[j]] = 1;
+            const NodeId r = find(nodes[j]);
+            if (root == -1) {
+                root = r;
+                m_first_carrier[c] = j;
+            } else if (r != root) {
+                parent[r] = root;
+            }
+        }
+    }
+
+    component.assign(m_num_nodes, -1);
+    std::vector<int> root_component(m_num_nodes, -1);
+    int num_components = 0;
+    for (NodeId i = 0; i < m_num_nodes; ++i) {
+        if (!carried[i])
+            continue;
+        int& id = root_component[find(i)];
+        if (id == -1)
+            id = num_components++;
+        component[i] = id;
+    }
+    return num_components;
+}
+
+template <typename R>
+template <typename Fn>
+inline void SoSGraph<R>::ForEachComponentClique(const std::vector<NodeId>& nodes, Fn fn) const {
+    for (NodeId i : nodes) {
+        for (const auto& inc : Incidences(i)) {
+            if (m_first_carrier[inc.clique] == inc.slot)
+                fn(inc.clique);
+        }
+    }
+}
+
+template <typename R>
+inline void SoSGraph<R>::CarrierSlots(CliqueId c, std::vector<size_t>& slots) const {
+    slots.clear();
+    const char* carries = m_carries_flow.data() + m_node_offsets[c];
+    for (int j = 0; j < CliqueSize(c); ++j) {
+        if (carries[j])
+            slots.push_back(j);
+    }
+}
+
+template <typename R>
+inline void SoSGraph<R>::ExtractComponents(const std::vector<NodeId>& nodes, const std::vector<NodeId>& local, SoSGraph& g) const {
+    ASSERT(g.NumNodes() == NodeId(nodes.size()));
+    std::vector<R> excess(nodes.size());
+    for (size_t j = 0; j < nodes.size(); ++j)
+        excess[j] = Excess(nodes[j]);
+    std::vector<size_t> slots;
+    std::vector<NodeId> g_nodes;
+    std::vector<R> table;
+    ForEachComponentClique(nodes, [&](CliqueId c) {
+        const auto c_nodes = CliqueNodes(c);
+        const CliqueRef ref = m_clique_refs[c];
+        CarrierSlots(c, slots);
+        g_nodes.clear();
+        for (size_t j : slots)
+            g_nodes.push_back(local[c_nodes[j]]);
+        switch (ref.family) {
+            case CliqueFamily::table: {
+                // The bounded table with the other nodes left out, which it
+                // doesn't depend on. It's submodular and normalized, so g
+                // bounds it to itself.
+                const auto& clique = m_cliques[ref.index];
+                table.resize(size_t(1) << slots.size());
+                for (Assignment b = 0; b < table.size(); ++b) {
+                    Assignment a = 0;
+                    for (size_t j = 0; j < slots.size(); ++j)
+                        a |= ((b >> j) & 1) << slots[j];
+                    table[b] = clique.m_bounded_energy[a];
+                }
+                g.AddClique(g_nodes.data(), g_nodes.size(), table.data());
+                break;
+            }
+            case CliqueFamily::potts:
+                g.AddPottsClique(g_nodes.data(), g_nodes.size(), m_potts_cliques[ref.index].Lambda());
+                break;
+            case CliqueFamily::cardinality: {
+                // g starts the flow at the same alpha, and takes it off
+                // the sink arcs again, so put it back into the excess
+                const auto& clique = m_cardinality_cliques[ref.index];
+                g.AddCardinalityClique(g_nodes.data(), g_nodes.size(), clique.m_h);
+                for (size_t j = 0; j < g_nodes.size(); ++j)
+                    excess[g_nodes[j]] += clique.AlphaCi()[j];
+                break;
+            }
+            case CliqueFamily::pairwise: {
+                // Likewise
+                const auto& clique = m_pairwise_cliques[ref.index];
+                const auto e = clique.EnergyTable();
+                g.AddPairwiseClique(g_nodes[0], g_nodes[1], e[0], e[1], e[2], e[3]);
+                for (size_t j = 0; j < 2; ++j)
+                    excess[g_nodes[j]] += clique.AlphaCi()[j];
+                break;
+            }
+        }
+    });
+    for (size_t j = 0; j < nodes.size(); ++j)
+        g.AddTerminalWeights(j, std::max<R>(excess[j], 0), std::max<R>(-excess[j], 0));
+}
+
+template <typename R>
+inline void SoSGraph<R>::MergeComponentFlow(const std::vector<NodeId>& nodes, const SoSGraph& g) {
+    std::vector<size_t> slots;
+    CliqueId g_c = 0;
+    ForEachComponentClique(nodes, [&](CliqueId c) {
+        const CliqueRef ref = m_clique_refs[c];
+        const CliqueRef g_ref = g.m_clique_refs[g_c++];
+        ASSERT(ref.family == g_ref.family);
+        switch (ref.family) {
+            case CliqueFamily::table: {
+                // g bounded our normalized table, where we bounded the
+                // original one, so its alpha is ours shifted by psi. Our
+                // table minus alpha is g's, with the other nodes left out.
+                auto& clique = m_cliques[ref.index];
+                const auto& g_clique = g.m_cliques[g_ref.index];
+                CarrierSlots(c, slots);
+                for (size_t j = 0; j < slots.size(); ++j)
+                    clique.m_alpha_Ci[slots[j]] = g_clique.m_alpha_Ci[j] - clique.m_psi[slots[j]];
+                for (Assignment a = 0; a < clique.TableSize(); ++a) {
+                    Assignment b = 0;
+                    for (size_t j = 0; j < slots.size(); ++j)
+                        b |= ((a >> slots[j]) & 1) << j;
+                    clique.m_alpha_energy[a] = g_clique.m_alpha_energy[b];
+                }
+                clique.InvalidateCaches();
+                clique.m_touched = true;
+                break;
+            }
+            case CliqueFamily::potts: {
+                auto& clique = m_potts_cliques[ref.index];
+                const auto& g_clique = g.m_potts_cliques[g_ref.index];
+                std::copy(g_clique.m_alpha_Ci, g_clique.m_alpha_Ci + clique.Size(), clique.m_alpha_Ci);
+                clique.m_positive_alpha = g_clique.m_positive_alpha;
+                break;
+            }
+            case CliqueFamily::cardinality: {
+                auto& clique = m_cardinality_cliques[ref.index];
+                const auto& g_clique = g.m_cardinality_cliques[g_ref.index];
+                std::copy(g_clique.m_alpha_Ci, g_clique.m_alpha_Ci + clique.Size(), clique.m_alpha_Ci);
+                clique.InvalidateCaches();
+                break;
+            }
+            case CliqueFamily::pairwise: {
+                auto& clique = m_pairwise_cliques[ref.index];
+                const auto& g_clique = g.m_pairwise_cliques[g_ref.index];
+                std::copy(g_clique.m_alpha_Ci, g_clique.m_alpha_Ci + 2, clique.m_alpha_Ci);
+                clique.UpdateResiduals();
+                break;
+            }
+        }
+    });
+}
+
+template <typename R>
+inline void SoSGraph<R>::UpperBoundCliques(UBfn ub, NormStats* stats) {
     UpperBoundCliques(ub, std::vector<bool>{}, std::vector<int>{}, stats);
 }
 
-inline void SoSGraph::UpperBoundCliques(UBfn ub, const std::vector<bool>& fixedVars, const std::vector<int>& labels, NormStats* stats) {
+template <typename R>
+inline void SoSGraph<R>::UpperBoundCliques(UBfn ub, const std::vector<bool>& fixedVars, const std::vector<int>& labels, NormStats* stats) {
     switch (ub) {
-        case UBfn::chen: UpperBoundCliques<ChenUpperBound>(fixedVars, stats);
+        case UBfn::chen: UpperBoundCliques<ChenUpperBound<R>>(fixedVars, stats);
                     break;
-        case UBfn::cvpr14: UpperBoundCliques<UpperBoundCVPR14>(fixedVars, stats);
+        case UBfn::cvpr14: UpperBoundCliques<UpperBoundCVPR14<R>>(fixedVars, stats);
                     break;
     }
 }
@@ -11,16 +11,15 @@
 
 #include "multilabel-energy.hpp"
 #include "submodular-ibfs.hpp"
-#include "parametric-submodular-ibfs.hpp"
 #include "submodular-functions.hpp"
 
 struct FlowConcept {
     typedef int NodeId;
     struct Clique {
         int Size() const;
-        const std::vector<REAL>& AlphaCi() const;
-        std::vector<REAL>& EnergyTable();
-        const std::vector<REAL>& EnergyTable() const;
+        Span<const REAL> AlphaCi() const;
+        Span<REAL> EnergyTable();
+        Span<const REAL> EnergyTable() const;
     };
     struct CliqueVec {
         Clique& operator[](int n);
@@ -29,7 +28,8 @@ struct FlowConcept {
     void AddNode(int n);
     void AddConstantTerm(REAL c);
     void AddUnaryTerm(NodeId i, REAL E0, REAL E1);
-    void AddClique(const std::vector<NodeId>& nodes, const std::vector<REAL>& energyTable, bool normalize);
+    void Reserve(NodeId num_nodes, size_t num_cliques, size_t num_clique_nodes, size_t num_table_entries);
+    void AddClique(const NodeId* nodes, size_t k, const REAL* energyTable);
     void GraphInit();
     void ClearUnaries();
     REAL GetConstantTerm();
@@ -45,7 +45,7 @@ struct SubmodularIBFSParams;
  *
  * Implements SoSPD algorithm from Fix, Wang, Zabih in CVPR 14.
  */
-template <typename Flow = SubmodularIBFS>
+template <typename Flow = SubmodularIBFS<>>
 class SoSPD {
     public:
         typedef MultilabelEnergy::VarId VarId;
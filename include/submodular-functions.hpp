@@ -9,37 +9,51 @@
 
 typedef uint32_t Assgn;
 
-typedef void (*UpperBoundFunction)(int, const std::vector<REAL>&, std::vector<REAL>&);
-void SubmodularUpperBound(int n, const std::vector<REAL>& oldEnergy, std::vector<REAL>& normalizedEnergy);
-REAL SubmodularLowerBound(int n, std::vector<REAL>& energyTable, bool early_finish = false);
-void UpperBoundCVPR14(int n, const std::vector<REAL>& origEnergy, std::vector<REAL>& energyTable);
+// The functions below work on tables of any signed integer energy type R
+template <typename R>
+using UpperBoundFunction = void (*)(int, const std::vector<R>&, std::vector<R>&);
+template <typename R>
+void SubmodularUpperBound(int n, const std::vector<R>& oldEnergy, std::vector<R>& normalizedEnergy);
+template <typename R>
+R SubmodularLowerBound(int n, std::vector<R>& energyTable, bool early_finish = false);
+template <typename R>
+void UpperBoundCVPR14(int n, const std::vector<R>& origEnergy, std::vector<R>& energyTable);
 
 // Takes in a set s (given by bitstring) and returns new energy such that
 // f(t | s) = f(t) for all t. Does not change f(t) for t disjoint from s
 // I.e., creates a set s whose members have zero marginal gain for all t
-void ZeroMarginalSet(int n, std::vector<REAL>& energyTable, Assgn s);
+template <typename R>
+void ZeroMarginalSet(int n, std::vector<R>& energyTable, Assgn s);
 
 // Updates f to f'(S) = f(S) + psi(S)
-void AddLinear(int n, std::vector<REAL>& energyTable, const std::vector<REAL>& psi);
+template <typename R>
+void AddLinear(int n, std::vector<R>& energyTable, const std::vector<R>& psi);
 
 // Updates f to f'(S) = f(S) - psi1(S) - psi2(V\S)
-void SubtractLinear(int n, std::vector<REAL>& energyTable, 
-        const std::vector<REAL>& psi1, const std::vector<REAL>& psi2);
+template <typename R>
+void SubtractLinear(int n, std::vector<R>& energyTable, 
+        const std::vector<R>& psi1, const std::vector<R>& psi2);
 
 // Modifies an energy function to be >= 0, with f(0) = f(V) = 0
 // energyTable is modified in place, must be submodular
 // psi must be length n, gets filled so that 
 //  f'(S) = f(S) + psi(S)
 // where f' is the new energyTable, and f is the old one
-void Normalize(int n, std::vector<REAL>& energyTable, std::vector<REAL>& psi);
-
-bool CheckSubmodular(int n, const std::vector<REAL>& energyTable);
-bool CheckUpperBoundInvariants(int n, const std::vector<REAL>& energyTable,
-        const std::vector<REAL>& upperBound);
-
-double DiffL1(const std::vector<REAL>& e1, const std::vector<REAL>& e2);
-double DiffL2(const std::vector<REAL>& e1, const std::vector<REAL>& e2);
-double DiffLInfty(const std::vector<REAL>& e1, const std::vector<REAL>& e2);
+template <typename R>
+void Normalize(int n, std::vector<R>& energyTable, std::vector<R>& psi);
+
+template <typename R>
+bool CheckSubmodular(int n, const std::vector<R>& energyTable);
+template <typename R>
+bool CheckUpperBoundInvariants(int n, const std::vector<R>& energyTable,
+        const std::vector<R>& upperBound);
+
+template <typename R>
+double DiffL1(const std::vector<R>& e1, const std::vector<R>& e2);
+template <typename R>
+double DiffL2(const std::vector<R>& e1, const std::vector<R>& e2);
+template <typename R>
+double DiffLInfty(const std::vector<R>& e1, const std::vector<R>& e2);
 
 /********************** Implementation *************************/
 
@@ -50,12 +64,13 @@ static inline Assgn NextPerm(Assgn v) {
     return (t + 1) | (((~t & -~t) - 1) >> (__builtin_ctz(v) + 1));
 }
 
-inline void UpperBoundCVPR14(int n, const std::vector<REAL>& origEnergy, std::vector<REAL>& energyTable) {
+template <typename R>
+inline void UpperBoundCVPR14(int n, const std::vector<R>& origEnergy, std::vector<R>& energyTable) {
     ASSERT(n < 32);
     int max_assgn = 1 << n;
     for (int i = 0; i < max_assgn; ++i)
         energyTable[i] = origEnergy[i];
-    std::vector<REAL> psi(max_assgn, 0);
+    std::vector<R> psi(max_assgn, 0);
     while (!CheckSubmodular(n, energyTable)) {
         // Reset psi
         for (auto& p : psi)
@@ -79,11 +94,11 @@ inline void UpperBoundCVPR14(int n, const std::vector<REAL>& origEnergy, std::ve
                         Assgn s_j = s | (1 << j); // Set s + j
                         if (s_j == s) continue;
                         Assgn s_ij = s_i | s_j;
-                        REAL delta_Sij = energyTable[s] + energyTable[s_ij]
+                        R delta_Sij = energyTable[s] + energyTable[s_ij]
                             - energyTable[s_i] - energyTable[s_j];
                         if (delta_Sij > 0) {
-                            REAL shift = (delta_Sij + 1) / 2;
-                            //REAL rem = delta_Sij % 2;
+                            R shift = (delta_Sij + 1) / 2;
+                            //R rem = delta_Sij % 2;
                             psi[s_i] = std::max(psi[s_i], shift);
                             psi[s_j] = std::max(psi[s_j], shift);
                         }
@@ -104,18 +119,19 @@ inline void UpperBoundCVPR14(int n, const std::vector<REAL>& origEnergy, std::ve
 }
 
 
-inline void ChenUpperBound(int n, const std::vector<REAL>& origEnergy, std::vector<REAL>& energyTable) {
+template <typename R>
+inline void ChenUpperBound(int n, const std::vector<R>& origEnergy, std::vector<R>& energyTable) {
     ASSERT(n < 32);
     int max_assgn = 1 << n;
     for (int i = 0; i < max_assgn; ++i)
         energyTable[i] = origEnergy[i];
-    std::vector<REAL> oldEnergy(energyTable);
-    std::vector<REAL> diffEnergy(max_assgn, 0);
+    std::vector<R> oldEnergy(energyTable);
+    std::vector<R> diffEnergy(max_assgn, 0);
     int loopIterations = 0;
-    std::vector<REAL> sumEnergy;
+    std::vector<R> sumEnergy;
     while (!CheckSubmodular(n, energyTable)) {
         loopIterations++;
-        REAL iterSumEnergy = 0;
+        R iterSumEnergy = 0;
         for (int i = 0; i < max_assgn; ++i)
             iterSumEnergy += energyTable[i];
         sumEnergy.push_back(iterSumEnergy);
@@ -158,7 +174,7 @@ inline void ChenUpperBound(int n, const std::vector<REAL>& origEnergy, std::vect
                 bool t = false;
                 for (int j = 0; j < n; ++j) {
                     if (i & (1 << j)) {
-                        REAL tmp = diffEnergy[ik ^ (1 << j)];
+                        R tmp = diffEnergy[ik ^ (1 << j)];
                         if (tmp < diffEnergy[ik] / 2) {
                             t = true;
                             break;
@@ -168,7 +184,7 @@ inline void ChenUpperBound(int n, const std::vector<REAL>& origEnergy, std::vect
                     }
                 }
                 if (t) {
-                    REAL tmp = (diffEnergy[i | (1 << k)] + 1) / 2;
+                    R tmp = (diffEnergy[i | (1 << k)] + 1) / 2;
                     if (tmp > diffEnergy[i])
                         diffEnergy[i] = tmp;
                 }
@@ -181,11 +197,12 @@ inline void ChenUpperBound(int n, const std::vector<REAL>& origEnergy, std::vect
     }
 }
 
-inline REAL SubmodularLowerBound(int n, std::vector<REAL>& energyTable, bool early_finish) {
+template <typename R>
+inline R SubmodularLowerBound(int n, std::vector<R>& energyTable, bool early_finish) {
     ASSERT(n < 32);
     Assgn max_assgn = 1 << n;
     ASSERT(energyTable.size() == max_assgn);
-    REAL max_diff = 0;
+    R max_diff = 0;
 
     // Need to iterate over all k bit subsets in increasing k
     for (int k = 1; k <= n; ++k) {
@@ -195,7 +212,7 @@ inline REAL SubmodularLowerBound(int n, std::vector<REAL>& energyTable, bool ear
         else bound = max_assgn - 1;
         Assgn s = (1 << k) - 1;
         do {
-            REAL subtract_from_s = 0;
+            R subtract_from_s = 0;
             for (int i = 0; i < n; ++i) {
                 Assgn s_i = s ^ (1 << i); // Set s - i
                 if (s_i >= s) continue;
@@ -203,7 +220,7 @@ inline REAL SubmodularLowerBound(int n, std::vector<REAL>& energyTable, bool ear
                     Assgn s_j = s ^ (1 << j); // Set s - j
                     if (s_j >= s) continue;
                     Assgn s_ij = s_i & s_j;
-                    REAL submodularity = energyTable[s] + energyTable[s_ij]
+                    R submodularity = energyTable[s] + energyTable[s_ij]
                         - energyTable[s_i] - energyTable[s_j];
                     if (submodularity > subtract_from_s) {
                         subtract_from_s = submodularity;
@@ -221,18 +238,20 @@ inline REAL SubmodularLowerBound(int n, std::vector<REAL>& energyTable, bool ear
     return max_diff;
 }
 
-inline void ZeroMarginalSet(int n, std::vector<REAL>& energyTable, Assgn s) {
+template <typename R>
+inline void ZeroMarginalSet(int n, std::vector<R>& energyTable, Assgn s) {
     Assgn base_set = (1 << n) - 1;
     Assgn not_s = base_set & (~s);
     for (Assgn t = 0; t <= base_set; ++t)
         energyTable[t] = energyTable[t & not_s];
 }
 
-inline void AddLinear(int n, std::vector<REAL>& energyTable, const std::vector<REAL>& psi) {
+template <typename R>
+inline void AddLinear(int n, std::vector<R>& energyTable, const std::vector<R>& psi) {
     Assgn max_assgn = 1 << n;
     ASSERT(max_assgn == energyTable.size());
     ASSERT(n == int(psi.size()));
-    REAL sum = 0;
+    R sum = 0;
     Assgn last_gray = 0;
     for (Assgn a = 1; a < max_assgn; ++a) {
         Assgn gray = a ^ (a >> 1);
@@ -247,13 +266,14 @@ inline void AddLinear(int n, std::vector<REAL>& energyTable, const std::vector<R
     }
 }
 
-inline void SubtractLinear(int n, std::vector<REAL>& energyTable, 
-        const std::vector<REAL>& psi1, const std::vector<REAL>& psi2) {
+template <typename R>
+inline void SubtractLinear(int n, std::vector<R>& energyTable, 
+        const std::vector<R>& psi1, const std::vector<R>& psi2) {
     Assgn max_assgn = 1 << n;
     ASSERT(max_assgn == energyTable.size());
     ASSERT(n == int(psi1.size()));
     ASSERT(n == int(psi2.size()));
-    REAL sum = 0;
+    R sum = 0;
     for (int i = 0; i < n; ++i)
         sum += psi2[i];
     energyTable[0] -= sum;
@@ -271,7 +291,8 @@ inline void SubtractLinear(int n, std::vector<REAL>& energyTable,
     }
 }
 
-inline void Normalize(int n, std::vector<REAL>& energyTable, std::vector<REAL>& psi) {
+template <typename R>
+inline void Normalize(int n, std::vector<R>& energyTable, std::vector<R>& psi) {
     Assgn max_assgn = 1 << n;
     ASSERT(max_assgn == energyTable.size());
     ASSERT(n == int(psi.size()));
@@ -287,13 +308,14 @@ inline void Normalize(int n, std::vector<REAL>& energyTable, std::vector<REAL>&
     }
     AddLinear(n, energyTable, psi);
 
-    for (REAL e : energyTable)
+    for (R e : energyTable)
         ASSERT(e >= 0);
     ASSERT(energyTable[0] == 0);
     ASSERT(energyTable[max_assgn-1] == 0);
 }
 
-inline bool CheckSubmodular(int n, const std::vector<REAL>& energyTable) {
+template <typename R>
+inline bool CheckSubmodular(int n, const std::vector<R>& energyTable) {
     ASSERT(n < 32);
     Assgn max_assgn = 1 << n;
     ASSERT(energyTable.size() == max_assgn);
@@ -307,7 +329,7 @@ inline bool CheckSubmodular(int n, const std::vector<REAL>& energyTable) {
                 if (s_j == s) continue;
                 Assgn s_ij = s_i | s_j;
 
-                REAL submodularity = energyTable[s] + energyTable[s_ij]
+                R submodularity = energyTable[s] + energyTable[s_ij]
                     - energyTable[s_i] - energyTable[s_j];
                 if (submodularity > 0) {
                     //std::cout << "Nonsubmodular: (" << s << ", " << i << ", " << j << "): ";
@@ -321,11 +343,12 @@ inline bool CheckSubmodular(int n, const std::vector<REAL>& energyTable) {
     return true;
 }
 
-inline bool CheckUpperBoundInvariants(int n, const std::vector<REAL>& energyTable,
-        const std::vector<REAL>& upperBound) {
+template <typename R>
+inline bool CheckUpperBoundInvariants(int n, const std::vector<R>& energyTable,
+        const std::vector<R>& upperBound) {
     int energy_len = energyTable.size();
     ASSERT(energy_len == int(upperBound.size()));
-    REAL max_energy = std::numeric_limits<REAL>::min();
+    R max_energy = std::numeric_limits<R>::min();
     for (int i = 0; i < energy_len; ++i) {
         if (energyTable[i] > upperBound[i])
             return false;
@@ -13,9 +13,42 @@
 
 #include "sos-graph.hpp"
 
+/** What the flow solver did in the last solve. Each solver fills in the
+ * phases and counts it has, and leaves the others at 0.
+ */
+struct FlowStats {
+    // Seconds spent in the whole solve, and in each phase of it
+    double totalTime = 0;
+    double initTime = 0;
+    double augmentTime = 0;
+    double adoptTime = 0;
+    double growTime = 0;
+    double relabelTime = 0;
+    double regionTime = 0;
+
+    size_t cliquePushes = 0;
+    size_t augmentations = 0;
+    size_t orphansAdopted = 0;
+    // Nodes moved to a higher distance label, by an orphan that found no
+    // parent at its old distance or by a push-relabel relabel
+    size_t relabels = 0;
+    size_t globalRelabels = 0;
+    // Residual arcs found while growing trees, discharging and relabeling
+    size_t arcsScanned = 0;
+    // Exchange capacities computed for bottlenecks and pushes (ResCap).
+    // Checking whether an arc is residual is cheaper, and isn't counted.
+    size_t exchangeCapacityCalls = 0;
+    // Highest distance label given to a node in a search tree, or for
+    // push-relabel, the highest label below the number of nodes
+    int maxTreeDepth = 0;
+
+    // Add up the stats of solves on separate parts of a graph
+    FlowStats& operator+=(const FlowStats& other);
+};
+
 struct SubmodularIBFSParams {
     enum class FlowAlgorithm {
-        bidirectional, source, parametric
+        bidirectional, source, parametric, excess, pushRelabel, region
     };
     static std::vector<std::pair<FlowAlgorithm, std::string>> algNames;
 
@@ -25,16 +58,39 @@ struct SubmodularIBFSParams {
     { }
 
     FlowAlgorithm alg = FlowAlgorithm::bidirectional;
-    SoSGraph::UBfn ub = SoSGraph::UBfn::cvpr14;
+    SoSGraphBase::UBfn ub = SoSGraphBase::UBfn::cvpr14;
     std::vector<bool> fixedVars;
+    // Cache exchange capacities per clique (see SoSGraph::SetCapacityCache)
+    bool cacheCapacities = false;
+    // Merge duplicate cliques and fold modular ones into the unaries
+    // before the first solve (see SoSGraph::CompactCliques)
+    bool compactCliques = false;
+    // Keep the flow from one Solve to the next, and only repair what
+    // changed in between (see SoSGraph::RepairFlow)
+    bool dynamic = false;
+    // Threads for growing the search trees of the bidirectional solver,
+    // or 0 for as many as OpenMP offers. Only used in builds with OpenMP,
+    // and on graphs without cardinality cliques.
+    int threads = 1;
+    // Blocks of consecutive node ids for the region solver to discharge
+    // in parallel, or 0 for one per thread. Graphs with cardinality
+    // cliques use a single region.
+    int regions = 0;
+    // Solve the parts of the graph that can't exchange flow (once fixed
+    // nodes and modular cliques are left out, see SoSGraph::FindComponents)
+    // separately, several at once with threads. Not used in dynamic mode.
+    bool components = false;
 };
 
+template <typename R>
 class FlowSolver;
-/** Algorithm for sum-of-submodular IBFS 
+/** Algorithm for sum-of-submodular IBFS, with energies and capacities of
+ * type R (see SoSGraph)
  */
+template <typename R = REAL>
 class SubmodularIBFS {
     public:
-        typedef SoSGraph::NodeId NodeId;
+        typedef SoSGraphBase::NodeId NodeId;
 
         SubmodularIBFS(SubmodularIBFSParams params = {});
         ~SubmodularIBFS(); // Needed for unique_ptr with incomplete type
@@ -54,41 +110,91 @@ class SubmodularIBFS {
 
         /** Add a constant to the energy function
          */
-        void AddConstantTerm(REAL c) { m_constant_term += c; }
+        void AddConstantTerm(R c) { m_constant_term += c; }
 
         /** AddUnaryTerm for node n, with cost E0 for not being in S and E1
          * for being in S
          */
-        void AddUnaryTerm(NodeId n, REAL E0, REAL E1);
-        void AddUnaryTerm(NodeId n, REAL coeff);
+        void AddUnaryTerm(NodeId n, R E0, R E1);
+        void AddUnaryTerm(NodeId n, R coeff);
         void ClearUnaries();
+        /** Add lambda*slope to the cost of node n not being in S, for
+         * SolveParametric. slope must be >= 0, so that raising lambda only
+         * makes S more attractive.
+         */
+        void AddParametricUnaryTerm(NodeId n, R slope);
+
+        /** Reserve space for the given numbers of nodes and cliques, and for
+         * the total number of clique nodes and energy table entries. See
+         * SoSGraph::Reserve.
+         */
+        void Reserve(NodeId num_nodes, size_t num_cliques, size_t num_clique_nodes, size_t num_table_entries);
 
         // Add Clique defined by nodes and energy table given
-        void AddClique(const std::vector<NodeId>& nodes, const std::vector<REAL>& energyTable);
-        void AddPairwiseTerm(NodeId i, NodeId j, REAL E00, REAL E01, REAL E10, REAL E11);
+        void AddClique(const std::vector<NodeId>& nodes, const std::vector<R>& energyTable);
+        // Same, for k nodes and a table of 2^k entries, without the vectors
+        void AddClique(const NodeId* nodes, size_t k, const R* energyTable);
+        // Add a term on nodes i and j, with energies laid out as in a table
+        // (so E01 is the energy with only i labeled 1). Submodular terms
+        // become plain arcs (see SoSGraph::AddPairwiseClique).
+        void AddPairwiseTerm(NodeId i, NodeId j, R E00, R E01, R E10, R E11);
+        // Add a Potts clique: cost lambda >= 0 unless all nodes agree
+        void AddPottsClique(const std::vector<NodeId>& nodes, R lambda);
+        /** Add a clique with energy h[c] when c of its nodes are labeled 1,
+         * for a concave h of nodes.size()+1 entries. h[0] goes into the
+         * constant term.
+         */
+        void AddCardinalityClique(const std::vector<NodeId>& nodes, const std::vector<R>& h);
 
         void Solve();
+        /** Solve for each of lambdas, which must be in increasing order,
+         * with the parametric unaries at that lambda. The flow of each
+         * solve is the start of the next, and the cuts are nested: once a
+         * node is in S it stays there. Needs FlowAlgorithm::parametric.
+         *
+         * breakpoints[n] is the index of the first lambda with n in S, or
+         * lambdas.size() if there is none. The labels are left at the last
+         * lambda, and the unaries without the parametric terms.
+         */
+        void SolveParametric(const std::vector<R>& lambdas, std::vector<size_t>& breakpoints);
 
         // Compute the total energy across all cliques of the current labeling
-        REAL ComputeEnergy() const;
-        REAL ComputeEnergy(const std::vector<int>& labels) const;
+        R ComputeEnergy() const;
+        R ComputeEnergy(const std::vector<int>& labels) const;
 
-        SoSGraph& Graph() { return m_graph; }
+        SoSGraph<R>& Graph() { return m_graph; }
         const SubmodularIBFSParams& Params() const { return m_params; }
         SubmodularIBFSParams& Params() { return m_params; }
-        SoSGraph::NormStats* NormStats() { return &m_normStats; }
+        SoSGraphBase::NormStats* NormStats() { return &m_normStats; }
+        // Stats of the last Solve or SolveParametric. With params.components
+        // the parts are added up, so the times are the sum over all threads.
+        const FlowStats& Stats() const { return m_flowStats; }
+        const std::vector<R>& ParametricUnaries() const { return m_parametric_unaries; }
 
     protected:
+        // Components smaller than this are packed together into one solve,
+        // to spread the cost of setting up a solver
+        static const NodeId kMinBatchNodes = 1024;
+        // If a component holds more than this share of the nodes, copying
+        // it costs more than the split saves, so solve the graph as a whole
+        static constexpr double kMaxComponentShare = 0.5;
+
+        // Solve with params.components, or return false to leave it to
+        // the flow solver
+        bool SolveComponents();
+
         /* Graph and energy function definitions */
         SubmodularIBFSParams m_params;
-        SoSGraph m_graph;
-        REAL m_constant_term = 0;
+        SoSGraph<R> m_graph;
+        R m_constant_term = 0;
         std::vector<int> m_labels;
-        std::unique_ptr<FlowSolver> m_flowSolver;
-        SoSGraph::NormStats m_normStats;
+        std::vector<R> m_parametric_unaries;
+        std::unique_ptr<FlowSolver<R>> m_flowSolver;
+        SoSGraphBase::NormStats m_normStats;
+        FlowStats m_flowStats;
 
     public:
-        REAL GetConstantTerm() const { return m_constant_term; }
+        R GetConstantTerm() const { return m_constant_term; }
         std::vector<int>& GetLabels() { return m_labels; }
         const std::vector<int>& GetLabels() const { return m_labels; }
 };
@@ -0,0 +1,45 @@
+#ifndef _SUBSET_KERNELS_HPP_
+#define _SUBSET_KERNELS_HPP_
+
+/** \file subset-kernels.hpp
+ * Vectorized kernels for the subset enumeration at the heart of
+ * IBFSEnergyTableClique::ExchangeCapacity and IBFSEnergyTableClique::Push.
+ *
+ * For a clique of size n and an arc (u, v), both operations visit every
+ * assignment S with u in S and v not in S. All bits below min(u, v) are free,
+ * so these assignments come in contiguous runs of 2^min(u, v) table entries.
+ * The kernels walk precomputed per-(n, u, v) tables of run starts and process
+ * each run with SSE4.2 or AVX2 instructions, falling back to scalar code.
+ * The instruction set is chosen at runtime from what the CPU supports.
+ */
+
+#include "energy-common.hpp"
+
+enum class SimdLevel {
+    scalar, sse4, avx2
+};
+
+/** Best instruction set supported by the CPU we're running on */
+SimdLevel SupportedSimdLevel();
+
+/** Instruction set currently used by SubsetMin and SubsetPush */
+SimdLevel GetSimdLevel();
+
+/** Override the instruction set used by the kernels (mostly for testing and
+ * benchmarking). Requests above SupportedSimdLevel() are clamped.
+ */
+void SetSimdLevel(SimdLevel level);
+
+/** Returns min { table[S] : u in S, v not in S } over subsets S of [0, n).
+ * Instantiated for int32_t and int64_t tables.
+ */
+template <typename R>
+R SubsetMin(const R* table, int n, int u_idx, int v_idx);
+
+/** For all S with u in S and v not in S, subtract delta from table[S] and
+ * add delta to table[S - u + v]
+ */
+template <typename R>
+void SubsetPush(R* table, int n, int u_idx, int v_idx, R delta);
+
+#endif
@@ -3,6 +3,9 @@
 #include <iostream>
 #include <limits>
 #include <chrono>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "submodular-ibfs.hpp"
 
@@ -10,57 +13,73 @@ typedef std::chrono::system_clock::time_point TimePt;
 typedef std::chrono::duration<double> Duration;
 typedef std::chrono::system_clock Clock;
 
-void BidirectionalIBFS::IBFSInit()
+template <typename R>
+void BidirectionalIBFS<R>::IBFSInit()
 {
     auto start = Clock::now();
     
     const int n = m_graph->NumNodes();
 
-    m_source_layers = std::vector<NodeQueue>(n+1);
-    m_sink_layers = std::vector<NodeQueue>(n+1);
+    m_source_layers.Reset(n+1, n+2);
+    m_sink_layers.Reset(n+1, n+2);
+    m_grown.assign(n+2, false);
+    if (m_num_threads > 1 && m_claimed.size() != static_cast<size_t>(n+2)) {
+        m_claimed = std::vector<std::atomic<long>>(n+2);
+        for (auto& claim : m_claimed)
+            claim.store(kUnclaimed, std::memory_order_relaxed);
+    }
 
     m_source_orphans.clear();
     m_sink_orphans.clear();
 
-    auto& nodes = m_graph->GetNodes();
-    auto& sNode = nodes[m_graph->GetS()];
-    sNode.state = NodeState::S;
-    sNode.dis = 0;
-    m_source_layers[0].push_back(sNode);
-    auto& tNode = nodes[m_graph->GetT()];
-    tNode.state = NodeState::T;
-    tNode.dis = 0;
-    m_sink_layers[0].push_back(tNode);
+    const NodeId s = m_graph->GetS();
+    m_graph->State(s) = NodeState::S;
+    m_graph->Dis(s) = 0;
+    m_source_layers.Add(s, 0);
+    const NodeId t = m_graph->GetT();
+    m_graph->State(t) = NodeState::T;
+    m_graph->Dis(t) = 0;
+    m_sink_layers.Add(t, 0);
 
     // saturate all s-i-t paths
     for (NodeId i = 0; i < n; ++i) {
-        REAL min_cap = std::min(m_graph->m_c_si[i]-m_graph->m_phi_si[i],
+        R min_cap = std::min(m_graph->m_c_si[i]-m_graph->m_phi_si[i],
                 m_graph->m_c_it[i]-m_graph->m_phi_it[i]);
         m_graph->m_phi_si[i] += min_cap;
         m_graph->m_phi_it[i] += min_cap;
         if (m_graph->m_c_si[i] > m_graph->m_phi_si[i]) {
-            auto& node = m_graph->node(i);
-            node.state = NodeState::S;
-            node.dis = 1;
+            m_graph->State(i) = NodeState::S;
+            m_graph->Dis(i) = 1;
             AddToLayer(i);
-            node.parent_arc = m_graph->ArcsEnd(i);
-            node.parent = m_graph->GetS();
+            m_graph->SetParentArc(i, m_graph->ArcsEnd(i));
         } else if (m_graph->m_c_it[i] > m_graph->m_phi_it[i]) {
-            auto& node = m_graph->node(i);
-            node.state = NodeState::T;
-            node.dis = 1;
+            m_graph->State(i) = NodeState::T;
+            m_graph->Dis(i) = 1;
             AddToLayer(i);
-            node.parent_arc = m_graph->ArcsEnd(i);
-            node.parent = m_graph->GetT();
+            m_graph->SetParentArc(i, m_graph->ArcsEnd(i));
         } else {
             ASSERT(m_graph->m_c_si[i] == m_graph->m_phi_si[i] 
                 && m_graph->m_c_it[i] == m_graph->m_phi_it[i]);
         }
     }
-    m_initTime += Duration{ Clock::now() - start }.count();
+    m_stats.initTime += Duration{ Clock::now() - start }.count();
+}
+
+template <typename R>
+void BidirectionalIBFS<R>::IBFS() {
+    // Pick the clique size once here, rather than on every arc
+    switch (m_graph->FixedCliqueSize()) {
+        case 2: RunIBFS<2>(); break;
+        case 3: RunIBFS<3>(); break;
+        case 4: RunIBFS<4>(); break;
+        case 9: RunIBFS<9>(); break;
+        default: RunIBFS<0>(); break;
+    }
 }
 
-void BidirectionalIBFS::IBFS() {
+template <typename R>
+template <int K>
+void BidirectionalIBFS<R>::RunIBFS() {
     auto start = Clock::now();
     m_forward_search = false;
     m_source_tree_d = 1;
@@ -68,98 +87,74 @@ void BidirectionalIBFS::IBFS() {
 
     IBFSInit();
 
-    // Set up initial current_q and search nodes to make it look like
-    // we just finished scanning the sink node
-    NodeQueue* current_q = &(m_sink_layers[0]);
-    m_search_node_iter = current_q->end();
-    m_search_node_end = current_q->end();
+    // Set up the search to make it look like we just finished scanning
+    // the sink node
+    m_search_slot = NodeLayers::npos;
 
-    while (!current_q->empty()) {
-        if (m_search_node_iter == m_search_node_end) {
+    while (!SearchLayers().Empty(SearchDis())) {
+        if (m_search_slot == NodeLayers::npos) {
             // Swap queues and continue
-            if (m_forward_search) {
+            if (m_forward_search)
                 m_source_tree_d++;
-                current_q = &(m_sink_layers[m_sink_tree_d]);
-            } else {
+            else
                 m_sink_tree_d++;
-                current_q = &(m_source_layers[m_source_tree_d]);
-            }
-            m_search_node_iter = current_q->begin();
-            m_search_node_end = current_q->end();
             m_forward_search = !m_forward_search;
-            if (!current_q->empty()) {
-                Node& n = *m_search_node_iter;
-                NodeId nodeIdx = n.id;
-                if (m_forward_search) {
-                    ASSERT(n.state == NodeState::S || n.state == NodeState::S_orphan);
-                    m_search_arc = m_graph->ArcsBegin(nodeIdx);
-                    m_search_arc_end = m_graph->ArcsEnd(nodeIdx);
-                } else {
-                    ASSERT(n.state == NodeState::T || n.state == NodeState::T_orphan);
-                    m_search_arc = m_graph->ArcsBegin(nodeIdx);
-                    m_search_arc_end = m_graph->ArcsEnd(nodeIdx);
-                }
-            }
+            if (m_num_threads > 1 && SearchLayers().Size(SearchDis()) >= kMinParallelLayer)
+                GrowLayer<K>();
+            AdvanceSearchNode(0);
             continue;
         }
-        Node& n = *m_search_node_iter;
-        NodeId search_node = n.id;
+        NodeId search_node = SearchLayers().At(SearchDis(), m_search_slot);
         int distance;
         if (m_forward_search) {
             distance = m_source_tree_d;
         } else {
             distance = m_sink_tree_d;
         }
-        ASSERT(n.dis == distance);
+        ASSERT(m_graph->Dis(search_node) == distance);
         // Advance m_search_arc until we find a residual arc
-        while (m_search_arc != m_search_arc_end && !m_graph->NonzeroCap(m_search_arc, m_forward_search))
-            ++m_search_arc;
-
-        if (m_search_arc != m_search_arc_end) {
+        if (m_graph->template NextResidualArc<K>(m_search_arc, m_forward_search)) {
+            m_stats.arcsScanned++;
             NodeId neighbor = m_search_arc.Target();
-            NodeState neighbor_state = m_graph->node(neighbor).state;
-            if (neighbor_state == n.state) {
-                ASSERT(m_graph->node(neighbor).dis <= n.dis + 1);
-                if (m_graph->node(neighbor).dis == n.dis+1) {
+            NodeState neighbor_state = m_graph->State(neighbor);
+            if (neighbor_state == m_graph->State(search_node)) {
+                ASSERT(m_graph->Dis(neighbor) <= m_graph->Dis(search_node) + 1);
+                if (m_graph->Dis(neighbor) == m_graph->Dis(search_node)+1) {
                     auto reverseArc = m_search_arc.Reverse();
-                    if (reverseArc < m_graph->node(neighbor).parent_arc) {
-                        m_graph->node(neighbor).parent_arc = reverseArc;
-                        m_graph->node(neighbor).parent = search_node;
+                    if (reverseArc < m_graph->ParentArc(neighbor)) {
+                        m_graph->SetParentArc(neighbor, reverseArc);
                     }
                 }
                 ++m_search_arc;
             } else if (neighbor_state == NodeState::N) {
                 // Then we found an unlabeled node, add it to the tree
-                m_graph->node(neighbor).state = n.state;
-                m_graph->node(neighbor).dis = n.dis + 1;
+                m_graph->State(neighbor) = m_graph->State(search_node);
+                m_graph->Dis(neighbor) = m_graph->Dis(search_node) + 1;
                 AddToLayer(neighbor);
                 auto reverseArc = m_search_arc.Reverse();
-                m_graph->node(neighbor).parent_arc = reverseArc;
-                ASSERT(m_graph->NonzeroCap(m_graph->node(neighbor).parent_arc, !m_forward_search));
-                m_graph->node(neighbor).parent = search_node;
+                m_graph->SetParentArc(neighbor, reverseArc);
+                ASSERT(m_graph->template NonzeroCap<K>(m_graph->ParentArc(neighbor), !m_forward_search));
                 ++m_search_arc;
             } else {
                 // Then we found an arc to the other tree
                 ASSERT(neighbor_state != NodeState::S_orphan && neighbor_state != NodeState::T_orphan);
-                ASSERT(m_graph->NonzeroCap(m_search_arc, m_forward_search));
-                Augment(m_search_arc);
-                Adopt();
+                ASSERT(m_graph->template NonzeroCap<K>(m_search_arc, m_forward_search));
+                Augment<K>(m_search_arc);
+                Adopt<K>();
             }
         } else {
             // No more arcs to scan from this node, so remove from queue
-            AdvanceSearchNode();
+            AdvanceSearchNode(m_search_slot + 1);
         }
     } // End while
-    m_totalTime += Duration{ Clock::now() - start }.count();
-
-    //std::cout << "Total time:      " << m_totalTime << "\n";
-    //std::cout << "Init time:       " << m_initTime << "\n";
-    //std::cout << "Augment time:    " << m_augmentTime << "\n";
-    //std::cout << "Adopt time:      " << m_adoptTime << "\n";
+    m_stats.totalTime += Duration{ Clock::now() - start }.count();
 }
 
-void BidirectionalIBFS::Augment(ArcIterator& arc) {
+template <typename R>
+template <int K>
+void BidirectionalIBFS<R>::Augment(const ArcIterator& arc) {
     auto start = Clock::now();
+    m_stats.augmentations++;
 
     NodeId i, j;
     if (m_forward_search) {
@@ -169,276 +164,400 @@ void BidirectionalIBFS::Augment(ArcIterator& arc) {
         i = arc.Target();
         j = arc.Source();
     }
-    REAL bottleneck = m_graph->ResCap(arc, m_forward_search);
+    R bottleneck = m_graph->template ResCap<K>(arc, m_forward_search);
+    m_stats.exchangeCapacityCalls++;
     NodeId current = i;
-    NodeId parent = m_graph->node(current).parent;
+    NodeId parent = m_graph->Parent(current);
     while (parent != m_graph->GetS()) {
-        ASSERT(m_graph->node(current).state == NodeState::S);
-        auto& a = m_graph->node(current).parent_arc;
-        bottleneck = std::min(bottleneck, m_graph->ResCap(a, false));
+        ASSERT(m_graph->State(current) == NodeState::S);
+        auto a = m_graph->ParentArc(current);
+        bottleneck = std::min(bottleneck, m_graph->template ResCap<K>(a, false));
+        m_stats.exchangeCapacityCalls++;
         current = parent;
-        parent = m_graph->node(current).parent;
+        parent = m_graph->Parent(current);
     }
-    ASSERT(m_graph->node(current).parent == m_graph->GetS());
+    ASSERT(m_graph->Parent(current) == m_graph->GetS());
     bottleneck = std::min(bottleneck, m_graph->m_c_si[current] - m_graph->m_phi_si[current]);
 
     current = j;
-    parent = m_graph->node(current).parent;
+    parent = m_graph->Parent(current);
     while (parent != m_graph->GetT()) {
-        ASSERT(m_graph->node(current).state == NodeState::T);
-        auto& a = m_graph->node(current).parent_arc;
-        bottleneck = std::min(bottleneck, m_graph->ResCap(a, true));
+        ASSERT(m_graph->State(current) == NodeState::T);
+        auto a = m_graph->ParentArc(current);
+        bottleneck = std::min(bottleneck, m_graph->template ResCap<K>(a, true));
+        m_stats.exchangeCapacityCalls++;
         current = parent;
-        parent = m_graph->node(current).parent;
+        parent = m_graph->Parent(current);
     }
-    ASSERT(m_graph->node(current).parent == m_graph->GetT());
+    ASSERT(m_graph->Parent(current) == m_graph->GetT());
     bottleneck = std::min(bottleneck, m_graph->m_c_it[current] - m_graph->m_phi_it[current]);
     ASSERT(bottleneck > 0);
 
     // Found the bottleneck, now do pushes on the arcs in the path
-    Push(arc, m_forward_search, bottleneck);
+    Push<K>(arc, m_forward_search, bottleneck);
     current = i;
-    parent = m_graph->node(current).parent;
+    parent = m_graph->Parent(current);
     while (parent != m_graph->GetS()) {
-        auto& a = m_graph->node(current).parent_arc;
-        Push(a, false, bottleneck);
+        auto a = m_graph->ParentArc(current);
+        Push<K>(a, false, bottleneck);
         current = parent;
-        parent = m_graph->node(current).parent;
+        parent = m_graph->Parent(current);
     }
-    ASSERT(m_graph->node(current).parent == m_graph->GetS());
+    ASSERT(m_graph->Parent(current) == m_graph->GetS());
     m_graph->m_phi_si[current] += bottleneck;
     if (m_graph->m_phi_si[current] == m_graph->m_c_si[current])
         MakeOrphan(current);
 
     current = j;
-    parent = m_graph->node(current).parent;
+    parent = m_graph->Parent(current);
     while (parent != m_graph->GetT()) {
-        auto& a = m_graph->node(current).parent_arc;
-        Push(a, true, bottleneck);
+        auto a = m_graph->ParentArc(current);
+        Push<K>(a, true, bottleneck);
         current = parent;
-        parent = m_graph->node(current).parent;
+        parent = m_graph->Parent(current);
     }
-    ASSERT(m_graph->node(current).parent == m_graph->GetT());
+    ASSERT(m_graph->Parent(current) == m_graph->GetT());
     m_graph->m_phi_it[current] += bottleneck;
     if (m_graph->m_phi_it[current] == m_graph->m_c_it[current])
         MakeOrphan(current);
 
-    m_augmentTime += Duration{ Clock::now() - start }.count();
+    m_stats.augmentTime += Duration{ Clock::now() - start }.count();
 }
 
-void BidirectionalIBFS::Adopt() {
+template <typename R>
+template <int K>
+void BidirectionalIBFS<R>::Adopt() {
     auto start = Clock::now();
     while (!m_source_orphans.empty()) {
-        Node& n = m_source_orphans.front();
-        NodeId i = n.id;
+        NodeId i = m_source_orphans.front().id;
         m_source_orphans.pop_front();
-        int old_dist = n.dis;
-        while (n.parent_arc != m_graph->ArcsEnd(i)
-                && (m_graph->node(n.parent).state == NodeState::T
-                    || m_graph->node(n.parent).state == NodeState::T_orphan
-                    || m_graph->node(n.parent).state == NodeState::N
-                    || m_graph->node(n.parent).dis != old_dist - 1
-                    || !m_graph->NonzeroCap(n.parent_arc, false))) {
-            ++n.parent_arc;
-            if (n.parent_arc != m_graph->ArcsEnd(i))
-                n.parent = n.parent_arc.Target();
+        m_stats.orphansAdopted++;
+        NodeState& state = m_graph->State(i);
+        int& dis = m_graph->Dis(i);
+        int old_dist = dis;
+        auto parent_arc = m_graph->ParentArc(i);
+        NodeId parent = m_graph->Parent(i);
+        while (parent_arc != m_graph->ArcsEnd(i)
+                && (m_graph->State(parent) == NodeState::T
+                    || m_graph->State(parent) == NodeState::T_orphan
+                    || m_graph->State(parent) == NodeState::N
+                    || m_graph->Dis(parent) != old_dist - 1
+                    || !m_graph->template NonzeroCap<K>(parent_arc, false))) {
+            ++parent_arc;
+            if (parent_arc != m_graph->ArcsEnd(i))
+                parent = parent_arc.Target();
         }
-        if (n.parent_arc == m_graph->ArcsEnd(i)) {
+        if (parent_arc == m_graph->ArcsEnd(i)) {
             RemoveFromLayer(i);
             // We didn't find a new parent with the same label, so do a relabel
-            n.dis = std::numeric_limits<int>::max()-1;
-            for (auto newParentArc = m_graph->ArcsBegin(i); newParentArc != m_graph->ArcsEnd(i); ++newParentArc) {
+            m_stats.relabels++;
+            dis = std::numeric_limits<int>::max()-1;
+            for (auto newParentArc = m_graph->ArcsBegin(i); m_graph->template NextResidualArc<K>(newParentArc, false); ++newParentArc) {
+                m_stats.arcsScanned++;
                 auto target = newParentArc.Target();
-                if (m_graph->node(target).dis < n.dis
-                        && (m_graph->node(target).state == NodeState::S
-                            || m_graph->node(target).state == NodeState::S_orphan)
-                        && m_graph->NonzeroCap(newParentArc, false)) {
-                    n.dis = m_graph->node(target).dis;
-                    n.parent_arc = newParentArc;
-                    ASSERT(m_graph->NonzeroCap(n.parent_arc, false));
-                    n.parent = target;
+                if (m_graph->Dis(target) < dis
+                        && (m_graph->State(target) == NodeState::S
+                            || m_graph->State(target) == NodeState::S_orphan)) {
+                    dis = m_graph->Dis(target);
+                    parent_arc = newParentArc;
+                    ASSERT(m_graph->template NonzeroCap<K>(parent_arc, false));
                 }
             }
-            n.dis++;
+            m_graph->SetParentArc(i, parent_arc);
+            dis++;
             int cutoff_distance = m_source_tree_d;
             if (m_forward_search) cutoff_distance += 1;
-            if (n.dis > cutoff_distance) {
-                n.state = NodeState::N;
+            if (dis > cutoff_distance) {
+                state = NodeState::N;
             } else {
-                n.state = NodeState::S;
+                state = NodeState::S;
                 AddToLayer(i);
             }
-            // FIXME(afix) Should really assert that n.dis > old_dis
+            // FIXME(afix) Should really assert that dis > old_dis
             // but current-arc heuristic isn't watertight at the moment...
-            if (n.dis > old_dist) {
+            if (dis > old_dist) {
                 for (auto arc = m_graph->ArcsBegin(i); arc != m_graph->ArcsEnd(i); ++arc) {
-                    if (m_graph->node(arc.Target()).parent == i)
+                    if (m_graph->Parent(arc.Target()) == i)
                         MakeOrphan(arc.Target());
                 }
             }
         } else {
-            ASSERT(m_graph->NonzeroCap(n.parent_arc, false));
-            n.state = NodeState::S;
+            ASSERT(m_graph->template NonzeroCap<K>(parent_arc, false));
+            m_graph->SetParentArc(i, parent_arc);
+            state = NodeState::S;
         }
     }
     while (!m_sink_orphans.empty()) {
-        Node& n = m_sink_orphans.front();
-        NodeId i = n.id;
+        NodeId i = m_sink_orphans.front().id;
         m_sink_orphans.pop_front();
-        int old_dist = n.dis;
-        while (n.parent_arc != m_graph->ArcsEnd(i)
-                && (m_graph->node(n.parent).state == NodeState::S
-                    || m_graph->node(n.parent).state == NodeState::S_orphan
-                    || m_graph->node(n.parent).state == NodeState::N
-                    || m_graph->node(n.parent).dis != old_dist - 1
-                    || !m_graph->NonzeroCap(n.parent_arc, true))) {
-            ++n.parent_arc;
-            if (n.parent_arc != m_graph->ArcsEnd(i))
-                n.parent = n.parent_arc.Target();
+        m_stats.orphansAdopted++;
+        NodeState& state = m_graph->State(i);
+        int& dis = m_graph->Dis(i);
+        int old_dist = dis;
+        auto parent_arc = m_graph->ParentArc(i);
+        NodeId parent = m_graph->Parent(i);
+        while (parent_arc != m_graph->ArcsEnd(i)
+                && (m_graph->State(parent) == NodeState::S
+                    || m_graph->State(parent) == NodeState::S_orphan
+                    || m_graph->State(parent) == NodeState::N
+                    || m_graph->Dis(parent) != old_dist - 1
+                    || !m_graph->template NonzeroCap<K>(parent_arc, true))) {
+            ++parent_arc;
+            if (parent_arc != m_graph->ArcsEnd(i))
+                parent = parent_arc.Target();
         }
-        if (n.parent_arc == m_graph->ArcsEnd(i)) {
+        if (parent_arc == m_graph->ArcsEnd(i)) {
             RemoveFromLayer(i);
             // We didn't find a new parent with the same label, so do a relabel
-            n.dis = std::numeric_limits<int>::max()-1;
-            for (auto newParentArc = m_graph->ArcsBegin(i); newParentArc != m_graph->ArcsEnd(i); ++newParentArc) {
+            m_stats.relabels++;
+            dis = std::numeric_limits<int>::max()-1;
+            for (auto newParentArc = m_graph->ArcsBegin(i); m_graph->template NextResidualArc<K>(newParentArc, true); ++newParentArc) {
+                m_stats.arcsScanned++;
                 auto target = newParentArc.Target();
-                if (m_graph->node(target).dis < n.dis
-                        && (m_graph->node(target).state == NodeState::T
-                            || m_graph->node(target).state == NodeState::T_orphan)
-                        && m_graph->NonzeroCap(newParentArc, true)) {
-                    n.dis = m_graph->node(target).dis;
-                    n.parent_arc = newParentArc;
-                    ASSERT(m_graph->NonzeroCap(n.parent_arc, true));
-                    n.parent = target;
+                if (m_graph->Dis(target) < dis
+                        && (m_graph->State(target) == NodeState::T
+                            || m_graph->State(target) == NodeState::T_orphan)) {
+                    dis = m_graph->Dis(target);
+                    parent_arc = newParentArc;
+                    ASSERT(m_graph->template NonzeroCap<K>(parent_arc, true));
                 }
             }
-            n.dis++;
+            m_graph->SetParentArc(i, parent_arc);
+            dis++;
             int cutoff_distance = m_sink_tree_d;
             if (!m_forward_search) cutoff_distance += 1;
-            if (n.dis > cutoff_distance) {
-                n.state = NodeState::N;
+            if (dis > cutoff_distance) {
+                state = NodeState::N;
             } else {
-                n.state = NodeState::T;
+                state = NodeState::T;
                 AddToLayer(i);
             }
-            // FIXME(afix) Should really assert that n.dis > old_dis
+            // FIXME(afix) Should really assert that dis > old_dis
             // but current-arc heuristic isn't watertight at the moment...
-            if (n.dis > old_dist) {
+            if (dis > old_dist) {
                 for (auto arc = m_graph->ArcsBegin(i); arc != m_graph->ArcsEnd(i); ++arc) {
-                    if (m_graph->node(arc.Target()).parent == i)
+                    if (m_graph->Parent(arc.Target()) == i)
                         MakeOrphan(arc.Target());
                 }
             }
         } else {
-            ASSERT(m_graph->NonzeroCap(n.parent_arc, true));
-            n.state = NodeState::T;
+            ASSERT(m_graph->template NonzeroCap<K>(parent_arc, true));
+            m_graph->SetParentArc(i, parent_arc);
+            state = NodeState::T;
         }
     }
-    m_adoptTime += Duration{ Clock::now() - start }.count();
+    m_stats.adoptTime += Duration{ Clock::now() - start }.count();
 }
 
-void BidirectionalIBFS::MakeOrphan(NodeId i) {
+/* Scan the layer about to be searched on several threads, adding the
+ * unlabeled nodes it reaches to the next layer. This only reads the flow,
+ * so a node with an arc to the other tree is left for the serial search
+ * to augment from as usual. The others are marked as grown, and the
+ * serial search skips them.
+ *
+ * A node reached from several slots of the layer goes to the lowest one,
+ * with the first arc found from there as its parent arc, and the new
+ * nodes are added in slot order. So the next layer depends only on the
+ * layer, not on the number or timing of the threads. Unlike the serial
+ * search, parent arcs aren't then moved to the smallest arc into the
+ * next layer, which only makes Adopt relabel a little more often.
+ */
+template <typename R>
+template <int K>
+void BidirectionalIBFS<R>::GrowLayer() {
+    auto start = Clock::now();
+    auto& layers = SearchLayers();
+    const int dis = SearchDis();
+    const long size = layers.Size(dis);
+    const bool forward = m_forward_search;
+    const NodeState state = forward ? NodeState::S : NodeState::T;
+    size_t scanned = 0;
+#ifdef _OPENMP
+    #pragma omp parallel num_threads(m_num_threads) reduction(+:scanned)
+#endif
+    {
+#ifdef _OPENMP
+        const int thread = omp_get_thread_num();
+#else
+        const int thread = 0;
+#endif
+        auto& grown = m_grown_nodes[thread];
+        auto& scratch = m_scan_scratch[thread];
+        grown.clear();
+        scratch.Reset();
+#ifdef _OPENMP
+        #pragma omp for schedule(static)
+#endif
+        for (long slot = 0; slot < size; ++slot) {
+            if (!layers.Live(dis, slot))
+                continue;
+            const NodeId i = layers.At(dis, slot);
+            bool done = true;
+            for (auto arc = m_graph->ArcsBegin(i); m_graph->template NextResidualArcShared<K>(arc, forward, scratch); ++arc) {
+                scanned++;
+                const NodeId j = arc.Target();
+                const NodeState neighbor_state = m_graph->State(j);
+                if (neighbor_state == state)
+                    continue;
+                if (neighbor_state == NodeState::N) {
+                    // Lower the claim on j to this slot, if it's lower
+                    long claim = m_claimed[j].load(std::memory_order_relaxed);
+                    while (slot < claim && !m_claimed[j].compare_exchange_weak(claim, slot, std::memory_order_relaxed)) { }
+                    if (slot < claim)
+                        grown.push_back({j, slot, arc.Reverse()});
+                    continue;
+                }
+                done = false;
+                break;
+            }
+            m_grown[i] = done;
+        }
+    }
+    m_stats.arcsScanned += scanned;
+    // A static schedule hands the threads consecutive blocks of slots in
+    // thread order, so this goes through the nodes in slot order. Each
+    // node is added from the first entry with its final claim, which also
+    // clears the claim for the next layer.
+    for (const auto& grown : m_grown_nodes) {
+        for (const auto& g : grown) {
+            const NodeId j = g.node;
+            if (m_claimed[j].load(std::memory_order_relaxed) != g.slot)
+                continue;
+            m_claimed[j].store(kUnclaimed, std::memory_order_relaxed);
+            m_graph->State(j) = state;
+            m_graph->Dis(j) = dis + 1;
+            AddToLayer(j);
+            m_graph->SetParentArc(j, g.parent_arc);
+        }
+    }
+    m_stats.growTime += Duration{ Clock::now() - start }.count();
+}
+
+template <typename R>
+void BidirectionalIBFS<R>::MakeOrphan(NodeId i) {
     Node& n = m_graph->node(i);
-    if (n.state != NodeState::S && n.state != NodeState::T)
+    NodeState& state = m_graph->State(i);
+    if (state != NodeState::S && state != NodeState::T)
         return;
-    if (n.state == NodeState::S) {
-        n.state = NodeState::S_orphan;
+    if (state == NodeState::S) {
+        state = NodeState::S_orphan;
         m_source_orphans.push_back(n);
-    } else if (n.state == NodeState::T) {
-        n.state = NodeState::T_orphan;
+    } else if (state == NodeState::T) {
+        state = NodeState::T_orphan;
         m_sink_orphans.push_back(n);
     }
 }
 
 
-void BidirectionalIBFS::Push(ArcIterator& arc, bool forwardArc, REAL delta) {
+template <typename R>
+template <int K>
+void BidirectionalIBFS<R>::Push(const ArcIterator& arc, bool forwardArc, R delta) {
     ASSERT(delta > 0);
-    m_num_clique_pushes++;
-    auto& c = m_graph->clique(arc.cliqueId());
-    if (forwardArc)
-        c.Push(arc.SourceIdx(), arc.TargetIdx(), delta);
-    else
-        c.Push(arc.TargetIdx(), arc.SourceIdx(), delta);
-    for (NodeId n : c.Nodes()) {
-        if (m_graph->node(n).state == NodeState::N)
+    m_stats.cliquePushes++;
+    m_graph->template Push<K>(arc, forwardArc, delta);
+    for (NodeId n : m_graph->CliqueNodes(arc.cliqueId())) {
+        if (m_graph->State(n) == NodeState::N)
             continue;
-        auto& parent_arc = m_graph->node(n).parent_arc;
-        if (parent_arc != m_graph->ArcsEnd(n) && parent_arc.cliqueId() == arc.cliqueId() && !m_graph->NonzeroCap(parent_arc, m_graph->node(n).state == NodeState::T)) {
+        auto parent_arc = m_graph->ParentArc(n);
+        if (parent_arc != m_graph->ArcsEnd(n) && parent_arc.cliqueId() == arc.cliqueId() && !m_graph->template NonzeroCap<K>(parent_arc, m_graph->State(n) == NodeState::T)) {
             MakeOrphan(n);
         }
     }
 }
 
 
-void BidirectionalIBFS::ComputeMinCut() {
+template <typename R>
+void BidirectionalIBFS<R>::ComputeMinCut() {
     auto& labels = m_energy->GetLabels();
     for (NodeId i = 0; i < m_graph->NumNodes(); ++i) {
-        if (m_graph->node(i).state == NodeState::T)
+        if (m_graph->State(i) == NodeState::T)
             labels[i] = 0;
-        else if (m_graph->node(i).state == NodeState::S)
+        else if (m_graph->State(i) == NodeState::S)
             labels[i] = 1;
         else {
-            ASSERT(m_graph->node(i).state == NodeState::N);
+            ASSERT(m_graph->State(i) == NodeState::N);
             // Put N nodes on whichever side could still grow
             labels[i] = !m_forward_search;
         }
     }
 }
 
-void BidirectionalIBFS::Solve(SubmodularIBFS* energy) {
+template <typename R>
+void BidirectionalIBFS<R>::Solve(SubmodularIBFS<R>* energy) {
+    m_stats = FlowStats{};
     m_energy = energy;
     m_graph = &energy->Graph();
-    m_graph->ResetFlow();
-    m_graph->UpperBoundCliques(energy->Params().ub, energy->Params().fixedVars, energy->GetLabels(), energy->NormStats());
+    m_num_threads = 1;
+#ifdef _OPENMP
+    if (m_graph->SharedScanSafe()) {
+        m_num_threads = energy->Params().threads;
+        if (m_num_threads <= 0)
+            m_num_threads = omp_get_max_threads();
+    }
+#endif
+    m_grown_nodes.resize(m_num_threads);
+    m_scan_scratch.resize(m_num_threads);
+    if (energy->Params().dynamic && m_graph->HasFlow()) {
+        m_graph->RepairFlow(energy->Params().ub, energy->Params().fixedVars, energy->NormStats());
+    } else {
+        m_graph->ResetFlow();
+        m_graph->UpperBoundCliques(energy->Params().ub, energy->Params().fixedVars, energy->GetLabels(), energy->NormStats());
+    }
     IBFS();
     ComputeMinCut();
 }
 
-void BidirectionalIBFS::AddToLayer(NodeId i) {
-    auto& node = m_graph->node(i);
-    int dis = node.dis;
-    if (node.state == NodeState::S) {
-        m_source_layers[dis].push_back(node);
-        if (m_forward_search && node.dis == m_source_tree_d)
-            m_search_node_end = m_source_layers[m_source_tree_d].end();
-    } else if (node.state == NodeState::T) {
-        m_sink_layers[dis].push_back(node);
-        if (!m_forward_search && node.dis == m_sink_tree_d)
-            m_search_node_end = m_sink_layers[m_sink_tree_d].end();
+template <typename R>
+void BidirectionalIBFS<R>::AddToLayer(NodeId i) {
+    int dis = m_graph->Dis(i);
+    m_grown[i] = false;
+    m_stats.maxTreeDepth = std::max(m_stats.maxTreeDepth, dis);
+    if (m_graph->State(i) == NodeState::S) {
+        m_source_layers.Add(i, dis);
+    } else if (m_graph->State(i) == NodeState::T) {
+        m_sink_layers.Add(i, dis);
     } else {
         ASSERT(false);
     }
 }
 
-void BidirectionalIBFS::RemoveFromLayer(NodeId i) {
-    auto& node = m_graph->node(i);
-    if (m_search_node_iter != m_search_node_end && m_search_node_iter->id == i)
-        AdvanceSearchNode();
-    int dis = node.dis;
-    if (node.state == NodeState::S || node.state == NodeState::S_orphan) {
-        auto& layer = m_source_layers[dis];
-        layer.erase(layer.iterator_to(node));
-    } else if (node.state == NodeState::T || node.state == NodeState::T_orphan) {
-        auto& layer = m_sink_layers[dis];
-        layer.erase(layer.iterator_to(node));
+template <typename R>
+void BidirectionalIBFS<R>::RemoveFromLayer(NodeId i) {
+    if (m_search_slot != NodeLayers::npos && SearchLayers().At(SearchDis(), m_search_slot) == i)
+        AdvanceSearchNode(m_search_slot + 1);
+    if (m_graph->State(i) == NodeState::S || m_graph->State(i) == NodeState::S_orphan) {
+        m_source_layers.Remove(i);
+    } else if (m_graph->State(i) == NodeState::T || m_graph->State(i) == NodeState::T_orphan) {
+        m_sink_layers.Remove(i);
     } else {
         ASSERT(false);
     }
 }
 
-void BidirectionalIBFS::AdvanceSearchNode() {
-    m_search_node_iter++;
-    if (m_search_node_iter != m_search_node_end) {
-        Node& n = *m_search_node_iter;
-        NodeId i = n.id;
-        if (m_forward_search) {
-            ASSERT(n.state == NodeState::S || n.state == NodeState::S_orphan);
-            m_search_arc = m_graph->ArcsBegin(i);
-            m_search_arc_end = m_graph->ArcsEnd(i);
-        } else {
-            ASSERT(n.state == NodeState::T || n.state == NodeState::T_orphan);
-            m_search_arc = m_graph->ArcsBegin(i);
-            m_search_arc_end = m_graph->ArcsEnd(i);
-        }
+template <typename R>
+void BidirectionalIBFS<R>::AdvanceSearchNode(size_t slot) {
+    auto& layers = SearchLayers();
+    const int dis = SearchDis();
+    // Skip over the nodes that have left the layer, or that GrowLayer
+    // has already scanned
+    m_search_slot = layers.NextLive(dis, slot);
+    while (m_search_slot != layers.Size(dis) && m_grown[layers.At(dis, m_search_slot)]) {
+        m_grown[layers.At(dis, m_search_slot)] = false;
+        m_search_slot = layers.NextLive(dis, m_search_slot + 1);
+    }
+    if (m_search_slot == layers.Size(dis)) {
+        m_search_slot = NodeLayers::npos;
+        return;
     }
+    NodeId i = layers.At(dis, m_search_slot);
+    if (m_forward_search) {
+        ASSERT(m_graph->State(i) == NodeState::S || m_graph->State(i) == NodeState::S_orphan);
+    } else {
+        ASSERT(m_graph->State(i) == NodeState::T || m_graph->State(i) == NodeState::T_orphan);
+    }
+    m_search_arc = m_graph->ArcsBegin(i);
+    m_search_arc_end = m_graph->ArcsEnd(i);
 }
+
+template class BidirectionalIBFS<int32_t>;
+template class BidirectionalIBFS<int64_t>;
@@ -0,0 +1,464 @@
+#include "flow-solver.hpp"
+
+#include <iostream>
+#include <limits>
+#include <chrono>
+
+#include "submodular-ibfs.hpp"
+
+typedef std::chrono::system_clock::time_point TimePt;
+typedef std::chrono::duration<double> Duration;
+typedef std::chrono::system_clock Clock;
+
+/* Excesses IBFS, after Goldberg, Hed, Kaplan, Kohli, Tarjan and Werneck,
+ * "Faster and More Dynamic Maximum Flow by Incremental Breadth-First
+ * Search", ESA 2015.
+ *
+ * We keep a pseudoflow rather than a flow: both terminal arcs of every node
+ * start out saturated, and a node may be left with an excess or a
+ * deficit. Nodes with an excess are the roots of the source tree, nodes
+ * with a deficit those of the sink tree, and an augmentation carries
+ * excess from the root of one path to the deficit at the root of the
+ * other. Once no residual path joins an excess to a deficit, the nodes
+ * reachable from an excess are a minimum cut.
+ *
+ * Changing capacities only changes excesses, so a dynamic solve (see
+ * SubmodularIBFSParams::dynamic) starts from the excesses the last one
+ * left, with no terminal arcs to repair.
+ */
+
+template <typename R>
+void ExcessIBFS<R>::IBFSInit()
+{
+    auto start = Clock::now();
+
+    const int n = m_graph->NumNodes();
+
+    m_source_layers.Reset(n+1, n+2);
+    m_sink_layers.Reset(n+1, n+2);
+
+    m_source_orphans.clear();
+    m_sink_orphans.clear();
+
+    const NodeId s = m_graph->GetS();
+    m_graph->State(s) = NodeState::S;
+    m_graph->Dis(s) = 0;
+    m_source_layers.Add(s, 0);
+    const NodeId t = m_graph->GetT();
+    m_graph->State(t) = NodeState::T;
+    m_graph->Dis(t) = 0;
+    m_sink_layers.Add(t, 0);
+
+    // saturate all terminal arcs, leaving the difference as excess
+    for (NodeId i = 0; i < n; ++i) {
+        m_excess[i] += (m_graph->m_c_si[i] - m_graph->m_phi_si[i])
+            - (m_graph->m_c_it[i] - m_graph->m_phi_it[i]);
+        m_graph->m_phi_si[i] = m_graph->m_c_si[i];
+        m_graph->m_phi_it[i] = m_graph->m_c_it[i];
+        if (m_excess[i] > 0) {
+            m_graph->State(i) = NodeState::S;
+            m_graph->Dis(i) = 1;
+            AddToLayer(i);
+            m_graph->SetParentArc(i, m_graph->ArcsEnd(i));
+        } else if (m_excess[i] < 0) {
+            m_graph->State(i) = NodeState::T;
+            m_graph->Dis(i) = 1;
+            AddToLayer(i);
+            m_graph->SetParentArc(i, m_graph->ArcsEnd(i));
+        }
+    }
+    m_stats.initTime += Duration{ Clock::now() - start }.count();
+}
+
+template <typename R>
+void ExcessIBFS<R>::IBFS() {
+    // Pick the clique size once here, rather than on every arc
+    switch (m_graph->FixedCliqueSize()) {
+        case 2: RunIBFS<2>(); break;
+        case 3: RunIBFS<3>(); break;
+        case 4: RunIBFS<4>(); break;
+        case 9: RunIBFS<9>(); break;
+        default: RunIBFS<0>(); break;
+    }
+}
+
+template <typename R>
+template <int K>
+void ExcessIBFS<R>::RunIBFS() {
+    auto start = Clock::now();
+    m_forward_search = false;
+    m_source_tree_d = 1;
+    m_sink_tree_d = 0;
+
+    IBFSInit();
+
+    // Set up the search to make it look like we just finished scanning
+    // the sink node
+    m_search_slot = NodeLayers::npos;
+
+    while (!SearchLayers().Empty(SearchDis())) {
+        if (m_search_slot == NodeLayers::npos) {
+            // Swap queues and continue
+            if (m_forward_search)
+                m_source_tree_d++;
+            else
+                m_sink_tree_d++;
+            m_forward_search = !m_forward_search;
+            AdvanceSearchNode(0);
+            continue;
+        }
+        NodeId search_node = SearchLayers().At(SearchDis(), m_search_slot);
+        int distance;
+        if (m_forward_search) {
+            distance = m_source_tree_d;
+        } else {
+            distance = m_sink_tree_d;
+        }
+        ASSERT(m_graph->Dis(search_node) == distance);
+        // Advance m_search_arc until we find a residual arc
+        if (m_graph->template NextResidualArc<K>(m_search_arc, m_forward_search)) {
+            m_stats.arcsScanned++;
+            NodeId neighbor = m_search_arc.Target();
+            NodeState neighbor_state = m_graph->State(neighbor);
+            if (neighbor_state == m_graph->State(search_node)) {
+                ASSERT(m_graph->Dis(neighbor) <= m_graph->Dis(search_node) + 1);
+                if (m_graph->Dis(neighbor) == m_graph->Dis(search_node)+1) {
+                    auto reverseArc = m_search_arc.Reverse();
+                    if (reverseArc < m_graph->ParentArc(neighbor)) {
+                        m_graph->SetParentArc(neighbor, reverseArc);
+                    }
+                }
+                ++m_search_arc;
+            } else if (neighbor_state == NodeState::N) {
+                // Then we found an unlabeled node, add it to the tree
+                m_graph->State(neighbor) = m_graph->State(search_node);
+                m_graph->Dis(neighbor) = m_graph->Dis(search_node) + 1;
+                AddToLayer(neighbor);
+                auto reverseArc = m_search_arc.Reverse();
+                m_graph->SetParentArc(neighbor, reverseArc);
+                ASSERT(m_graph->template NonzeroCap<K>(m_graph->ParentArc(neighbor), !m_forward_search));
+                ++m_search_arc;
+            } else {
+                // Then we found an arc to the other tree
+                ASSERT(neighbor_state != NodeState::S_orphan && neighbor_state != NodeState::T_orphan);
+                ASSERT(m_graph->template NonzeroCap<K>(m_search_arc, m_forward_search));
+                Augment<K>(m_search_arc);
+                Adopt<K>();
+            }
+        } else {
+            // No more arcs to scan from this node, so remove from queue
+            AdvanceSearchNode(m_search_slot + 1);
+        }
+    } // End while
+    m_stats.totalTime += Duration{ Clock::now() - start }.count();
+}
+
+template <typename R>
+template <int K>
+void ExcessIBFS<R>::Augment(const ArcIterator& arc) {
+    auto start = Clock::now();
+    m_stats.augmentations++;
+
+    NodeId i, j;
+    if (m_forward_search) {
+        i = arc.Source();
+        j = arc.Target();
+    } else {
+        i = arc.Target();
+        j = arc.Source();
+    }
+    R bottleneck = m_graph->template ResCap<K>(arc, m_forward_search);
+    m_stats.exchangeCapacityCalls++;
+    NodeId current = i;
+    NodeId parent = m_graph->Parent(current);
+    while (parent != m_graph->GetS()) {
+        ASSERT(m_graph->State(current) == NodeState::S);
+        auto a = m_graph->ParentArc(current);
+        bottleneck = std::min(bottleneck, m_graph->template ResCap<K>(a, false));
+        m_stats.exchangeCapacityCalls++;
+        current = parent;
+        parent = m_graph->Parent(current);
+    }
+    const NodeId source_root = current;
+    bottleneck = std::min(bottleneck, m_excess[source_root]);
+
+    current = j;
+    parent = m_graph->Parent(current);
+    while (parent != m_graph->GetT()) {
+        ASSERT(m_graph->State(current) == NodeState::T);
+        auto a = m_graph->ParentArc(current);
+        bottleneck = std::min(bottleneck, m_graph->template ResCap<K>(a, true));
+        m_stats.exchangeCapacityCalls++;
+        current = parent;
+        parent = m_graph->Parent(current);
+    }
+    const NodeId sink_root = current;
+    bottleneck = std::min(bottleneck, -m_excess[sink_root]);
+    ASSERT(bottleneck > 0);
+
+    // Found the bottleneck, now do pushes on the arcs in the path
+    Push<K>(arc, m_forward_search, bottleneck);
+    current = i;
+    while (current != source_root) {
+        auto a = m_graph->ParentArc(current);
+        Push<K>(a, false, bottleneck);
+        current = a.Target();
+    }
+    m_excess[source_root] -= bottleneck;
+    if (m_excess[source_root] == 0)
+        MakeOrphan(source_root);
+
+    current = j;
+    while (current != sink_root) {
+        auto a = m_graph->ParentArc(current);
+        Push<K>(a, true, bottleneck);
+        current = a.Target();
+    }
+    m_excess[sink_root] += bottleneck;
+    if (m_excess[sink_root] == 0)
+        MakeOrphan(sink_root);
+
+    m_stats.augmentTime += Duration{ Clock::now() - start }.count();
+}
+
+template <typename R>
+template <int K>
+void ExcessIBFS<R>::Adopt() {
+    auto start = Clock::now();
+    while (!m_source_orphans.empty()) {
+        NodeId i = m_source_orphans.front().id;
+        m_source_orphans.pop_front();
+        m_stats.orphansAdopted++;
+        NodeState& state = m_graph->State(i);
+        int& dis = m_graph->Dis(i);
+        int old_dist = dis;
+        auto parent_arc = m_graph->ParentArc(i);
+        NodeId parent = m_graph->Parent(i);
+        while (parent_arc != m_graph->ArcsEnd(i)
+                && (m_graph->State(parent) == NodeState::T
+                    || m_graph->State(parent) == NodeState::T_orphan
+                    || m_graph->State(parent) == NodeState::N
+                    || m_graph->Dis(parent) != old_dist - 1
+                    || !m_graph->template NonzeroCap<K>(parent_arc, false))) {
+            ++parent_arc;
+            if (parent_arc != m_graph->ArcsEnd(i))
+                parent = parent_arc.Target();
+        }
+        if (parent_arc == m_graph->ArcsEnd(i)) {
+            RemoveFromLayer(i);
+            // We didn't find a new parent with the same label, so do a relabel
+            m_stats.relabels++;
+            dis = std::numeric_limits<int>::max()-1;
+            for (auto newParentArc = m_graph->ArcsBegin(i); m_graph->template NextResidualArc<K>(newParentArc, false); ++newParentArc) {
+                m_stats.arcsScanned++;
+                auto target = newParentArc.Target();
+                if (m_graph->Dis(target) < dis
+                        && (m_graph->State(target) == NodeState::S
+                            || m_graph->State(target) == NodeState::S_orphan)) {
+                    dis = m_graph->Dis(target);
+                    parent_arc = newParentArc;
+                    ASSERT(m_graph->template NonzeroCap<K>(parent_arc, false));
+                }
+            }
+            m_graph->SetParentArc(i, parent_arc);
+            dis++;
+            int cutoff_distance = m_source_tree_d;
+            if (m_forward_search) cutoff_distance += 1;
+            if (dis > cutoff_distance) {
+                state = NodeState::N;
+            } else {
+                state = NodeState::S;
+                AddToLayer(i);
+            }
+            // FIXME(afix) Should really assert that dis > old_dis
+            // but current-arc heuristic isn't watertight at the moment...
+            if (dis > old_dist) {
+                for (auto arc = m_graph->ArcsBegin(i); arc != m_graph->ArcsEnd(i); ++arc) {
+                    if (m_graph->Parent(arc.Target()) == i)
+                        MakeOrphan(arc.Target());
+                }
+            }
+        } else {
+            ASSERT(m_graph->template NonzeroCap<K>(parent_arc, false));
+            m_graph->SetParentArc(i, parent_arc);
+            state = NodeState::S;
+        }
+    }
+    while (!m_sink_orphans.empty()) {
+        NodeId i = m_sink_orphans.front().id;
+        m_sink_orphans.pop_front();
+        m_stats.orphansAdopted++;
+        NodeState& state = m_graph->State(i);
+        int& dis = m_graph->Dis(i);
+        int old_dist = dis;
+        auto parent_arc = m_graph->ParentArc(i);
+        NodeId parent = m_graph->Parent(i);
+        while (parent_arc != m_graph->ArcsEnd(i)
+                && (m_graph->State(parent) == NodeState::S
+                    || m_graph->State(parent) == NodeState::S_orphan
+                    || m_graph->State(parent) == NodeState::N
+                    || m_graph->Dis(parent) != old_dist - 1
+                    || !m_graph->template NonzeroCap<K>(parent_arc, true))) {
+            ++parent_arc;
+            if (parent_arc != m_graph->ArcsEnd(i))
+                parent = parent_arc.Target();
+        }
+        if (parent_arc == m_graph->ArcsEnd(i)) {
+            RemoveFromLayer(i);
+            // We didn't find a new parent with the same label, so do a relabel
+            m_stats.relabels++;
+            dis = std::numeric_limits<int>::max()-1;
+            for (auto newParentArc = m_graph->ArcsBegin(i); m_graph->template NextResidualArc<K>(newParentArc, true); ++newParentArc) {
+                m_stats.arcsScanned++;
+                auto target = newParentArc.Target();
+                if (m_graph->Dis(target) < dis
+                        && (m_graph->State(target) == NodeState::T
+                            || m_graph->State(target) == NodeState::T_orphan)) {
+                    dis = m_graph->Dis(target);
+                    parent_arc = newParentArc;
+                    ASSERT(m_graph->template NonzeroCap<K>(parent_arc, true));
+                }
+            }
+            m_graph->SetParentArc(i, parent_arc);
+            dis++;
+            int cutoff_distance = m_sink_tree_d;
+            if (!m_forward_search) cutoff_distance += 1;
+            if (dis > cutoff_distance) {
+                state = NodeState::N;
+            } else {
+                state = NodeState::T;
+                AddToLayer(i);
+            }
+            // FIXME(afix) Should really assert that dis > old_dis
+            // but current-arc heuristic isn't watertight at the moment...
+            if (dis > old_dist) {
+                for (auto arc = m_graph->ArcsBegin(i); arc != m_graph->ArcsEnd(i); ++arc) {
+                    if (m_graph->Parent(arc.Target()) == i)
+                        MakeOrphan(arc.Target());
+                }
+            }
+        } else {
+            ASSERT(m_graph->template NonzeroCap<K>(parent_arc, true));
+            m_graph->SetParentArc(i, parent_arc);
+            state = NodeState::T;
+        }
+    }
+    m_stats.adoptTime += Duration{ Clock::now() - start }.count();
+}
+
+template <typename R>
+void ExcessIBFS<R>::MakeOrphan(NodeId i) {
+    Node& n = m_graph->node(i);
+    NodeState& state = m_graph->State(i);
+    if (state != NodeState::S && state != NodeState::T)
+        return;
+    if (state == NodeState::S) {
+        state = NodeState::S_orphan;
+        m_source_orphans.push_back(n);
+    } else if (state == NodeState::T) {
+        state = NodeState::T_orphan;
+        m_sink_orphans.push_back(n);
+    }
+}
+
+
+template <typename R>
+template <int K>
+void ExcessIBFS<R>::Push(const ArcIterator& arc, bool forwardArc, R delta) {
+    ASSERT(delta > 0);
+    m_stats.cliquePushes++;
+    m_graph->template Push<K>(arc, forwardArc, delta);
+    for (NodeId n : m_graph->CliqueNodes(arc.cliqueId())) {
+        if (m_graph->State(n) == NodeState::N)
+            continue;
+        auto parent_arc = m_graph->ParentArc(n);
+        if (parent_arc != m_graph->ArcsEnd(n) && parent_arc.cliqueId() == arc.cliqueId() && !m_graph->template NonzeroCap<K>(parent_arc, m_graph->State(n) == NodeState::T)) {
+            MakeOrphan(n);
+        }
+    }
+}
+
+
+template <typename R>
+void ExcessIBFS<R>::ComputeMinCut() {
+    auto& labels = m_energy->GetLabels();
+    for (NodeId i = 0; i < m_graph->NumNodes(); ++i) {
+        if (m_graph->State(i) == NodeState::T)
+            labels[i] = 0;
+        else if (m_graph->State(i) == NodeState::S)
+            labels[i] = 1;
+        else {
+            ASSERT(m_graph->State(i) == NodeState::N);
+            // Put N nodes on whichever side could still grow
+            labels[i] = !m_forward_search;
+        }
+    }
+}
+
+template <typename R>
+void ExcessIBFS<R>::Solve(SubmodularIBFS<R>* energy) {
+    m_stats = FlowStats{};
+    m_energy = energy;
+    m_graph = &energy->Graph();
+    // The excesses left by the last solve are part of its pseudoflow, so
+    // the dynamic mode keeps them, along with the rest of it
+    if (energy->Params().dynamic && m_graph->HasFlow()) {
+        m_graph->RepairFlow(energy->Params().ub, energy->Params().fixedVars, energy->NormStats());
+    } else {
+        m_graph->ResetFlow();
+        m_graph->UpperBoundCliques(energy->Params().ub, energy->Params().fixedVars, energy->GetLabels(), energy->NormStats());
+        m_excess.clear();
+    }
+    m_excess.resize(m_graph->NumNodes(), 0);
+    IBFS();
+    ComputeMinCut();
+}
+
+template <typename R>
+void ExcessIBFS<R>::AddToLayer(NodeId i) {
+    int dis = m_graph->Dis(i);
+    m_stats.maxTreeDepth = std::max(m_stats.maxTreeDepth, dis);
+    if (m_graph->State(i) == NodeState::S) {
+        m_source_layers.Add(i, dis);
+    } else if (m_graph->State(i) == NodeState::T) {
+        m_sink_layers.Add(i, dis);
+    } else {
+        ASSERT(false);
+    }
+}
+
+template <typename R>
+void ExcessIBFS<R>::RemoveFromLayer(NodeId i) {
+    if (m_search_slot != NodeLayers::npos && SearchLayers().At(SearchDis(), m_search_slot) == i)
+        AdvanceSearchNode(m_search_slot + 1);
+    if (m_graph->State(i) == NodeState::S || m_graph->State(i) == NodeState::S_orphan) {
+        m_source_layers.Remove(i);
+    } else if (m_graph->State(i) == NodeState::T || m_graph->State(i) == NodeState::T_orphan) {
+        m_sink_layers.Remove(i);
+    } else {
+        ASSERT(false);
+    }
+}
+
+template <typename R>
+void ExcessIBFS<R>::AdvanceSearchNode(size_t slot) {
+    auto& layers = SearchLayers();
+    const int dis = SearchDis();
+    // Skip over the nodes that have left the layer
+    m_search_slot = layers.NextLive(dis, slot);
+    if (m_search_slot == layers.Size(dis)) {
+        m_search_slot = NodeLayers::npos;
+        return;
+    }
+    NodeId i = layers.At(dis, m_search_slot);
+    if (m_forward_search) {
+        ASSERT(m_graph->State(i) == NodeState::S || m_graph->State(i) == NodeState::S_orphan);
+    } else {
+        ASSERT(m_graph->State(i) == NodeState::T || m_graph->State(i) == NodeState::T_orphan);
+    }
+    m_search_arc = m_graph->ArcsBegin(i);
+    m_search_arc_end = m_graph->ArcsEnd(i);
+}
+
+template class ExcessIBFS<int32_t>;
+template class ExcessIBFS<int64_t>;
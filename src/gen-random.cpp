@@ -59,6 +59,7 @@ void GenRandom(HigherOrder& ho,
 
 typedef HigherOrderEnergy<REAL, 4> HO;
 GEN_RANDOM_INSTANTIATE(HO, REAL);
-GEN_RANDOM_INSTANTIATE(SubmodularIBFS, REAL);
+GEN_RANDOM_INSTANTIATE(SubmodularIBFS<int32_t>, int32_t);
+GEN_RANDOM_INSTANTIATE(SubmodularIBFS<int64_t>, int64_t);
 
 #undef GEN_RANDOM_INSTANTIATE
@@ -0,0 +1,279 @@
+#include "flow-solver.hpp"
+
+#include <iostream>
+#include <limits>
+#include <chrono>
+
+#include "submodular-ibfs.hpp"
+
+typedef std::chrono::system_clock::time_point TimePt;
+typedef std::chrono::duration<double> Duration;
+typedef std::chrono::system_clock Clock;
+
+/* Highest-label push-relabel, in the style of Cherkassky and Goldberg's
+ * HIPR, on the exchange arcs of the cliques.
+ *
+ * Like ExcessIBFS, we work on a pseudoflow: both terminal arcs of every
+ * node start out saturated, leaving nodes with an excess or a deficit. The
+ * nodes with a deficit play the part of the sink, and labels are lower
+ * bounds on the distance to one of them. We only run the first phase of
+ * push-relabel: excess that can't reach a deficit stays where it is, and
+ * the nodes that can reach a deficit are the sink side of a minimum cut.
+ *
+ * Pushing on a clique can open up other arcs of the same clique. For
+ * submodular cliques those keep the labels valid (Fujishige and Zhang),
+ * but not the current arcs, so a relabel that finds a node's label can't
+ * go up just starts the node's arcs over.
+ */
+
+template <typename R>
+void PushRelabel<R>::Init()
+{
+    auto start = Clock::now();
+
+    const int n = m_graph->NumNodes();
+    m_active.resize(n);
+
+    // saturate all terminal arcs, leaving the difference as excess
+    for (NodeId i = 0; i < n; ++i) {
+        m_excess[i] += (m_graph->m_c_si[i] - m_graph->m_phi_si[i])
+            - (m_graph->m_c_it[i] - m_graph->m_phi_it[i]);
+        m_graph->m_phi_si[i] = m_graph->m_c_si[i];
+        m_graph->m_phi_it[i] = m_graph->m_c_it[i];
+    }
+
+    // Count arcs, to decide how often to do a global relabel
+    size_t num_arcs = 0;
+    for (CliqueId c = 0; c < m_graph->GetNumCliques(); ++c) {
+        const size_t k = m_graph->CliqueSize(c);
+        num_arcs += k * (k - 1);
+    }
+    m_global_relabel_work = kGlobalRelabelFreq * (6 * n + num_arcs);
+    m_stats.initTime += Duration{ Clock::now() - start }.count();
+}
+
+template <typename R>
+void PushRelabel<R>::MaxFlow() {
+    // Pick the clique size once here, rather than on every arc
+    switch (m_graph->FixedCliqueSize()) {
+        case 2: RunPushRelabel<2>(); break;
+        case 3: RunPushRelabel<3>(); break;
+        case 4: RunPushRelabel<4>(); break;
+        case 9: RunPushRelabel<9>(); break;
+        default: RunPushRelabel<0>(); break;
+    }
+}
+
+template <typename R>
+template <int K>
+void PushRelabel<R>::RunPushRelabel() {
+    auto start = Clock::now();
+    Init();
+    GlobalRelabel<K>();
+    // The gap heuristic trusts the labels, so finish with a global relabel
+    // to check that no excess can still reach a deficit
+    while (m_max_active >= 0) {
+        while (m_max_active >= 0) {
+            auto& bucket = m_active[m_max_active];
+            if (bucket.empty()) {
+                m_max_active--;
+                continue;
+            }
+            NodeId i = bucket.back();
+            bucket.pop_back();
+            if (m_graph->Dis(i) != m_max_active || m_excess[i] <= 0)
+                continue;
+            Discharge<K>(i);
+            if (m_work > m_global_relabel_work)
+                GlobalRelabel<K>();
+        }
+        GlobalRelabel<K>();
+    }
+    m_stats.totalTime += Duration{ Clock::now() - start }.count();
+}
+
+template <typename R>
+template <int K>
+void PushRelabel<R>::Discharge(NodeId i) {
+    const int n = m_graph->NumNodes();
+    int& dis = m_graph->Dis(i);
+    while (m_excess[i] > 0) {
+        // The parent arc of a node is its current arc
+        auto arc = m_graph->ParentArc(i);
+        for (; m_graph->template NextResidualArc<K>(arc, true); ++arc) {
+            m_stats.arcsScanned++;
+            NodeId j = arc.Target();
+            if (m_graph->Dis(j) != dis - 1)
+                continue;
+            R delta = std::min(m_excess[i], m_graph->template ResCap<K>(arc, true));
+            m_stats.exchangeCapacityCalls++;
+            Push<K>(arc, delta);
+            if (m_excess[i] == 0)
+                break;
+        }
+        m_graph->SetParentArc(i, arc);
+        if (m_excess[i] == 0)
+            break;
+        Relabel<K>(i);
+        if (dis >= n)
+            break;
+    }
+}
+
+template <typename R>
+template <int K>
+void PushRelabel<R>::Push(const ArcIterator& arc, R delta) {
+    ASSERT(delta > 0);
+    m_stats.cliquePushes++;
+    m_graph->template Push<K>(arc, true, delta);
+    NodeId i = arc.Source();
+    NodeId j = arc.Target();
+    m_excess[i] -= delta;
+    bool inactive = (m_excess[j] <= 0);
+    m_excess[j] += delta;
+    if (inactive && m_excess[j] > 0)
+        Activate(j);
+}
+
+template <typename R>
+template <int K>
+void PushRelabel<R>::Relabel(NodeId i) {
+    auto start = Clock::now();
+    const int n = m_graph->NumNodes();
+    int& dis = m_graph->Dis(i);
+    const int old_dis = dis;
+    int new_dis = n;
+    auto current_arc = m_graph->ArcsEnd(i);
+    for (auto arc = m_graph->ArcsBegin(i); m_graph->template NextResidualArc<K>(arc, true); ++arc) {
+        m_work++;
+        m_stats.arcsScanned++;
+        int d = m_graph->Dis(arc.Target()) + 1;
+        if (d < new_dis) {
+            new_dis = d;
+            current_arc = arc;
+        }
+    }
+    if (new_dis == old_dis) {
+        // An admissible arc was opened up behind the current arc
+        m_graph->SetParentArc(i, current_arc);
+        m_stats.relabelTime += Duration{ Clock::now() - start }.count();
+        return;
+    }
+    m_stats.relabels++;
+    m_label_nodes.Remove(i);
+    if (new_dis > old_dis && m_label_nodes.Empty(old_dis)) {
+        // Gap: nothing at or above old_dis can reach a deficit any more
+        dis = n;
+        Gap(old_dis);
+    } else {
+        dis = new_dis;
+        if (dis < n) {
+            m_label_nodes.Add(i, dis);
+            m_max_label = std::max(m_max_label, dis);
+            m_stats.maxTreeDepth = std::max(m_stats.maxTreeDepth, dis);
+            m_graph->SetParentArc(i, current_arc);
+        }
+    }
+    m_stats.relabelTime += Duration{ Clock::now() - start }.count();
+}
+
+template <typename R>
+void PushRelabel<R>::Gap(int gap) {
+    const int n = m_graph->NumNodes();
+    for (int d = gap + 1; d <= m_max_label; ++d) {
+        for (size_t slot = 0; slot < m_label_nodes.Size(d); ++slot) {
+            if (m_label_nodes.Live(d, slot))
+                m_graph->Dis(m_label_nodes.At(d, slot)) = n;
+        }
+        m_label_nodes.Clear(d);
+    }
+    m_max_label = gap - 1;
+}
+
+template <typename R>
+void PushRelabel<R>::Activate(NodeId i) {
+    int dis = m_graph->Dis(i);
+    if (dis >= m_graph->NumNodes())
+        return;
+    m_active[dis].push_back(i);
+    m_max_active = std::max(m_max_active, dis);
+}
+
+template <typename R>
+template <int K>
+void PushRelabel<R>::GlobalRelabel() {
+    auto start = Clock::now();
+    const int n = m_graph->NumNodes();
+    m_label_nodes.Reset(n, n);
+    for (auto& bucket : m_active)
+        bucket.clear();
+    m_max_active = -1;
+    m_max_label = 0;
+
+    // Breadth first search back from the deficits, over residual arcs
+    m_bfs_queue.clear();
+    for (NodeId i = 0; i < n; ++i) {
+        m_graph->SetParentArc(i, m_graph->ArcsBegin(i));
+        if (m_excess[i] < 0) {
+            m_graph->Dis(i) = 0;
+            m_bfs_queue.push_back(i);
+            m_label_nodes.Add(i, 0);
+        } else {
+            m_graph->Dis(i) = n;
+        }
+    }
+    for (size_t q = 0; q < m_bfs_queue.size(); ++q) {
+        NodeId i = m_bfs_queue[q];
+        const int d = m_graph->Dis(i) + 1;
+        for (auto arc = m_graph->ArcsBegin(i); m_graph->template NextResidualArc<K>(arc, false); ++arc) {
+            m_stats.arcsScanned++;
+            NodeId j = arc.Target();
+            if (m_graph->Dis(j) == n) {
+                m_graph->Dis(j) = d;
+                m_bfs_queue.push_back(j);
+                m_label_nodes.Add(j, d);
+                m_max_label = d;
+            }
+        }
+    }
+
+    for (NodeId i = 0; i < n; ++i) {
+        if (m_excess[i] > 0)
+            Activate(i);
+    }
+    m_work = 0;
+    m_stats.globalRelabels++;
+    m_stats.maxTreeDepth = std::max(m_stats.maxTreeDepth, m_max_label);
+    m_stats.relabelTime += Duration{ Clock::now() - start }.count();
+}
+
+template <typename R>
+void PushRelabel<R>::ComputeMinCut() {
+    // Labels are exact after the last global relabel, and the nodes that
+    // can't reach a deficit are on the source side
+    auto& labels = m_energy->GetLabels();
+    for (NodeId i = 0; i < m_graph->NumNodes(); ++i)
+        labels[i] = (m_graph->Dis(i) >= m_graph->NumNodes());
+}
+
+template <typename R>
+void PushRelabel<R>::Solve(SubmodularIBFS<R>* energy) {
+    m_stats = FlowStats{};
+    m_energy = energy;
+    m_graph = &energy->Graph();
+    // As in ExcessIBFS, the excesses left by the last solve are part of
+    // its pseudoflow, so the dynamic mode keeps them
+    if (energy->Params().dynamic && m_graph->HasFlow()) {
+        m_graph->RepairFlow(energy->Params().ub, energy->Params().fixedVars, energy->NormStats());
+    } else {
+        m_graph->ResetFlow();
+        m_graph->UpperBoundCliques(energy->Params().ub, energy->Params().fixedVars, energy->GetLabels(), energy->NormStats());
+        m_excess.clear();
+    }
+    m_excess.resize(m_graph->NumNodes(), 0);
+    MaxFlow();
+    ComputeMinCut();
+}
+
+template class PushRelabel<int32_t>;
+template class PushRelabel<int64_t>;
@@ -0,0 +1,336 @@
+#include "flow-solver.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <chrono>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "submodular-ibfs.hpp"
+
+typedef std::chrono::system_clock::time_point TimePt;
+typedef std::chrono::duration<double> Duration;
+typedef std::chrono::system_clock Clock;
+
+/* Region push-relabel, after Delong and Boykov's region pushes and
+ * Shekhovtsov and Hlavac's region discharge.
+ *
+ * We work on the same pseudoflow as PushRelabel, with the nodes split into
+ * blocks of consecutive ids. For grids numbered row by row those are bands
+ * of rows. A clique is interior if all its nodes are in one region, and a
+ * boundary clique otherwise. Each round:
+ *
+ *  - A global relabel computes exact distances to the deficits, and we
+ *    stop if no excess can reach one.
+ *  - The regions run FIFO push-relabel in parallel, pushing only on their
+ *    interior cliques. Relabels also look across the boundary, at the
+ *    labels of the other regions as of the start of the round, so labels
+ *    stay valid. A node whose only admissible arcs leave the region is
+ *    set aside as blocked.
+ *  - The blocked nodes push on the boundary cliques, one at a time.
+ *
+ * Labels only go up, so every round does some push or relabel, and the
+ * last global relabel shows the cut is a minimum cut.
+ */
+
+template <typename R>
+void RegionPushRelabel<R>::Init()
+{
+    auto start = Clock::now();
+
+    const int n = m_graph->NumNodes();
+
+    // saturate all terminal arcs, leaving the difference as excess
+    for (NodeId i = 0; i < n; ++i) {
+        m_excess[i] += (m_graph->m_c_si[i] - m_graph->m_phi_si[i])
+            - (m_graph->m_c_it[i] - m_graph->m_phi_it[i]);
+        m_graph->m_phi_si[i] = m_graph->m_c_si[i];
+        m_graph->m_phi_it[i] = m_graph->m_c_it[i];
+    }
+
+    const int num_regions = std::max(1, std::min(m_num_regions, n));
+    m_region_size = std::max(1, (n + num_regions - 1) / num_regions);
+    m_regions.resize(std::max(1, (n + m_region_size - 1) / m_region_size));
+    for (size_t r = 0; r < m_regions.size(); ++r) {
+        auto& region = m_regions[r];
+        region.begin = r * m_region_size;
+        region.end = std::min<NodeId>(n, region.begin + m_region_size);
+        region.queue.clear();
+        region.blocked.clear();
+        region.max_work = 6 * (region.end - region.begin);
+    }
+
+    // Sort the cliques into interior and boundary, and count the arcs of
+    // each region to decide how much relabeling it may do in a round
+    const CliqueId num_cliques = m_graph->GetNumCliques();
+    m_interior.assign(num_cliques, 1);
+    m_boundary_cliques.clear();
+    for (CliqueId c = 0; c < num_cliques; ++c) {
+        const auto nodes = m_graph->CliqueNodes(c);
+        const size_t k = m_graph->CliqueSize(c);
+        const int r = RegionOf(nodes[0]);
+        for (size_t idx = 0; idx < k; ++idx) {
+            m_regions[RegionOf(nodes[idx])].max_work += k - 1;
+            if (RegionOf(nodes[idx]) != r)
+                m_interior[c] = 0;
+        }
+        if (!m_interior[c])
+            m_boundary_cliques.push_back(c);
+    }
+    for (auto& region : m_regions)
+        region.max_work *= kGlobalRelabelFreq;
+    m_snapshot.resize(n);
+    m_stats.initTime += Duration{ Clock::now() - start }.count();
+}
+
+template <typename R>
+void RegionPushRelabel<R>::MaxFlow() {
+    // Pick the clique size once here, rather than on every arc
+    switch (m_graph->FixedCliqueSize()) {
+        case 2: RunRegions<2>(); break;
+        case 3: RunRegions<3>(); break;
+        case 4: RunRegions<4>(); break;
+        case 9: RunRegions<9>(); break;
+        default: RunRegions<0>(); break;
+    }
+}
+
+template <typename R>
+template <int K>
+void RegionPushRelabel<R>::RunRegions() {
+    auto start = Clock::now();
+    Init();
+    const int n = m_graph->NumNodes();
+    const int num_regions = m_regions.size();
+    while (GlobalRelabel<K>() > 0) {
+        // Boundary cliques are shared between regions, so fill their
+        // caches now, while nothing else runs
+        for (CliqueId c : m_boundary_cliques)
+            m_graph->template PrepareResidualQueries<K>(c);
+        for (NodeId i = 0; i < n; ++i)
+            m_snapshot[i] = m_graph->Dis(i);
+
+        auto region_start = Clock::now();
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic, 1) num_threads(m_num_threads)
+#endif
+        for (int r = 0; r < num_regions; ++r)
+            DischargeRegion<K>(m_regions[r]);
+        m_stats.regionTime += Duration{ Clock::now() - region_start }.count();
+
+        for (const auto& region : m_regions) {
+            m_stats += region.stats;
+            for (NodeId i : region.blocked)
+                PushBoundary<K>(i);
+        }
+    }
+    m_stats.totalTime += Duration{ Clock::now() - start }.count();
+}
+
+template <typename R>
+template <int K>
+void RegionPushRelabel<R>::DischargeRegion(Region& region) {
+    const int n = m_graph->NumNodes();
+    region.blocked.clear();
+    region.work = 0;
+    region.stats = FlowStats{};
+    // Nodes left in the queue when the region runs out of work stay
+    // active, and the next global relabel picks them up again
+    for (size_t q = 0; q < region.queue.size() && region.work <= region.max_work; ++q) {
+        NodeId i = region.queue[q];
+        if (m_excess[i] > 0 && m_graph->Dis(i) < n)
+            Discharge<K>(region, i);
+    }
+    region.queue.clear();
+}
+
+template <typename R>
+template <int K>
+void RegionPushRelabel<R>::Discharge(Region& region, NodeId i) {
+    const int n = m_graph->NumNodes();
+    int& dis = m_graph->Dis(i);
+    while (m_excess[i] > 0) {
+        // The parent arc of a node is its current arc
+        auto arc = m_graph->ParentArc(i);
+        for (; m_graph->template NextResidualArc<K>(arc, true); ++arc) {
+            region.stats.arcsScanned++;
+            if (!m_interior[arc.cliqueId()])
+                continue;
+            NodeId j = arc.Target();
+            if (m_graph->Dis(j) != dis - 1)
+                continue;
+            R delta = std::min(m_excess[i], m_graph->template ResCap<K>(arc, true));
+            region.stats.exchangeCapacityCalls++;
+            m_graph->template Push<K>(arc, true, delta);
+            region.stats.cliquePushes++;
+            m_excess[i] -= delta;
+            bool inactive = (m_excess[j] <= 0);
+            m_excess[j] += delta;
+            if (inactive && m_excess[j] > 0)
+                region.queue.push_back(j);
+            if (m_excess[i] == 0)
+                break;
+        }
+        m_graph->SetParentArc(i, arc);
+        if (m_excess[i] == 0)
+            break;
+        if (!Relabel<K>(region, i)) {
+            region.blocked.push_back(i);
+            break;
+        }
+        if (dis >= n)
+            break;
+    }
+}
+
+template <typename R>
+template <int K>
+bool RegionPushRelabel<R>::Relabel(Region& region, NodeId i) {
+    const int n = m_graph->NumNodes();
+    const int r = RegionOf(i);
+    int& dis = m_graph->Dis(i);
+    int new_dis = n;
+    int interior_dis = n;
+    auto interior_arc = m_graph->ArcsEnd(i);
+    for (auto arc = m_graph->ArcsBegin(i); m_graph->template NextResidualArc<K>(arc, true); ++arc) {
+        region.work++;
+        region.stats.arcsScanned++;
+        NodeId j = arc.Target();
+        int d = ((RegionOf(j) == r) ? m_graph->Dis(j) : m_snapshot[j]) + 1;
+        new_dis = std::min(new_dis, d);
+        if (m_interior[arc.cliqueId()] && d < interior_dis) {
+            interior_dis = d;
+            interior_arc = arc;
+        }
+    }
+    if (new_dis > dis) {
+        dis = new_dis;
+        region.stats.relabels++;
+    }
+    if (dis >= n) {
+        dis = n;
+        return true;
+    }
+    region.stats.maxTreeDepth = std::max(region.stats.maxTreeDepth, dis);
+    if (interior_dis == dis) {
+        m_graph->SetParentArc(i, interior_arc);
+        return true;
+    }
+    // The lowest neighbors are in other regions: wait for PushBoundary
+    return false;
+}
+
+template <typename R>
+template <int K>
+void RegionPushRelabel<R>::PushBoundary(NodeId i) {
+    const int n = m_graph->NumNodes();
+    const int dis = m_graph->Dis(i);
+    if (m_excess[i] <= 0 || dis >= n)
+        return;
+    for (auto arc = m_graph->ArcsBegin(i); m_graph->template NextResidualArc<K>(arc, true); ++arc) {
+        m_stats.arcsScanned++;
+        if (m_interior[arc.cliqueId()])
+            continue;
+        NodeId j = arc.Target();
+        if (m_graph->Dis(j) != dis - 1)
+            continue;
+        R delta = std::min(m_excess[i], m_graph->template ResCap<K>(arc, true));
+        m_stats.exchangeCapacityCalls++;
+        m_graph->template Push<K>(arc, true, delta);
+        m_stats.cliquePushes++;
+        m_excess[i] -= delta;
+        m_excess[j] += delta;
+        if (m_excess[i] == 0)
+            break;
+    }
+}
+
+template <typename R>
+template <int K>
+size_t RegionPushRelabel<R>::GlobalRelabel() {
+    auto start = Clock::now();
+    const int n = m_graph->NumNodes();
+
+    // Breadth first search back from the deficits, over residual arcs
+    m_bfs_queue.clear();
+    for (NodeId i = 0; i < n; ++i) {
+        m_graph->SetParentArc(i, m_graph->ArcsBegin(i));
+        if (m_excess[i] < 0) {
+            m_graph->Dis(i) = 0;
+            m_bfs_queue.push_back(i);
+        } else {
+            m_graph->Dis(i) = n;
+        }
+    }
+    for (size_t q = 0; q < m_bfs_queue.size(); ++q) {
+        NodeId i = m_bfs_queue[q];
+        const int d = m_graph->Dis(i) + 1;
+        for (auto arc = m_graph->ArcsBegin(i); m_graph->template NextResidualArc<K>(arc, false); ++arc) {
+            m_stats.arcsScanned++;
+            NodeId j = arc.Target();
+            if (m_graph->Dis(j) == n) {
+                m_graph->Dis(j) = d;
+                m_bfs_queue.push_back(j);
+                m_stats.maxTreeDepth = std::max(m_stats.maxTreeDepth, d);
+            }
+        }
+    }
+
+    size_t num_active = 0;
+    for (auto& region : m_regions)
+        region.queue.clear();
+    for (NodeId i = 0; i < n; ++i) {
+        if (m_excess[i] > 0 && m_graph->Dis(i) < n) {
+            m_regions[RegionOf(i)].queue.push_back(i);
+            num_active++;
+        }
+    }
+    m_stats.globalRelabels++;
+    m_stats.relabelTime += Duration{ Clock::now() - start }.count();
+    return num_active;
+}
+
+template <typename R>
+void RegionPushRelabel<R>::ComputeMinCut() {
+    // Labels are exact after the last global relabel, and the nodes that
+    // can't reach a deficit are on the source side
+    auto& labels = m_energy->GetLabels();
+    for (NodeId i = 0; i < m_graph->NumNodes(); ++i)
+        labels[i] = (m_graph->Dis(i) >= m_graph->NumNodes());
+}
+
+template <typename R>
+void RegionPushRelabel<R>::Solve(SubmodularIBFS<R>* energy) {
+    m_stats = FlowStats{};
+    m_energy = energy;
+    m_graph = &energy->Graph();
+    m_num_threads = 1;
+#ifdef _OPENMP
+    m_num_threads = energy->Params().threads;
+    if (m_num_threads <= 0)
+        m_num_threads = omp_get_max_threads();
+#endif
+    m_num_regions = energy->Params().regions;
+    if (m_num_regions <= 0)
+        m_num_regions = m_num_threads;
+    // Residual queries on cardinality cliques fill caches that can't be
+    // filled ahead of time, so those graphs get a single region
+    if (!m_graph->SharedScanSafe())
+        m_num_regions = 1;
+    // As in PushRelabel, the dynamic mode keeps the excesses
+    if (energy->Params().dynamic && m_graph->HasFlow()) {
+        m_graph->RepairFlow(energy->Params().ub, energy->Params().fixedVars, energy->NormStats());
+    } else {
+        m_graph->ResetFlow();
+        m_graph->UpperBoundCliques(energy->Params().ub, energy->Params().fixedVars, energy->GetLabels(), energy->NormStats());
+        m_excess.clear();
+    }
+    m_excess.resize(m_graph->NumNodes(), 0);
+    MaxFlow();
+    ComputeMinCut();
+}
+
+template class RegionPushRelabel<int32_t>;
+template class RegionPushRelabel<int64_t>;
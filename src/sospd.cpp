@@ -2,6 +2,7 @@
 #include "multilabel-energy.hpp"
 
 #include <iostream>
+#include <type_traits>
 
 template <typename Flow>
 SoSPD<Flow>::SoSPD(const MultilabelEnergy* energy)
@@ -115,6 +116,7 @@ void SoSPD<Flow>::PreEditDual(Flow& crf) {
     std::vector<REAL> psi;
     std::vector<REAL> current_lambda;
     std::vector<REAL> fusion_lambda;
+    std::vector<REAL> energy_table;
 
     auto& ibfs_cliques = crf.Graph().GetCliques();
     ASSERT(ibfs_cliques.size() == m_energy->cliques().size());
@@ -127,10 +129,13 @@ void SoSPD<Flow>::PreEditDual(Flow& crf) {
         auto& lambda_a = lambdaAlpha(clique_index);
 
         auto& ibfs_c = ibfs_cliques[clique_index];
+        // Read through a const view, the mutable one marks the clique dirty
+        const auto& const_ibfs_c = ibfs_c;
+        const auto ibfs_table = const_ibfs_c.EnergyTable();
         ASSERT(k == ibfs_c.Size());
-        std::vector<REAL>& energy_table = ibfs_c.EnergyTable();
         Assgn max_assgn = 1 << k;
-        ASSERT(energy_table.size() == max_assgn);
+        ASSERT(ibfs_table.size() == max_assgn);
+        energy_table.resize(max_assgn);
 
         psi.resize(k);
         current_labels.resize(k);
@@ -172,6 +177,10 @@ void SoSPD<Flow>::PreEditDual(Flow& crf) {
         // g(S) - lambda_fusion(S) - lambda_current(C\S)
         SubtractLinear(k, energy_table, fusion_lambda, current_lambda);
         ASSERT(energy_table[0] == 0); // Check tightness of current labeling
+        // Unchanged tables (e.g. with all nodes fixed) are left alone, so
+        // the flow graph doesn't bound them again
+        if (!std::equal(energy_table.begin(), energy_table.end(), ibfs_table.begin()))
+            std::copy(energy_table.begin(), energy_table.end(), ibfs_c.EnergyTable().begin());
 
         // Debugging code
         /*
@@ -234,15 +243,29 @@ template <typename Flow>
 void SoSPD<Flow>::SetupGraph(Flow& crf) {
     typedef int32_t Assgn;
     const size_t n = m_labels.size();
+    size_t num_clique_nodes = 0;
+    size_t num_table_entries = 0;
+    size_t max_table_size = 0;
+    for (const CliquePtr& cp : m_energy->cliques()) {
+        ASSERT(cp->size() < 32);
+        const size_t table_size = size_t(1) << cp->size();
+        num_clique_nodes += cp->size();
+        num_table_entries += table_size;
+        max_table_size = std::max(max_table_size, table_size);
+    }
+    crf.Reserve(n, m_energy->cliques().size(), num_clique_nodes, num_table_entries);
     crf.AddNode(n);
 
+    // All tables start out zero, PreEditDual fills them in
+    const std::vector<REAL> zero_table(max_table_size, 0);
     for (const CliquePtr& cp : m_energy->cliques()) {
         const Clique& c = *cp;
         const size_t k = c.size();
-        ASSERT(k < 32);
         const Assgn max_assgn = 1 << k;
-        std::vector<typename Flow::NodeId> nodes(c.nodes(), c.nodes() + c.size());
-        crf.AddClique(nodes, std::vector<REAL>(max_assgn, 0));
+        ASSERT(max_assgn <= static_cast<Assgn>(zero_table.size()));
+        static_assert(std::is_same<VarId, typename Flow::NodeId>::value,
+                "Clique nodes are passed to the flow graph as is");
+        crf.AddClique(c.nodes(), k, zero_table.data());
     }
 }
 
@@ -282,7 +305,7 @@ bool SoSPD<Flow>::UpdatePrimalDual(Flow& crf) {
     for (const CliquePtr& cp : m_energy->cliques()) {
         const Clique& c = *cp;
         auto& ibfs_c = clique[i];
-        const std::vector<REAL>& phiCi = ibfs_c.AlphaCi();
+        const auto phiCi = ibfs_c.AlphaCi();
         for (size_t j = 0; j < phiCi.size(); ++j) {
             dualVariable(i, j, m_fusion_labels[c.nodes()[j]]) += phiCi[j];
             Height(c.nodes()[j], m_fusion_labels[c.nodes()[j]]) += phiCi[j];
@@ -537,4 +560,4 @@ double SoSPD<Flow>::LowerBound() {
 
 
 // Template instantiations
-template class SoSPD<SubmodularIBFS>;
+template class SoSPD<SubmodularIBFS<>>;
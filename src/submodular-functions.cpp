@@ -6,13 +6,14 @@
 
 #include "sos-graph.hpp"
 
-const std::vector<SoSGraph::UBParam> SoSGraph::ubParamList = 
-    { UBParam{ UBfn::chen, "chen", ChenUpperBound },
-      UBParam{ UBfn::cvpr14, "cvpr14", UpperBoundCVPR14 },
+const std::vector<SoSGraphBase::UBParam> SoSGraphBase::ubParamList = 
+    { UBParam{ UBfn::chen, "chen", ChenUpperBound<REAL> },
+      UBParam{ UBfn::cvpr14, "cvpr14", UpperBoundCVPR14<REAL> },
     };
 
 
-double DiffL1(const std::vector<REAL>& e1, const std::vector<REAL>& e2) {
+template <typename R>
+double DiffL1(const std::vector<R>& e1, const std::vector<R>& e2) {
     int n = e1.size();
     double norm = 0;
     for (int i = 0; i < n; ++i)
@@ -20,7 +21,8 @@ double DiffL1(const std::vector<REAL>& e1, const std::vector<REAL>& e2) {
     return norm;
 }
 
-double DiffL2(const std::vector<REAL>& e1, const std::vector<REAL>& e2) {
+template <typename R>
+double DiffL2(const std::vector<R>& e1, const std::vector<R>& e2) {
     int n = e1.size();
     double norm = 0;
     for (int i = 0; i < n; ++i) {
@@ -30,7 +32,8 @@ double DiffL2(const std::vector<REAL>& e1, const std::vector<REAL>& e2) {
     return norm;
 }
 
-double DiffLInfty(const std::vector<REAL>& e1, const std::vector<REAL>& e2) {
+template <typename R>
+double DiffLInfty(const std::vector<R>& e1, const std::vector<R>& e2) {
     int n = e1.size();
     double norm = 0;
     for (int i = 0; i < n; ++i)
@@ -38,3 +41,12 @@ double DiffLInfty(const std::vector<REAL>& e1, const std::vector<REAL>& e2) {
     return norm;
 }
 
+#define DIFF_NORMS_INSTANTIATE(R) \
+    template double DiffL1<R>(const std::vector<R>&, const std::vector<R>&); \
+    template double DiffL2<R>(const std::vector<R>&, const std::vector<R>&); \
+    template double DiffLInfty<R>(const std::vector<R>&, const std::vector<R>&);
+
+DIFF_NORMS_INSTANTIATE(int32_t)
+DIFF_NORMS_INSTANTIATE(int64_t)
+
+#undef DIFF_NORMS_INSTANTIATE
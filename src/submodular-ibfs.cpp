@@ -1,8 +1,13 @@
 #include "submodular-ibfs.hpp"
 
+#include <algorithm>
 #include <chrono>
 #include <vector>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include "flow-solver.hpp"
 
 typedef std::chrono::system_clock::time_point TimePt;
@@ -10,43 +15,84 @@ typedef std::chrono::duration<double> Duration;
 typedef std::chrono::system_clock Clock;
 
 
-inline std::unique_ptr<FlowSolver> FlowSolver::GetSolver(const SubmodularIBFSParams& params) {
+template <typename R>
+inline std::unique_ptr<FlowSolver<R>> FlowSolver<R>::GetSolver(const SubmodularIBFSParams& params) {
     typedef SubmodularIBFSParams::FlowAlgorithm Alg;
-    typedef std::unique_ptr<FlowSolver> FlowPtr;
+    typedef std::unique_ptr<FlowSolver<R>> FlowPtr;
     switch (params.alg) {
         case Alg::bidirectional:
-            return FlowPtr{ new BidirectionalIBFS{} };
+            return FlowPtr{ new BidirectionalIBFS<R>{} };
         case Alg::source:
-            return FlowPtr{ new SourceIBFS{} };
+            return FlowPtr{ new SourceIBFS<R>{} };
         case Alg::parametric:
-            return FlowPtr{ new ParametricIBFS{} };
+            return FlowPtr{ new ParametricIBFS<R>{} };
+        case Alg::excess:
+            return FlowPtr{ new ExcessIBFS<R>{} };
+        case Alg::pushRelabel:
+            return FlowPtr{ new PushRelabel<R>{} };
+        case Alg::region:
+            return FlowPtr{ new RegionPushRelabel<R>{} };
     }
 }
 
 std::vector<std::pair<SubmodularIBFSParams::FlowAlgorithm, std::string>> SubmodularIBFSParams::algNames 
     = { { SubmodularIBFSParams::FlowAlgorithm::bidirectional, "bidirectional" },
         { SubmodularIBFSParams::FlowAlgorithm::source, "source" },
-        { SubmodularIBFSParams::FlowAlgorithm::parametric, "parametric" }
+        { SubmodularIBFSParams::FlowAlgorithm::parametric, "parametric" },
+        { SubmodularIBFSParams::FlowAlgorithm::excess, "excess" },
+        { SubmodularIBFSParams::FlowAlgorithm::pushRelabel, "push-relabel" },
+        { SubmodularIBFSParams::FlowAlgorithm::region, "region" }
     };
 
-SubmodularIBFS::SubmodularIBFS(SubmodularIBFSParams params) 
+FlowStats& FlowStats::operator+=(const FlowStats& other) {
+    totalTime += other.totalTime;
+    initTime += other.initTime;
+    augmentTime += other.augmentTime;
+    adoptTime += other.adoptTime;
+    growTime += other.growTime;
+    relabelTime += other.relabelTime;
+    regionTime += other.regionTime;
+    cliquePushes += other.cliquePushes;
+    augmentations += other.augmentations;
+    orphansAdopted += other.orphansAdopted;
+    relabels += other.relabels;
+    globalRelabels += other.globalRelabels;
+    arcsScanned += other.arcsScanned;
+    exchangeCapacityCalls += other.exchangeCapacityCalls;
+    maxTreeDepth = std::max(maxTreeDepth, other.maxTreeDepth);
+    return *this;
+}
+
+template <typename R>
+SubmodularIBFS<R>::SubmodularIBFS(SubmodularIBFSParams params) 
     : m_params(params),
-    m_flowSolver(FlowSolver::GetSolver(params))
+    m_flowSolver(FlowSolver<R>::GetSolver(params))
 { }
 
-SubmodularIBFS::~SubmodularIBFS() { }
+template <typename R>
+SubmodularIBFS<R>::~SubmodularIBFS() { }
 
-SubmodularIBFS::NodeId SubmodularIBFS::AddNode(int n) {
-    for (int i = 0; i < n; ++i)
-        m_labels.push_back(-1);
+template <typename R>
+typename SubmodularIBFS<R>::NodeId SubmodularIBFS<R>::AddNode(int n) {
+    m_labels.resize(m_labels.size() + n, -1);
+    m_parametric_unaries.resize(m_labels.size(), 0);
     return m_graph.AddNode(n);
 }
 
-int SubmodularIBFS::GetLabel(NodeId n) const {
+template <typename R>
+void SubmodularIBFS<R>::Reserve(NodeId num_nodes, size_t num_cliques, size_t num_clique_nodes, size_t num_table_entries) {
+    m_labels.reserve(num_nodes);
+    m_parametric_unaries.reserve(num_nodes);
+    m_graph.Reserve(num_nodes, num_cliques, num_clique_nodes, num_table_entries);
+}
+
+template <typename R>
+int SubmodularIBFS<R>::GetLabel(NodeId n) const {
     return m_labels[n];
 }
 
-void SubmodularIBFS::AddUnaryTerm(NodeId n, REAL E0, REAL E1) {
+template <typename R>
+void SubmodularIBFS<R>::AddUnaryTerm(NodeId n, R E0, R E1) {
     // Reparametize so that E0, E1 >= 0
     if (E0 < 0) {
         AddConstantTerm(E0);
@@ -62,43 +108,187 @@ void SubmodularIBFS::AddUnaryTerm(NodeId n, REAL E0, REAL E1) {
     m_graph.AddTerminalWeights(n, E0, E1);
 }
 
-void SubmodularIBFS::AddUnaryTerm(NodeId n, REAL coeff) {
+template <typename R>
+void SubmodularIBFS<R>::AddUnaryTerm(NodeId n, R coeff) {
     AddUnaryTerm(n, 0, coeff);
 }
 
-void SubmodularIBFS::ClearUnaries() {
+template <typename R>
+void SubmodularIBFS<R>::ClearUnaries() {
     m_graph.ClearTerminals();
+    std::fill(m_parametric_unaries.begin(), m_parametric_unaries.end(), 0);
+}
+
+template <typename R>
+void SubmodularIBFS<R>::AddParametricUnaryTerm(NodeId n, R slope) {
+    ASSERT(slope >= 0);
+    m_parametric_unaries[n] += slope;
 }
 
-void SubmodularIBFS::AddClique(const std::vector<NodeId>& nodes, const std::vector<REAL>& energyTable) {
+template <typename R>
+void SubmodularIBFS<R>::AddClique(const std::vector<NodeId>& nodes, const std::vector<R>& energyTable) {
     m_graph.AddClique(nodes, energyTable);
 }
 
-void SubmodularIBFS::AddPairwiseTerm(NodeId i, NodeId j, REAL E00, REAL E01, REAL E10, REAL E11) {
-    std::vector<NodeId> nodes{i, j};
-    std::vector<REAL> energyTable{E00, E01, E10, E11};
-    AddClique(nodes, energyTable);
+template <typename R>
+void SubmodularIBFS<R>::AddClique(const NodeId* nodes, size_t k, const R* energyTable) {
+    m_graph.AddClique(nodes, k, energyTable);
+}
+
+template <typename R>
+void SubmodularIBFS<R>::AddPairwiseTerm(NodeId i, NodeId j, R E00, R E01, R E10, R E11) {
+    if (E01 + E10 >= E00 + E11) {
+        m_graph.AddPairwiseClique(i, j, E00, E01, E10, E11);
+        return;
+    }
+    // Not submodular: store it as a table, for UpperBoundCliques to bound
+    const NodeId nodes[] = {i, j};
+    const R energyTable[] = {E00, E01, E10, E11};
+    AddClique(nodes, 2, energyTable);
+}
+
+template <typename R>
+void SubmodularIBFS<R>::AddPottsClique(const std::vector<NodeId>& nodes, R lambda) {
+    m_graph.AddPottsClique(nodes.data(), nodes.size(), lambda);
 }
 
-REAL SubmodularIBFS::ComputeEnergy() const {
+template <typename R>
+void SubmodularIBFS<R>::AddCardinalityClique(const std::vector<NodeId>& nodes, const std::vector<R>& h) {
+    ASSERT(h.size() == nodes.size() + 1);
+    std::vector<R> shifted(h.size());
+    for (size_t c = 0; c < h.size(); ++c)
+        shifted[c] = h[c] - h[0];
+    AddConstantTerm(h[0]);
+    m_graph.AddCardinalityClique(nodes.data(), nodes.size(), shifted.data());
+}
+
+template <typename R>
+R SubmodularIBFS<R>::ComputeEnergy() const {
     return ComputeEnergy(m_labels);
 }
 
-REAL SubmodularIBFS::ComputeEnergy(const std::vector<int>& labels) const {
+template <typename R>
+R SubmodularIBFS<R>::ComputeEnergy(const std::vector<int>& labels) const {
     // FIXME: Change to actually store the original unaries, since optimization 
     // might change them.
-    REAL total = m_constant_term;
+    R total = m_constant_term;
     for (NodeId i = 0; i < m_graph.NumNodes(); ++i) {
         if (labels[i] == 1) total += m_graph.m_c_it[i];
         else total += m_graph.m_c_si[i];
     }
-    for (const auto& c : m_graph.m_cliques) {
-        total += c.ComputeEnergy(labels);
-    }
+    total += m_graph.ComputeCliqueEnergy(labels);
     return total;
 }
 
-void SubmodularIBFS::Solve() {
+template <typename R>
+void SubmodularIBFS<R>::Solve() {
+    if (m_params.compactCliques && !m_graph.Finalized())
+        AddConstantTerm(m_graph.CompactCliques());
+    m_graph.SetCapacityCache(m_params.cacheCapacities);
+    if (m_params.components && !m_params.dynamic && SolveComponents())
+        return;
     m_flowSolver->Solve(this);    
+    m_flowStats = m_flowSolver->Stats();
+}
+
+template <typename R>
+void SubmodularIBFS<R>::SolveParametric(const std::vector<R>& lambdas, std::vector<size_t>& breakpoints) {
+    ASSERT(m_params.alg == SubmodularIBFSParams::FlowAlgorithm::parametric);
+    if (m_params.compactCliques && !m_graph.Finalized())
+        AddConstantTerm(m_graph.CompactCliques());
+    m_graph.SetCapacityCache(m_params.cacheCapacities);
+    static_cast<ParametricIBFS<R>*>(m_flowSolver.get())->SolveParametric(this, lambdas, breakpoints);
+    m_flowStats = m_flowSolver->Stats();
+}
+
+template <typename R>
+bool SubmodularIBFS<R>::SolveComponents() {
+    // The flow solver bounds the cliques again if we fall back to it, so
+    // only count this bound if we don't
+    const auto stats = m_normStats;
+    m_graph.ResetFlow();
+    m_graph.UpperBoundCliques(m_params.ub, m_params.fixedVars, m_labels, &m_normStats);
+    std::vector<int> component;
+    const int num_components = m_graph.FindComponents(component);
+    const NodeId n = m_graph.NumNodes();
+
+    // Nodes of each component, in counting sort order
+    std::vector<size_t> offsets(num_components + 1, 0);
+    for (NodeId i = 0; i < n; ++i) {
+        if (component[i] >= 0)
+            offsets[component[i] + 1]++;
+    }
+    size_t largest = 0;
+    for (int c = 0; c < num_components; ++c) {
+        largest = std::max(largest, offsets[c + 1]);
+        offsets[c + 1] += offsets[c];
+    }
+    if (largest > kMaxComponentShare * n) {
+        m_normStats = stats;
+        return false;
+    }
+    std::vector<NodeId> order(offsets.back());
+    {
+        auto next = offsets;
+        for (NodeId i = 0; i < n; ++i) {
+            if (component[i] >= 0)
+                order[next[component[i]]++] = i;
+        }
+    }
+
+    // Nodes no clique carries flow at only have their terminal arcs
+    for (NodeId i = 0; i < n; ++i) {
+        if (component[i] < 0)
+            m_labels[i] = (m_graph.Excess(i) >= 0);
+    }
+
+    // Largest components first, packing the small ones into batches
+    std::vector<int> by_size(num_components);
+    for (int c = 0; c < num_components; ++c)
+        by_size[c] = c;
+    std::sort(by_size.begin(), by_size.end(), [&](int a, int b) {
+        return offsets[a + 1] - offsets[a] > offsets[b + 1] - offsets[b];
+    });
+    std::vector<std::vector<NodeId>> batches;
+    for (int c : by_size) {
+        if (batches.empty() || NodeId(batches.back().size()) >= kMinBatchNodes)
+            batches.emplace_back();
+        batches.back().insert(batches.back().end(), order.begin() + offsets[c], order.begin() + offsets[c + 1]);
+    }
+    std::vector<NodeId> local(n);
+    for (const auto& nodes : batches) {
+        for (size_t j = 0; j < nodes.size(); ++j)
+            local[nodes[j]] = j;
+    }
+
+    SubmodularIBFSParams params{m_params.alg};
+    params.ub = m_params.ub;
+    params.cacheCapacities = m_params.cacheCapacities;
+    const int num_batches = batches.size();
+    m_flowStats = FlowStats{};
+#ifdef _OPENMP
+    int num_threads = m_params.threads;
+    if (num_threads <= 0)
+        num_threads = omp_get_max_threads();
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(num_threads)
+#endif
+    for (int b = 0; b < num_batches; ++b) {
+        const auto& nodes = batches[b];
+        SubmodularIBFS sf{params};
+        sf.AddNode(nodes.size());
+        m_graph.ExtractComponents(nodes, local, sf.Graph());
+        sf.Solve();
+        m_graph.MergeComponentFlow(nodes, sf.Graph());
+        for (size_t j = 0; j < nodes.size(); ++j)
+            m_labels[nodes[j]] = sf.GetLabel(j);
+#ifdef _OPENMP
+        #pragma omp critical
+#endif
+        m_flowStats += sf.Stats();
+    }
+    m_graph.DropFlow();
+    return true;
 }
 
+template class SubmodularIBFS<int32_t>;
+template class SubmodularIBFS<int64_t>;
@@ -0,0 +1,392 @@
+#include "subset-kernels.hpp"
+
+#include <algorithm>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SOS_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace {
+
+typedef uint32_t Assignment;
+
+// Largest clique size for which we precompute run tables. Above this, the
+// run starts are enumerated on the fly in chunks.
+const int kMaxTableArity = 12;
+const int kChunkSize = 256;
+
+/* Every kernel is a template on the energy type R, instantiated for 32 and
+ * 64 bit integers at the bottom of this file.
+ */
+template <typename R>
+using MinRunsFn = R (*)(const R*, const Assignment*, size_t, Assignment);
+template <typename R>
+using PushRunsFn = void (*)(R*, const Assignment*, size_t, Assignment, Assignment, R);
+
+/* Scalar kernels */
+
+template <typename R>
+R MinRunsScalar(const R* table, const Assignment* starts, size_t count, Assignment run_len) {
+    R min_energy = std::numeric_limits<R>::max();
+    for (size_t r = 0; r < count; ++r) {
+        const R* run = table + starts[r];
+        for (Assignment j = 0; j < run_len; ++j)
+            min_energy = std::min(min_energy, run[j]);
+    }
+    return min_energy;
+}
+
+template <typename R>
+void PushRunsScalar(R* table, const Assignment* starts, size_t count, Assignment run_len, Assignment uv_mask, R delta) {
+    for (size_t r = 0; r < count; ++r) {
+        R* u_run = table + starts[r];
+        R* v_run = table + (starts[r] ^ uv_mask);
+        for (Assignment j = 0; j < run_len; ++j) {
+            u_run[j] -= delta;
+            v_run[j] += delta;
+        }
+    }
+}
+
+#ifdef SOS_X86_SIMD
+
+/* Lane operations for each energy type. The kernels below are written once
+ * against these, so 32 bit energies get twice the lanes per register.
+ */
+template <typename T>
+struct SimdOps;
+
+template <>
+struct SimdOps<int64_t> {
+    static const Assignment kLanes128 = 2;
+    static const Assignment kLanes256 = 4;
+
+    __attribute__((target("sse4.2")))
+    static __m128i Set128(int64_t x) { return _mm_set1_epi64x(x); }
+    __attribute__((target("sse4.2")))
+    static __m128i Min128(__m128i a, __m128i b) {
+        return _mm_blendv_epi8(a, b, _mm_cmpgt_epi64(a, b));
+    }
+    __attribute__((target("sse4.2")))
+    static __m128i Add128(__m128i a, __m128i b) { return _mm_add_epi64(a, b); }
+    __attribute__((target("sse4.2")))
+    static __m128i Sub128(__m128i a, __m128i b) { return _mm_sub_epi64(a, b); }
+
+    __attribute__((target("avx2")))
+    static __m256i Set256(int64_t x) { return _mm256_set1_epi64x(x); }
+    __attribute__((target("avx2")))
+    static __m256i Min256(__m256i a, __m256i b) {
+        return _mm256_blendv_epi8(a, b, _mm256_cmpgt_epi64(a, b));
+    }
+    __attribute__((target("avx2")))
+    static __m256i Add256(__m256i a, __m256i b) { return _mm256_add_epi64(a, b); }
+    __attribute__((target("avx2")))
+    static __m256i Sub256(__m256i a, __m256i b) { return _mm256_sub_epi64(a, b); }
+    // table[starts[0]], ..., table[starts[kLanes256-1]]
+    __attribute__((target("avx2")))
+    static __m256i Gather256(const int64_t* table, const Assignment* starts) {
+        __m128i idx = _mm_loadu_si128(reinterpret_cast<const __m128i*>(starts));
+        return _mm256_i32gather_epi64(reinterpret_cast<const long long*>(table), idx, 8);
+    }
+};
+
+template <>
+struct SimdOps<int32_t> {
+    static const Assignment kLanes128 = 4;
+    static const Assignment kLanes256 = 8;
+
+    __attribute__((target("sse4.2")))
+    static __m128i Set128(int32_t x) { return _mm_set1_epi32(x); }
+    __attribute__((target("sse4.2")))
+    static __m128i Min128(__m128i a, __m128i b) { return _mm_min_epi32(a, b); }
+    __attribute__((target("sse4.2")))
+    static __m128i Add128(__m128i a, __m128i b) { return _mm_add_epi32(a, b); }
+    __attribute__((target("sse4.2")))
+    static __m128i Sub128(__m128i a, __m128i b) { return _mm_sub_epi32(a, b); }
+
+    __attribute__((target("avx2")))
+    static __m256i Set256(int32_t x) { return _mm256_set1_epi32(x); }
+    __attribute__((target("avx2")))
+    static __m256i Min256(__m256i a, __m256i b) { return _mm256_min_epi32(a, b); }
+    __attribute__((target("avx2")))
+    static __m256i Add256(__m256i a, __m256i b) { return _mm256_add_epi32(a, b); }
+    __attribute__((target("avx2")))
+    static __m256i Sub256(__m256i a, __m256i b) { return _mm256_sub_epi32(a, b); }
+    __attribute__((target("avx2")))
+    static __m256i Gather256(const int32_t* table, const Assignment* starts) {
+        __m256i idx = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(starts));
+        return _mm256_i32gather_epi32(reinterpret_cast<const int*>(table), idx, 4);
+    }
+};
+
+/* SSE4.2 kernels: runs at least one register long */
+
+template <typename R>
+__attribute__((target("sse4.2")))
+R MinRunsSSE4(const R* table, const Assignment* starts, size_t count, Assignment run_len) {
+    typedef SimdOps<R> Ops;
+    if (run_len < Ops::kLanes128)
+        return MinRunsScalar(table, starts, count, run_len);
+    __m128i vmin = Ops::Set128(std::numeric_limits<R>::max());
+    for (size_t r = 0; r < count; ++r) {
+        const R* run = table + starts[r];
+        for (Assignment j = 0; j < run_len; j += Ops::kLanes128)
+            vmin = Ops::Min128(vmin, _mm_loadu_si128(reinterpret_cast<const __m128i*>(run + j)));
+    }
+    alignas(16) R lanes[Ops::kLanes128];
+    _mm_store_si128(reinterpret_cast<__m128i*>(lanes), vmin);
+    return *std::min_element(lanes, lanes + Ops::kLanes128);
+}
+
+template <typename R>
+__attribute__((target("sse4.2")))
+void PushRunsSSE4(R* table, const Assignment* starts, size_t count, Assignment run_len, Assignment uv_mask, R delta) {
+    typedef SimdOps<R> Ops;
+    if (run_len < Ops::kLanes128) {
+        PushRunsScalar(table, starts, count, run_len, uv_mask, delta);
+        return;
+    }
+    const __m128i vdelta = Ops::Set128(delta);
+    for (size_t r = 0; r < count; ++r) {
+        __m128i* u_run = reinterpret_cast<__m128i*>(table + starts[r]);
+        __m128i* v_run = reinterpret_cast<__m128i*>(table + (starts[r] ^ uv_mask));
+        for (Assignment j = 0; j < run_len/Ops::kLanes128; ++j) {
+            _mm_storeu_si128(u_run + j, Ops::Sub128(_mm_loadu_si128(u_run + j), vdelta));
+            _mm_storeu_si128(v_run + j, Ops::Add128(_mm_loadu_si128(v_run + j), vdelta));
+        }
+    }
+}
+
+/* AVX2 kernels. Runs of length 1 are gathered straight from the table of
+ * run starts, runs of half a register are paired up into one register,
+ * and other short runs go to the SSE4.2 kernels.
+ */
+
+template <typename R>
+__attribute__((target("avx2")))
+R MinRunsAVX2(const R* table, const Assignment* starts, size_t count, Assignment run_len) {
+    typedef SimdOps<R> Ops;
+    __m256i vmin = Ops::Set256(std::numeric_limits<R>::max());
+    size_t r = 0;
+    if (run_len >= Ops::kLanes256) {
+        for (; r < count; ++r) {
+            const R* run = table + starts[r];
+            for (Assignment j = 0; j < run_len; j += Ops::kLanes256)
+                vmin = Ops::Min256(vmin, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(run + j)));
+        }
+    } else if (2*run_len == Ops::kLanes256) {
+        for (; r + 2 <= count; r += 2) {
+            __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(table + starts[r]));
+            __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(table + starts[r+1]));
+            vmin = Ops::Min256(vmin, _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1));
+        }
+    } else if (run_len == 1) {
+        for (; r + Ops::kLanes256 <= count; r += Ops::kLanes256)
+            vmin = Ops::Min256(vmin, Ops::Gather256(table, starts + r));
+    } else {
+        return MinRunsSSE4(table, starts, count, run_len);
+    }
+    alignas(32) R lanes[Ops::kLanes256];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), vmin);
+    R min_energy = *std::min_element(lanes, lanes + Ops::kLanes256);
+    if (r < count)
+        min_energy = std::min(min_energy, MinRunsScalar(table, starts + r, count - r, run_len));
+    return min_energy;
+}
+
+template <typename R>
+__attribute__((target("avx2")))
+void PushRunsAVX2(R* table, const Assignment* starts, size_t count, Assignment run_len, Assignment uv_mask, R delta) {
+    typedef SimdOps<R> Ops;
+    if (run_len < Ops::kLanes256) {
+        PushRunsSSE4(table, starts, count, run_len, uv_mask, delta);
+        return;
+    }
+    const __m256i vdelta = Ops::Set256(delta);
+    for (size_t r = 0; r < count; ++r) {
+        __m256i* u_run = reinterpret_cast<__m256i*>(table + starts[r]);
+        __m256i* v_run = reinterpret_cast<__m256i*>(table + (starts[r] ^ uv_mask));
+        for (Assignment j = 0; j < run_len/Ops::kLanes256; ++j) {
+            _mm256_storeu_si256(u_run + j, Ops::Sub256(_mm256_loadu_si256(u_run + j), vdelta));
+            _mm256_storeu_si256(v_run + j, Ops::Add256(_mm256_loadu_si256(v_run + j), vdelta));
+        }
+    }
+}
+
+#endif // SOS_X86_SIMD
+
+template <typename R>
+struct KernelSet {
+    SimdLevel level;
+    MinRunsFn<R> min;
+    PushRunsFn<R> push;
+};
+
+template <typename R>
+KernelSet<R> KernelsFor(SimdLevel level) {
+    switch (level) {
+#ifdef SOS_X86_SIMD
+        case SimdLevel::avx2:
+            return { SimdLevel::avx2, MinRunsAVX2<R>, PushRunsAVX2<R> };
+        case SimdLevel::sse4:
+            return { SimdLevel::sse4, MinRunsSSE4<R>, PushRunsSSE4<R> };
+#endif
+        default:
+            return { SimdLevel::scalar, MinRunsScalar<R>, PushRunsScalar<R> };
+    }
+}
+
+// The kernels in use for energies of type R. SetSimdLevel switches those
+// of every type at once.
+template <typename R>
+KernelSet<R>& CurrentKernels() {
+    static KernelSet<R> kernels = KernelsFor<R>(SupportedSimdLevel());
+    return kernels;
+}
+
+/* Tables of run starts for every (n, u, v) with n <= kMaxTableArity. The
+ * runs for (n, u, v) are m_starts[m_begin[Index(n, u, v)]] and following.
+ */
+class RunTables {
+    public:
+        RunTables() {
+            m_begin.push_back(0);
+            for (int n = 0; n <= kMaxTableArity; ++n) {
+                for (int u = 0; u < kMaxTableArity; ++u) {
+                    for (int v = 0; v < kMaxTableArity; ++v) {
+                        if (u < n && v < n && u != v)
+                            AddRuns(n, u, v);
+                        m_begin.push_back(m_starts.size());
+                    }
+                }
+            }
+        }
+
+        const Assignment* Starts(int n, int u, int v) const {
+            return m_starts.data() + m_begin[Index(n, u, v)];
+        }
+
+    private:
+        static int Index(int n, int u, int v) {
+            return (n*kMaxTableArity + u)*kMaxTableArity + v;
+        }
+
+        void AddRuns(int n, int u, int v) {
+            const Assignment u_mask = 1 << u;
+            const Assignment start_mask = ((1 << n) - 1) & ~(u_mask | (1 << v))
+                & ~((2 << std::min(u, v)) - 1);
+            Assignment s = 0;
+            do {
+                m_starts.push_back(s | u_mask);
+                s = (s - start_mask) & start_mask;
+            } while (s != 0);
+        }
+
+        std::vector<size_t> m_begin;
+        std::vector<Assignment> m_starts;
+};
+
+const RunTables& GetRunTables() {
+    static const RunTables tables;
+    return tables;
+}
+
+struct RunInfo {
+    Assignment u_mask;
+    Assignment uv_mask;
+    Assignment start_mask;
+    Assignment run_len;
+    size_t count;
+};
+
+RunInfo GetRunInfo(int n, int u_idx, int v_idx) {
+    ASSERT(0 <= u_idx && u_idx < n);
+    ASSERT(0 <= v_idx && v_idx < n);
+    ASSERT(u_idx != v_idx && n <= 31);
+    const int lo = std::min(u_idx, v_idx);
+    RunInfo info;
+    info.u_mask = 1 << u_idx;
+    info.uv_mask = info.u_mask | (1 << v_idx);
+    info.start_mask = ((Assignment(1) << n) - 1) & ~info.uv_mask & ~((2u << lo) - 1);
+    info.run_len = 1 << lo;
+    info.count = size_t(1) << (n - 2 - lo);
+    return info;
+}
+
+} // namespace
+
+SimdLevel SupportedSimdLevel() {
+#ifdef SOS_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return SimdLevel::avx2;
+    if (__builtin_cpu_supports("sse4.2"))
+        return SimdLevel::sse4;
+#endif
+    return SimdLevel::scalar;
+}
+
+SimdLevel GetSimdLevel() {
+    return CurrentKernels<int64_t>().level;
+}
+
+void SetSimdLevel(SimdLevel level) {
+    level = std::min(level, SupportedSimdLevel());
+    CurrentKernels<int32_t>() = KernelsFor<int32_t>(level);
+    CurrentKernels<int64_t>() = KernelsFor<int64_t>(level);
+}
+
+template <typename R>
+R SubsetMin(const R* table, int n, int u_idx, int v_idx) {
+    const RunInfo info = GetRunInfo(n, u_idx, v_idx);
+    const MinRunsFn<R> min_runs = CurrentKernels<R>().min;
+    if (n <= kMaxTableArity)
+        return min_runs(table, GetRunTables().Starts(n, u_idx, v_idx), info.count, info.run_len);
+
+    R min_energy = std::numeric_limits<R>::max();
+    Assignment starts[kChunkSize];
+    size_t num_starts = 0;
+    Assignment s = 0;
+    do {
+        starts[num_starts++] = s | info.u_mask;
+        if (num_starts == kChunkSize) {
+            min_energy = std::min(min_energy, min_runs(table, starts, num_starts, info.run_len));
+            num_starts = 0;
+        }
+        s = (s - info.start_mask) & info.start_mask;
+    } while (s != 0);
+    if (num_starts > 0)
+        min_energy = std::min(min_energy, min_runs(table, starts, num_starts, info.run_len));
+    return min_energy;
+}
+
+template <typename R>
+void SubsetPush(R* table, int n, int u_idx, int v_idx, R delta) {
+    const RunInfo info = GetRunInfo(n, u_idx, v_idx);
+    const PushRunsFn<R> push_runs = CurrentKernels<R>().push;
+    if (n <= kMaxTableArity) {
+        push_runs(table, GetRunTables().Starts(n, u_idx, v_idx), info.count, info.run_len, info.uv_mask, delta);
+        return;
+    }
+
+    Assignment starts[kChunkSize];
+    size_t num_starts = 0;
+    Assignment s = 0;
+    do {
+        starts[num_starts++] = s | info.u_mask;
+        if (num_starts == kChunkSize) {
+            push_runs(table, starts, num_starts, info.run_len, info.uv_mask, delta);
+            num_starts = 0;
+        }
+        s = (s - info.start_mask) & info.start_mask;
+    } while (s != 0);
+    if (num_starts > 0)
+        push_runs(table, starts, num_starts, info.run_len, info.uv_mask, delta);
+}
+
+template int32_t SubsetMin(const int32_t* table, int n, int u_idx, int v_idx);
+template int64_t SubsetMin(const int64_t* table, int n, int u_idx, int v_idx);
+template void SubsetPush(int32_t* table, int n, int u_idx, int v_idx, int32_t delta);
+template void SubsetPush(int64_t* table, int n, int u_idx, int v_idx, int64_t delta);
@@ -1,16 +1,18 @@
 #include <boost/test/unit_test.hpp>
 #include <iostream>
+#include <numeric>
+#include <random>
 #include "submodular-ibfs.hpp"
 #include "higher-order-energy.hpp"
 #include "gen-random.hpp"
 #include "qpbo.hpp"
 
-typedef SubmodularIBFS::NodeId NodeId;
+typedef SubmodularIBFS<>::NodeId NodeId;
 
 /* Sets up a submodular flow problem with a single clique. The clique has 4
 * nodes, and is equal to -1 when all 4 nodes are set to 1, 0 otherwise.
 */
-static void SetupMinimalFlow(SubmodularIBFS& sf) {
+static void SetupMinimalFlow(SubmodularIBFS<>& sf) {
 
     sf.AddNode(4);
 
@@ -21,7 +23,7 @@ static void SetupMinimalFlow(SubmodularIBFS& sf) {
     sf.AddClique(nodes, energyTable);
 }
 
-void TestConstructor(SubmodularIBFS& sf) {
+void TestConstructor(SubmodularIBFS<>& sf) {
     BOOST_CHECK_EQUAL(sf.GetConstantTerm(), 0);
     BOOST_CHECK_EQUAL(sf.Graph().NumNodes(), 0);
     BOOST_CHECK_EQUAL(sf.Graph().GetC_si().size(), 0);
@@ -31,11 +33,10 @@ void TestConstructor(SubmodularIBFS& sf) {
     BOOST_CHECK_EQUAL(sf.GetLabels().size(), 0);
     BOOST_CHECK_EQUAL(sf.Graph().GetNumCliques(), 0);
     BOOST_CHECK_EQUAL(sf.Graph().GetCliques().size(), 0);
-    BOOST_CHECK_EQUAL(sf.Graph().GetNeighbors().size(), 0);
     BOOST_CHECK_EQUAL(sf.ComputeEnergy(), 0);
 }
 
-void TestMinimalFlowSetup(SubmodularIBFS& sf) {
+void TestMinimalFlowSetup(SubmodularIBFS<>& sf) {
     SetupMinimalFlow(sf);
 
     BOOST_CHECK_EQUAL(sf.GetConstantTerm(), 0);
@@ -46,11 +47,16 @@ void TestMinimalFlowSetup(SubmodularIBFS& sf) {
     BOOST_CHECK_EQUAL(sf.GetLabels().size(), 4);
     BOOST_CHECK_EQUAL(sf.Graph().GetNumCliques(), 1);
     BOOST_CHECK_EQUAL(sf.Graph().GetCliques().size(), 1);
-    BOOST_CHECK_EQUAL(sf.Graph().GetNeighbors().size(), 4);
     BOOST_CHECK_EQUAL(sf.ComputeEnergy(), 0);
 
     sf.Graph().ResetFlow();
-    sf.Graph().UpperBoundCliques(SoSGraph::UBfn::cvpr14);
+    for (NodeId i = 0; i < 4; ++i) {
+        auto incidences = sf.Graph().Incidences(i);
+        BOOST_REQUIRE_EQUAL(incidences.size(), 1);
+        BOOST_CHECK_EQUAL(incidences[0].clique, 0);
+        BOOST_CHECK_EQUAL(incidences[0].slot, i);
+    }
+    sf.Graph().UpperBoundCliques(SoSGraphBase::UBfn::cvpr14);
 
     std::vector<int>& labels = sf.GetLabels();
     const uint32_t max_assgn = 1 << 4;
@@ -68,7 +74,7 @@ void TestMinimalFlowSetup(SubmodularIBFS& sf) {
     }
 }
 
-void TestRandomFlowSetup(SubmodularIBFS& sf) {
+void TestRandomFlowSetup(SubmodularIBFS<>& sf) {
     const size_t n = 100;
     const size_t k = 4;
     const size_t m = 100;
@@ -86,14 +92,84 @@ void TestRandomFlowSetup(SubmodularIBFS& sf) {
     BOOST_CHECK_EQUAL(sf.GetLabels().size(), n);
     BOOST_CHECK_EQUAL(sf.Graph().GetNumCliques(), m);
     BOOST_CHECK_EQUAL(sf.Graph().GetCliques().size(), m);
-    BOOST_CHECK_EQUAL(sf.Graph().GetNeighbors().size(), n);
 
+    // Every (clique, slot) pair appears exactly once in the incidence
+    sf.Graph().ResetFlow();
+    size_t num_incidences = 0;
+    for (NodeId i = 0; i < static_cast<NodeId>(n); ++i) {
+        for (const auto& inc : sf.Graph().Incidences(i)) {
+            BOOST_CHECK_EQUAL(sf.Graph().GetCliques()[inc.clique].Nodes()[inc.slot], i);
+            num_incidences++;
+        }
+    }
+    BOOST_CHECK_EQUAL(num_incidences, m*k);
+
+    // Reversing an arc swaps its endpoints and stays on the same clique
+    auto& graph = sf.Graph();
+    for (NodeId i = 0; i < static_cast<NodeId>(n); ++i) {
+        for (auto arc = graph.ArcsBegin(i); arc != graph.ArcsEnd(i); ++arc) {
+            auto rev = arc.Reverse();
+            BOOST_CHECK_EQUAL(rev.Source(), arc.Target());
+            BOOST_CHECK_EQUAL(rev.Target(), arc.Source());
+            BOOST_CHECK_EQUAL(rev.cliqueId(), arc.cliqueId());
+            BOOST_CHECK(rev.Reverse() == arc);
+        }
+    }
+
+    // Parent arcs survive packing, and the parent is the arc's target
+    for (NodeId i = 0; i < static_cast<NodeId>(n); ++i) {
+        BOOST_CHECK(graph.ParentArc(i) == graph.ArcsEnd(i));
+        for (auto arc = graph.ArcsBegin(i); arc != graph.ArcsEnd(i); ++arc) {
+            graph.SetParentArc(i, arc);
+            BOOST_CHECK(graph.ParentArc(i) == arc);
+            BOOST_CHECK_EQUAL(graph.Parent(i), arc.Target());
+        }
+    }
+}
+
+/* Build the same graph with Reserve and the pointer-based AddClique, and
+* check it matches the one built clique by clique from vectors.
+*/
+void TestReservedSetup(SubmodularIBFS<>& sf) {
+    const size_t n = 100;
+    const size_t k = 4;
+    const size_t m = 100;
+    const unsigned int seed = 0;
+
+    SubmodularIBFS<> orig;
+    GenRandom(orig, n, k, m, (REAL)100, (REAL)800, (REAL)1600, seed);
+
+    sf.Reserve(n, m, m*k, m << k);
+    sf.AddNode(n);
+    for (const auto& c : orig.Graph().GetCliques())
+        sf.AddClique(c.Nodes().data(), c.Size(), c.EnergyTable().data());
+    BOOST_CHECK_EQUAL(sf.Graph().GetNumCliques(), m);
+
+    BOOST_CHECK(!sf.Graph().Finalized());
+    sf.Graph().Finalize();
+    BOOST_CHECK(sf.Graph().Finalized());
+    orig.Graph().Finalize();
+    for (size_t i = 0; i < m; ++i) {
+        const auto& c1 = sf.Graph().GetCliques()[i];
+        const auto& c2 = orig.Graph().GetCliques()[i];
+        BOOST_REQUIRE(std::equal(c1.Nodes().begin(), c1.Nodes().end(), c2.Nodes().begin()));
+        BOOST_REQUIRE(std::equal(c1.EnergyTable().begin(), c1.EnergyTable().end(), c2.EnergyTable().begin()));
+    }
+    for (NodeId i = 0; i < static_cast<NodeId>(n); ++i) {
+        auto inc1 = sf.Graph().Incidences(i);
+        auto inc2 = orig.Graph().Incidences(i);
+        BOOST_REQUIRE_EQUAL(inc1.size(), inc2.size());
+        for (size_t j = 0; j < inc1.size(); ++j) {
+            BOOST_CHECK_EQUAL(inc1[j].clique, inc2[j].clique);
+            BOOST_CHECK_EQUAL(inc1[j].slot, inc2[j].slot);
+        }
+    }
 }
 
 /* Check that for a clique c, the energy is always >= 0, and is equal to 0 at
 * the all 0 and all 1 labelings.
 */
-void CheckNormalized(const SoSGraph::IBFSEnergyTableClique& c, std::vector<int>& labels) {
+void CheckNormalized(const SoSGraph<>::IBFSEnergyTableClique& c, std::vector<int>& labels) {
     const size_t n = c.Nodes().size();
     BOOST_REQUIRE_LT(n, 32);
     const uint32_t max_assgn = 1 << n;
@@ -116,7 +192,7 @@ void CheckNormalized(const SoSGraph::IBFSEnergyTableClique& c, std::vector<int>&
 /* Check that all source-sink capacities are >= 0, and that cliques
 * are normalized (i.e., are >= 0 for all labelings)
 */
-void TestRandomFlowNormalized(SubmodularIBFS& sf) {
+void TestRandomFlowNormalized(SubmodularIBFS<>& sf) {
     const size_t n = 100;
     const size_t k = 4;
     const size_t m = 100;
@@ -126,7 +202,7 @@ void TestRandomFlowNormalized(SubmodularIBFS& sf) {
     const unsigned int seed = 0;
 
     GenRandom(sf, n, k, m, clique_range, unary_mean, unary_var, seed);
-    sf.Graph().UpperBoundCliques(SoSGraph::UBfn::cvpr14);
+    sf.Graph().UpperBoundCliques(SoSGraphBase::UBfn::cvpr14);
 
     for (const auto& c : sf.Graph().GetCliques()) {
         BOOST_CHECK_EQUAL(c.Nodes().size(), 4);
@@ -134,12 +210,12 @@ void TestRandomFlowNormalized(SubmodularIBFS& sf) {
     }
 }
 
-static void CheckCut(SubmodularIBFS& sf) {
+static void CheckCut(SubmodularIBFS<>& sf) {
     auto& phi_si = sf.Graph().GetPhi_si();
     auto& phi_it = sf.Graph().GetPhi_it();
     auto& c_si = sf.Graph().GetC_si();
     auto& c_it = sf.Graph().GetC_it();
-    for (SubmodularIBFS::NodeId i = 0; i < sf.Graph().NumNodes(); ++i) {
+    for (SubmodularIBFS<>::NodeId i = 0; i < sf.Graph().NumNodes(); ++i) {
         int label = sf.GetLabel(i);
         if (label == 0) {
             BOOST_CHECK_EQUAL(phi_si[i], c_si[i]);
@@ -164,7 +240,7 @@ static void CheckCut(SubmodularIBFS& sf) {
             }
         }
     }
-    for (auto& c : sf.Graph().GetCliques()) {
+    for (const auto& c : sf.Graph().GetCliques()) {
         auto reparamEnergy = c.ComputeAlphaEnergy(sf.GetLabels());
         BOOST_CHECK_EQUAL(reparamEnergy, 0);
         int assgn = 0;
@@ -177,12 +253,39 @@ static void CheckCut(SubmodularIBFS& sf) {
         }
         BOOST_CHECK_EQUAL(sumPhi, c.EnergyTable()[assgn]);
     }
+    for (auto& c : sf.Graph().GetPottsCliques()) {
+        REAL sumPhi = 0;
+        for (size_t i = 0; i < c.Size(); ++i) {
+            if (sf.GetLabel(c.Nodes()[i]) == 1)
+                sumPhi += c.AlphaCi()[i];
+        }
+        BOOST_CHECK_EQUAL(sumPhi, c.ComputeEnergy(sf.GetLabels()));
+    }
+    for (auto& c : sf.Graph().GetPairwiseCliques()) {
+        int assgn = 0;
+        REAL sumPhi = 0;
+        for (size_t i = 0; i < c.Size(); ++i) {
+            if (sf.GetLabel(c.Nodes()[i]) == 1) {
+                sumPhi += c.AlphaCi()[i];
+                assgn |= (1 << i);
+            }
+        }
+        BOOST_CHECK_EQUAL(sumPhi, c.EnergyTable()[assgn] - c.EnergyTable()[0]);
+    }
+    for (auto& c : sf.Graph().GetCardinalityCliques()) {
+        REAL sumPhi = 0;
+        for (size_t i = 0; i < c.Size(); ++i) {
+            if (sf.GetLabel(c.Nodes()[i]) == 1)
+                sumPhi += c.AlphaCi()[i];
+        }
+        BOOST_CHECK_EQUAL(sumPhi, c.ComputeEnergy(sf.GetLabels()));
+    }
 }
 
 /* Sanity check to make sure basic flow computation working on a minimally
 * sized graph.
 */
-void TestMinimalFlow(SubmodularIBFS& sf) {
+void TestMinimalFlow(SubmodularIBFS<>& sf) {
     SetupMinimalFlow(sf);
 
     sf.Solve();
@@ -196,7 +299,7 @@ void TestMinimalFlow(SubmodularIBFS& sf) {
     }
 }
 
-void TestSearchSource(SubmodularIBFS& crf) {
+void TestSearchSource(SubmodularIBFS<>& crf) {
 	crf.AddNode(3);
 	crf.AddUnaryTerm(0, 12, 6);
 	crf.AddUnaryTerm(1, 8, 8);
@@ -220,6 +323,592 @@ void TestSearchSource(SubmodularIBFS& crf) {
     BOOST_CHECK_EQUAL(crf.ComputeEnergy(label), 23);
 }
 
+/* Potts cliques. Small ones are checked against the same energy written
+* out as tables; large ones, which have no table form, against CheckCut.
+*/
+void TestPotts(SubmodularIBFS<>& sf) {
+    const size_t n = 2000;
+    const size_t m = 1000;
+    const size_t k = 4;
+    const size_t big_k = 100;
+    const size_t num_big = 20;
+
+    std::mt19937 random_gen(0);
+    std::uniform_int_distribution<REAL> lambda_gen(0, 100);
+    std::uniform_int_distribution<REAL> unary_gen(-100, 100);
+    std::vector<NodeId> all_nodes(n);
+    std::iota(all_nodes.begin(), all_nodes.end(), 0);
+    auto randomNodes = [&](size_t size) {
+        std::shuffle(all_nodes.begin(), all_nodes.end(), random_gen);
+        return std::vector<NodeId>(all_nodes.begin(), all_nodes.begin() + size);
+    };
+
+    SubmodularIBFS<> table{sf.Params()};
+    SubmodularIBFS<> big{sf.Params()};
+    sf.AddNode(n);
+    table.AddNode(n);
+    big.AddNode(n);
+    for (size_t i = 0; i < n; ++i) {
+        const REAL unary = unary_gen(random_gen);
+        sf.AddUnaryTerm(i, unary);
+        table.AddUnaryTerm(i, unary);
+        big.AddUnaryTerm(i, unary);
+    }
+    for (size_t j = 0; j < m; ++j) {
+        const auto nodes = randomNodes(k);
+        const REAL lambda = lambda_gen(random_gen);
+        std::vector<REAL> energyTable(1 << k, lambda);
+        energyTable.front() = energyTable.back() = 0;
+        sf.AddPottsClique(nodes, lambda);
+        table.AddClique(nodes, energyTable);
+    }
+    for (size_t j = 0; j < num_big; ++j)
+        big.AddPottsClique(randomNodes(big_k), lambda_gen(random_gen));
+
+    sf.Solve();
+    table.Solve();
+    big.Solve();
+    CheckCut(sf);
+    CheckCut(table);
+    CheckCut(big);
+    BOOST_CHECK_EQUAL(sf.ComputeEnergy(), table.ComputeEnergy());
+    BOOST_CHECK_EQUAL(big.Graph().GetNumCliques(), num_big);
+    BOOST_CHECK_EQUAL(big.Graph().GetCliques().size(), 0);
+}
+
+/* Cardinality cliques. Small ones are checked against the same energy
+* written out as tables. Large ones hold Potts energies, and are checked
+* against Potts cliques, along with large robust P^n cliques and CheckCut.
+*/
+void TestCardinality(SubmodularIBFS<>& sf) {
+    const size_t n = 2000;
+    const size_t m = 1000;
+    const size_t k = 4;
+    const size_t big_k = 100;
+    const size_t num_big = 20;
+
+    std::mt19937 random_gen(0);
+    std::uniform_int_distribution<REAL> weight_gen(0, 100);
+    std::uniform_int_distribution<REAL> unary_gen(-100, 100);
+    std::vector<NodeId> all_nodes(n);
+    std::iota(all_nodes.begin(), all_nodes.end(), 0);
+    auto randomNodes = [&](size_t size) {
+        std::shuffle(all_nodes.begin(), all_nodes.end(), random_gen);
+        return std::vector<NodeId>(all_nodes.begin(), all_nodes.begin() + size);
+    };
+    // Random concave h: an offset plus decreasing increments
+    auto randomConcave = [&](size_t size) {
+        std::vector<REAL> increments(size);
+        for (auto& d : increments)
+            d = weight_gen(random_gen) - 50;
+        std::sort(increments.rbegin(), increments.rend());
+        std::vector<REAL> h(size + 1, weight_gen(random_gen) - 50);
+        for (size_t c = 0; c < size; ++c)
+            h[c+1] = h[c] + increments[c];
+        return h;
+    };
+
+    SubmodularIBFS<> table{sf.Params()};
+    SubmodularIBFS<> big{sf.Params()};
+    SubmodularIBFS<> potts{sf.Params()};
+    for (auto* ibfs : { &sf, &table, &big, &potts })
+        ibfs->AddNode(n);
+    for (size_t i = 0; i < n; ++i) {
+        const REAL unary = unary_gen(random_gen);
+        for (auto* ibfs : { &sf, &table, &big, &potts })
+            ibfs->AddUnaryTerm(i, unary);
+    }
+    for (size_t j = 0; j < m; ++j) {
+        const auto nodes = randomNodes(k);
+        const auto h = randomConcave(k);
+        std::vector<REAL> energyTable(1 << k);
+        // CheckCut expects tables with E(0) = 0
+        for (uint32_t a = 0; a < energyTable.size(); ++a)
+            energyTable[a] = h[__builtin_popcount(a)] - h[0];
+        sf.AddCardinalityClique(nodes, h);
+        table.AddClique(nodes, energyTable);
+        table.AddConstantTerm(h[0]);
+    }
+    for (size_t j = 0; j < num_big; ++j) {
+        const auto nodes = randomNodes(big_k);
+        const REAL lambda = weight_gen(random_gen);
+        std::vector<REAL> h(big_k + 1, lambda);
+        h.front() = h.back() = 0;
+        big.AddCardinalityClique(nodes, h);
+        potts.AddPottsClique(nodes, lambda);
+    }
+    for (size_t j = 0; j < num_big; ++j) {
+        // Robust P^n: min(gamma * min(c, k - c), lambda)
+        const auto nodes = randomNodes(big_k);
+        const REAL gamma = weight_gen(random_gen) / 10;
+        const REAL lambda = weight_gen(random_gen) * 5;
+        std::vector<REAL> h(big_k + 1);
+        for (size_t c = 0; c <= big_k; ++c)
+            h[c] = std::min(gamma * REAL(std::min(c, big_k - c)), lambda);
+        big.AddCardinalityClique(nodes, h);
+        potts.AddCardinalityClique(nodes, h);
+    }
+
+    for (auto* ibfs : { &sf, &table, &big, &potts }) {
+        ibfs->Solve();
+        CheckCut(*ibfs);
+    }
+    BOOST_CHECK_EQUAL(sf.ComputeEnergy(), table.ComputeEnergy());
+    BOOST_CHECK_EQUAL(big.ComputeEnergy(), potts.ComputeEnergy());
+    BOOST_CHECK_EQUAL(big.Graph().GetCardinalityCliques().size(), 2*num_big);
+}
+
+/* Pairwise terms, mixed with a few higher-order cliques. Checked against
+* the same terms added as 2-node tables.
+*/
+void TestPairwise(SubmodularIBFS<>& sf) {
+    const size_t n = 2000;
+    const size_t m = 8000;
+    const size_t num_potts = 200;
+
+    std::mt19937 random_gen(0);
+    std::uniform_int_distribution<REAL> energy_gen(-50, 50);
+    std::uniform_int_distribution<REAL> lambda_gen(0, 100);
+    std::uniform_int_distribution<NodeId> node_gen(0, n-1);
+
+    SubmodularIBFS<> table{sf.Params()};
+    sf.AddNode(n);
+    table.AddNode(n);
+    for (size_t i = 0; i < n; ++i) {
+        const REAL unary = energy_gen(random_gen);
+        sf.AddUnaryTerm(i, unary);
+        table.AddUnaryTerm(i, unary);
+    }
+    for (size_t j = 0; j < m; ++j) {
+        const NodeId nodes[] = { node_gen(random_gen), node_gen(random_gen) };
+        if (nodes[0] == nodes[1])
+            continue;
+        std::vector<REAL> energyTable(4);
+        for (auto& e : energyTable)
+            e = energy_gen(random_gen);
+        // Make it submodular
+        const REAL excess = energyTable[0] + energyTable[3] - energyTable[1] - energyTable[2];
+        if (excess > 0)
+            energyTable[1] += excess;
+        sf.AddPairwiseTerm(nodes[0], nodes[1], energyTable[0], energyTable[1], energyTable[2], energyTable[3]);
+        table.AddClique(nodes, 2, energyTable.data());
+    }
+    for (size_t j = 0; j < num_potts; ++j) {
+        std::vector<NodeId> nodes;
+        while (nodes.size() < 4) {
+            const NodeId i = node_gen(random_gen);
+            if (std::find(nodes.begin(), nodes.end(), i) == nodes.end())
+                nodes.push_back(i);
+        }
+        const REAL lambda = lambda_gen(random_gen);
+        std::vector<REAL> energyTable(16, lambda);
+        energyTable.front() = energyTable.back() = 0;
+        sf.AddClique(nodes, energyTable);
+        table.AddClique(nodes, energyTable);
+    }
+
+    sf.Solve();
+    table.Solve();
+    CheckCut(sf);
+    BOOST_CHECK_EQUAL(sf.ComputeEnergy(), table.ComputeEnergy());
+    BOOST_CHECK_EQUAL(sf.Graph().GetCliques().size(), num_potts);
+
+    // Non-submodular terms are left as tables, to be bounded
+    SubmodularIBFS<> bounded{sf.Params()};
+    bounded.AddNode(2);
+    bounded.AddPairwiseTerm(0, 1, 0, 1, 1, 5);
+    BOOST_CHECK_EQUAL(bounded.Graph().GetCliques().size(), 1);
+    BOOST_CHECK_EQUAL(bounded.Graph().GetPairwiseCliques().size(), 0);
+}
+
+/* Compacting cliques must not change the energy. The cliques are drawn from
+* a few node sets, in random node order, so that many of them get merged,
+* and some are modular and get folded into the unaries.
+*/
+void TestCompactCliques(SubmodularIBFS<>& sf) {
+    const size_t n = 200;
+    const size_t num_sets = 50;
+    const size_t m = 1000;
+
+    std::mt19937 random_gen(0);
+    std::uniform_int_distribution<REAL> energy_gen(-50, 50);
+    std::uniform_int_distribution<REAL> negative_gen(-50, 0);
+    std::uniform_int_distribution<NodeId> node_gen(0, n-1);
+    std::uniform_int_distribution<size_t> set_gen(0, num_sets-1);
+    std::uniform_int_distribution<int> kind_gen(0, 3);
+
+    std::vector<std::vector<NodeId>> sets;
+    while (sets.size() < num_sets) {
+        std::vector<NodeId> nodes;
+        while (nodes.size() < 3) {
+            const NodeId i = node_gen(random_gen) % (n - 20);
+            if (std::find(nodes.begin(), nodes.end(), i) == nodes.end())
+                nodes.push_back(i);
+        }
+        sets.push_back(nodes);
+    }
+
+    SubmodularIBFSParams ref_params = sf.Params();
+    ref_params.compactCliques = false;
+    SubmodularIBFS<> ref{ref_params};
+    sf.AddNode(n);
+    ref.AddNode(n);
+    for (size_t i = 0; i < n; ++i) {
+        const REAL unary = energy_gen(random_gen);
+        sf.AddUnaryTerm(i, unary);
+        ref.AddUnaryTerm(i, unary);
+    }
+    for (size_t c = 0; c < m; ++c) {
+        auto nodes = sets[set_gen(random_gen)];
+        std::shuffle(nodes.begin(), nodes.end(), random_gen);
+        const int kind = kind_gen(random_gen);
+        if (kind == 0 || kind == 1) {
+            // Submodular table with a modular part. Kind 1 is modular only.
+            std::vector<REAL> table(8, 0);
+            for (uint32_t subset = 1; subset < 8; ++subset) {
+                const bool single = (subset & (subset - 1)) == 0;
+                if (!single && kind == 1)
+                    continue;
+                const REAL weight = single ? energy_gen(random_gen) : negative_gen(random_gen);
+                for (uint32_t a = 0; a < 8; ++a) {
+                    if ((a & subset) == subset)
+                        table[a] += weight;
+                }
+            }
+            sf.AddClique(nodes, table);
+            ref.AddClique(nodes, table);
+        } else {
+            // Pairwise term on two of the nodes. Kind 3 is modular only.
+            REAL e[4];
+            for (auto& x : e)
+                x = energy_gen(random_gen);
+            e[3] = e[1] + e[2] - e[0] + ((kind == 2) ? negative_gen(random_gen) : 0);
+            sf.AddPairwiseTerm(nodes[0], nodes[1], e[0], e[1], e[2], e[3]);
+            ref.AddPairwiseTerm(nodes[0], nodes[1], e[0], e[1], e[2], e[3]);
+        }
+    }
+
+    // Modular cliques on nodes outside the sets above, which all get folded
+    for (NodeId i = n - 20; i < NodeId(n); i += 2) {
+        const std::vector<NodeId> nodes = { i, i + 1 };
+        const REAL e0 = energy_gen(random_gen);
+        const REAL e1 = energy_gen(random_gen);
+        const REAL e2 = energy_gen(random_gen);
+        const std::vector<REAL> table = { e0, e1, e2, e1 + e2 - e0 };
+        sf.AddClique(nodes, table);
+        ref.AddClique(nodes, table);
+        sf.AddPairwiseTerm(i + 1, i, e0, e1, e2, e1 + e2 - e0);
+        ref.AddPairwiseTerm(i + 1, i, e0, e1, e2, e1 + e2 - e0);
+    }
+
+    sf.Solve();
+    ref.Solve();
+    CheckCut(sf);
+    BOOST_CHECK_EQUAL(sf.ComputeEnergy(), ref.ComputeEnergy());
+    BOOST_CHECK(sf.Graph().GetCliques().size() <= num_sets);
+    BOOST_CHECK(sf.Graph().GetPairwiseCliques().size() <= 3*num_sets);
+
+    std::uniform_int_distribution<int> label_gen(0, 1);
+    std::vector<int> labels(n);
+    for (int trial = 0; trial < 20; ++trial) {
+        for (auto& l : labels)
+            l = label_gen(random_gen);
+        BOOST_CHECK_EQUAL(sf.ComputeEnergy(labels), ref.ComputeEnergy(labels));
+    }
+}
+
+// Random submodular table on k nodes: sums of negative weights on the
+// sets holding each subset of at least two nodes
+static std::vector<REAL> RandomSubmodularTable(size_t k, std::mt19937& random_gen) {
+    std::uniform_int_distribution<REAL> weight_gen(-100, 0);
+    std::vector<REAL> table(1 << k, 0);
+    for (uint32_t subset = 1; subset < table.size(); ++subset) {
+        if ((subset & (subset - 1)) == 0)
+            continue;
+        const REAL weight = weight_gen(random_gen);
+        for (uint32_t a = 0; a < table.size(); ++a) {
+            if ((a & subset) == subset)
+                table[a] += weight;
+        }
+    }
+    return table;
+}
+
+/* Solving again after rewriting some of the tables must give the same
+* result as solving the rewritten energy from scratch, even though only
+* the rewritten cliques are bounded again.
+*/
+void TestDirtyCliques(SubmodularIBFS<>& sf) {
+    const size_t n = 1000;
+    const size_t k = 4;
+    const size_t m = 1000;
+    const size_t num_changed = 50;
+    const unsigned int seed = 0;
+
+    GenRandom(sf, n, k, m, (REAL)100, (REAL)800, (REAL)1600, seed);
+    sf.Solve();
+    for (const auto& c : sf.Graph().GetCliques())
+        BOOST_CHECK(!c.Dirty());
+    CheckCut(sf);
+
+    // ResetFlow only restores the cliques the solve pushed on, and leaves
+    // phi_si - phi_it = sum of alpha, with every alpha back at -psi
+    size_t num_touched = 0;
+    for (const auto& c : sf.Graph().GetCliques())
+        num_touched += c.Touched();
+    BOOST_CHECK(num_touched > 0);
+    sf.Graph().ResetFlow();
+    std::vector<REAL> alpha_sum(n, 0);
+    for (const auto& c : sf.Graph().GetCliques()) {
+        BOOST_CHECK(!c.Touched());
+        for (size_t i = 0; i < c.Size(); ++i)
+            alpha_sum[c.Nodes()[i]] += c.AlphaCi()[i];
+    }
+    for (NodeId i = 0; i < static_cast<NodeId>(n); ++i)
+        BOOST_CHECK_EQUAL(sf.Graph().GetPhi_si()[i] - sf.Graph().GetPhi_it()[i], alpha_sum[i]);
+
+    std::mt19937 random_gen(seed);
+    std::uniform_int_distribution<size_t> clique_gen(0, m-1);
+    std::vector<std::pair<size_t, std::vector<REAL>>> changes;
+    for (size_t j = 0; j < num_changed; ++j)
+        changes.emplace_back(clique_gen(random_gen), RandomSubmodularTable(k, random_gen));
+    auto applyChanges = [&](SubmodularIBFS<>& ibfs) {
+        for (const auto& change : changes) {
+            auto table = ibfs.Graph().GetCliques()[change.first].EnergyTable();
+            std::copy(change.second.begin(), change.second.end(), table.begin());
+        }
+    };
+    applyChanges(sf);
+    for (const auto& change : changes)
+        BOOST_CHECK(sf.Graph().GetCliques()[change.first].Dirty());
+    sf.Solve();
+    CheckCut(sf);
+
+    SubmodularIBFS<> fresh{sf.Params()};
+    GenRandom(fresh, n, k, m, (REAL)100, (REAL)800, (REAL)1600, seed);
+    applyChanges(fresh);
+    fresh.Solve();
+    BOOST_CHECK_EQUAL(sf.ComputeEnergy(), fresh.ComputeEnergy());
+}
+
+/* Solve a sequence of problems, changing some tables and all the unaries
+ * between solves. Each solve must find as good a cut as a solver starting
+ * from scratch every time.
+ */
+void TestDynamic(SubmodularIBFS<>& sf) {
+    const size_t n = 1000;
+    const size_t k = 4;
+    const size_t m = 1000;
+    const size_t num_pairwise = 500;
+    const size_t num_changed = 50;
+    const size_t num_rounds = 4;
+    const unsigned int seed = 0;
+
+    SubmodularIBFS<> fresh;
+    std::mt19937 random_gen(seed);
+    std::uniform_int_distribution<SubmodularIBFS<>::NodeId> node_gen(0, n-1);
+    std::uniform_int_distribution<REAL> pairwise_gen(0, 100);
+    for (auto* ibfs : { &sf, &fresh })
+        GenRandom(*ibfs, n, k, m, (REAL)100, (REAL)800, (REAL)1600, seed);
+    for (size_t j = 0; j < num_pairwise; ++j) {
+        const auto i = node_gen(random_gen);
+        const auto l = node_gen(random_gen);
+        const REAL weight = pairwise_gen(random_gen);
+        if (i == l)
+            continue;
+        for (auto* ibfs : { &sf, &fresh })
+            ibfs->AddPairwiseTerm(i, l, 0, weight, weight, 0);
+    }
+    sf.Solve();
+    CheckCut(sf);
+
+    std::uniform_int_distribution<size_t> clique_gen(0, m-1);
+    std::uniform_int_distribution<REAL> unary_gen(0, 1600);
+    for (size_t round = 0; round < num_rounds; ++round) {
+        std::vector<std::pair<size_t, std::vector<REAL>>> changes;
+        for (size_t j = 0; j < num_changed; ++j)
+            changes.emplace_back(clique_gen(random_gen), RandomSubmodularTable(k, random_gen));
+        std::vector<std::pair<REAL, REAL>> unaries;
+        for (size_t i = 0; i < n; ++i)
+            unaries.emplace_back(unary_gen(random_gen), unary_gen(random_gen));
+        for (auto* ibfs : { &sf, &fresh }) {
+            for (const auto& change : changes) {
+                auto table = ibfs->Graph().GetCliques()[change.first].EnergyTable();
+                std::copy(change.second.begin(), change.second.end(), table.begin());
+            }
+            ibfs->ClearUnaries();
+            for (size_t i = 0; i < n; ++i)
+                ibfs->AddUnaryTerm(i, unaries[i].first, unaries[i].second);
+        }
+        sf.Solve();
+        BOOST_CHECK(sf.Graph().HasFlow());
+        CheckCut(sf);
+        fresh.Solve();
+        BOOST_CHECK_EQUAL(sf.ComputeEnergy(), fresh.ComputeEnergy());
+    }
+}
+
+/* Groups of nodes, joined by modular cliques, zero Potts cliques and
+* cliques whose only nodes outside the group are fixed. Solving the groups
+* one by one must give the same energy as solving the whole graph.
+*/
+void TestComponents(SubmodularIBFS<>& sf) {
+    const size_t num_groups = 200;
+    const size_t group_size = 8;
+    const size_t cliques_per_group = 6;
+    // Each group is followed by a node that only the joining cliques use
+    const size_t n = num_groups * (group_size + 1);
+
+    std::mt19937 random_gen(0);
+    std::uniform_int_distribution<REAL> energy_gen(-100, 100);
+    std::uniform_int_distribution<REAL> weight_gen(0, 100);
+    std::uniform_int_distribution<size_t> slot_gen(0, group_size - 1);
+    std::uniform_int_distribution<size_t> group_gen(1, num_groups - 1);
+
+    SubmodularIBFSParams ref_params = sf.Params();
+    ref_params.components = false;
+    SubmodularIBFS<> ref{ref_params};
+    std::vector<bool> fixed(n, false);
+    for (auto* ibfs : { &sf, &ref })
+        ibfs->AddNode(n);
+    for (size_t i = 0; i < n; ++i) {
+        const REAL unary = energy_gen(random_gen);
+        for (auto* ibfs : { &sf, &ref })
+            ibfs->AddUnaryTerm(i, unary);
+    }
+    auto group_node = [&](size_t g, size_t slot) { return NodeId(g * (group_size + 1) + slot); };
+    for (size_t g = 0; g < num_groups; ++g) {
+        for (size_t c = 0; c < cliques_per_group; ++c) {
+            std::vector<NodeId> nodes;
+            while (nodes.size() < 3) {
+                const NodeId i = group_node(g, slot_gen(random_gen));
+                if (std::find(nodes.begin(), nodes.end(), i) == nodes.end())
+                    nodes.push_back(i);
+            }
+            const auto table = RandomSubmodularTable(3, random_gen);
+            const REAL weight = weight_gen(random_gen);
+            for (auto* ibfs : { &sf, &ref }) {
+                ibfs->AddClique(nodes, table);
+                ibfs->AddPairwiseTerm(nodes[0], nodes[1], 0, weight, weight, 0);
+            }
+        }
+
+        const NodeId joint = group_node(g, group_size);
+        const NodeId next_joint = group_node((g + 1) % num_groups, group_size);
+        const NodeId other = group_node((g + group_gen(random_gen)) % num_groups, slot_gen(random_gen));
+        const NodeId mine = group_node(g, slot_gen(random_gen));
+        const REAL e1 = energy_gen(random_gen);
+        const REAL e2 = energy_gen(random_gen);
+        const auto table = RandomSubmodularTable(3, random_gen);
+        fixed[joint] = true;
+        for (auto* ibfs : { &sf, &ref }) {
+            ibfs->AddClique({ joint, next_joint, mine }, table);
+            ibfs->AddClique({ mine, other }, { 0, e1, e2, e1 + e2 });
+            ibfs->AddPottsClique({ mine, other }, 0);
+        }
+    }
+
+    // The joints are fixed, so no flow crosses between groups
+    sf.Params().fixedVars = fixed;
+    ref.Params().fixedVars = fixed;
+    sf.Solve();
+    ref.Solve();
+    BOOST_CHECK(!sf.Graph().HasFlow());
+    BOOST_CHECK(sf.Stats().cliquePushes > 0);
+    for (const auto& c : sf.Graph().GetCliques())
+        BOOST_CHECK_EQUAL(c.ComputeAlphaEnergy(sf.GetLabels()), 0);
+    BOOST_CHECK_EQUAL(sf.ComputeEnergy(), ref.ComputeEnergy());
+
+    // Now the joints chain all the groups together, which isn't worth
+    // splitting up
+    sf.Params().fixedVars.clear();
+    ref.Params().fixedVars.clear();
+    sf.Solve();
+    ref.Solve();
+    BOOST_CHECK(sf.Graph().HasFlow());
+    CheckCut(sf);
+    BOOST_CHECK_EQUAL(sf.ComputeEnergy(), ref.ComputeEnergy());
+}
+
+/* Sweep parametric unaries over a list of lambdas. The cut at each lambda
+ * must be as good as a solve from scratch with the unaries at that lambda,
+ * and a plain solve afterwards must ignore the parametric unaries.
+ */
+void TestParametricSweep(SubmodularIBFS<>& sf) {
+    const size_t n = 1000;
+    const size_t k = 4;
+    const size_t m = 1000;
+    const unsigned int seed = 0;
+    const std::vector<REAL> lambdas = { -100, -40, -10, 0, 10, 40, 100 };
+
+    GenRandom(sf, n, k, m, (REAL)100, (REAL)800, (REAL)1600, seed);
+    std::mt19937 random_gen(seed);
+    std::uniform_int_distribution<REAL> slope_gen(0, 20);
+    std::vector<REAL> slopes(n);
+    for (size_t i = 0; i < n; ++i) {
+        slopes[i] = slope_gen(random_gen);
+        sf.AddParametricUnaryTerm(i, slopes[i]);
+    }
+    std::vector<size_t> breakpoints;
+    sf.SolveParametric(lambdas, breakpoints);
+    BOOST_CHECK_EQUAL(breakpoints.size(), n);
+
+    std::vector<int> labels(n);
+    REAL zero_energy = 0;
+    for (size_t l = 0; l < lambdas.size(); ++l) {
+        for (size_t i = 0; i < n; ++i)
+            labels[i] = (breakpoints[i] <= l);
+        REAL energy = sf.ComputeEnergy(labels);
+        for (size_t i = 0; i < n; ++i) {
+            if (!labels[i])
+                energy += lambdas[l] * slopes[i];
+        }
+
+        SubmodularIBFS<> fresh;
+        GenRandom(fresh, n, k, m, (REAL)100, (REAL)800, (REAL)1600, seed);
+        for (size_t i = 0; i < n; ++i)
+            fresh.AddUnaryTerm(i, lambdas[l] * slopes[i], 0);
+        fresh.Solve();
+        BOOST_CHECK_EQUAL(energy, fresh.ComputeEnergy());
+        if (lambdas[l] == 0)
+            zero_energy = energy;
+    }
+    // The labels are left at the last lambda, and the sweep moves some
+    // nodes into S
+    BOOST_CHECK(sf.GetLabels() == labels);
+    BOOST_CHECK(std::any_of(breakpoints.begin(), breakpoints.end(),
+                [&](size_t b) { return 0 < b && b < lambdas.size(); }));
+
+    sf.Solve();
+    CheckCut(sf);
+    BOOST_CHECK_EQUAL(sf.ComputeEnergy(), zero_energy);
+}
+
+/* The stats describe the last solve only: solving again in dynamic mode,
+ * with nothing changed, finds the flow already maximal.
+ */
+void TestStats(SubmodularIBFS<>& sf) {
+    const size_t n = 1000;
+    const size_t k = 4;
+    const size_t m = 1000;
+
+    sf.Params().dynamic = true;
+    GenRandom(sf, n, k, m, (REAL)100, (REAL)800, (REAL)1600, 0);
+    sf.Solve();
+    const FlowStats stats = sf.Stats();
+    BOOST_CHECK(stats.cliquePushes > 0);
+    BOOST_CHECK(stats.arcsScanned > 0);
+    BOOST_CHECK(stats.exchangeCapacityCalls > 0);
+    BOOST_CHECK(stats.maxTreeDepth > 0);
+    BOOST_CHECK(stats.totalTime >= stats.initTime);
+
+    sf.Solve();
+    CheckCut(sf);
+    BOOST_CHECK_EQUAL(sf.Stats().cliquePushes, 0);
+    BOOST_CHECK_EQUAL(sf.Stats().augmentations, 0);
+    BOOST_CHECK(sf.Stats().arcsScanned <= stats.arcsScanned);
+}
+
 /* More complicated test case on a larger graph.
 *
 * GenRandom generates a random submodular function that can be turned into
@@ -227,7 +916,7 @@ void TestSearchSource(SubmodularIBFS& crf) {
 * same energy function for both SubmodularIBFS and HigherOrderEnergy
 * and then check that they give the same answer.
 */
-void TestIdenticalToHigherOrder(SubmodularIBFS& sf) {
+void TestIdenticalToHigherOrder(SubmodularIBFS<>& sf) {
     HigherOrderEnergy<REAL, 4> ho;
 
     const size_t n = 16000;
@@ -252,10 +941,10 @@ void TestIdenticalToHigherOrder(SubmodularIBFS& sf) {
     for (size_t i = 0; i < n; ++i)
         qr_labels.push_back(qr.GetLabel(i));
 
-    SubmodularIBFS orig;
+    SubmodularIBFS<> orig;
     GenRandom(orig, n, k, m, clique_range, unary_mean, unary_var, seed);
     orig.Graph().ResetFlow();
-    sf.Graph().UpperBoundCliques(SoSGraph::UBfn::cvpr14);
+    sf.Graph().UpperBoundCliques(SoSGraphBase::UBfn::cvpr14);
     for (size_t i = 0; i < n; ++i) {
         BOOST_REQUIRE_EQUAL(sf.Graph().GetC_si()[i], orig.Graph().GetC_si()[i]);
         BOOST_REQUIRE_EQUAL(sf.Graph().GetC_it()[i], orig.Graph().GetC_it()[i]);
@@ -297,71 +986,455 @@ void TestIdenticalToHigherOrder(SubmodularIBFS& sf) {
     }
 }
 
+/* Solve the same random function with 32 and 64 bit capacities. The energies
+ * are small enough for either width, so both must reach the same minimum.
+ */
+void TestCapacityWidths(const SubmodularIBFSParams& params) {
+    const size_t n = 4000;
+    const size_t m = 4000;
+    const size_t k = 4;
+    const unsigned int seed = 0;
+
+    SubmodularIBFS<int32_t> narrow{params};
+    SubmodularIBFS<int64_t> wide{params};
+    GenRandom(narrow, n, k, m, int32_t(100), int32_t(800), int32_t(1600), seed);
+    GenRandom(wide, n, k, m, int64_t(100), int64_t(800), int64_t(1600), seed);
+    narrow.Solve();
+    wide.Solve();
+
+    BOOST_CHECK_EQUAL(narrow.ComputeEnergy(), wide.ComputeEnergy());
+    BOOST_CHECK_EQUAL(narrow.ComputeEnergy(wide.GetLabels()), wide.ComputeEnergy());
+}
+
 BOOST_AUTO_TEST_SUITE(TestBidirectional)
     BOOST_AUTO_TEST_CASE(Constructor) {
-        SubmodularIBFS sf;
+        SubmodularIBFS<> sf;
         TestConstructor(sf);
     }
     BOOST_AUTO_TEST_CASE(MinimalFlowSetup) {
-        SubmodularIBFS sf;
+        SubmodularIBFS<> sf;
         TestMinimalFlowSetup(sf);
     }
     BOOST_AUTO_TEST_CASE(RandomFlowSetup) {
-        SubmodularIBFS sf;
+        SubmodularIBFS<> sf;
         TestRandomFlowSetup(sf);
     }
+    BOOST_AUTO_TEST_CASE(ReservedSetup) {
+        SubmodularIBFS<> sf;
+        TestReservedSetup(sf);
+    }
     BOOST_AUTO_TEST_CASE(RandomFlowNormalized) {
-        SubmodularIBFS sf;
+        SubmodularIBFS<> sf;
         TestRandomFlowNormalized(sf);
     }
     BOOST_AUTO_TEST_CASE(MinimalFlow) {
-        SubmodularIBFS sf;
+        SubmodularIBFS<> sf;
         TestMinimalFlow(sf);
     }
     BOOST_AUTO_TEST_CASE(SearchSource) {
-        SubmodularIBFS sf;
+        SubmodularIBFS<> sf;
         TestSearchSource(sf);
     }
     BOOST_AUTO_TEST_CASE(IdenticalToHigherOrder) {
-        SubmodularIBFS sf;
+        SubmodularIBFS<> sf;
+        TestIdenticalToHigherOrder(sf);
+    }
+    BOOST_AUTO_TEST_CASE(Potts) {
+        SubmodularIBFS<> sf;
+        TestPotts(sf);
+    }
+    BOOST_AUTO_TEST_CASE(Pairwise) {
+        SubmodularIBFS<> sf;
+        TestPairwise(sf);
+    }
+    BOOST_AUTO_TEST_CASE(Cardinality) {
+        SubmodularIBFS<> sf;
+        TestCardinality(sf);
+    }
+    BOOST_AUTO_TEST_CASE(DirtyCliques) {
+        SubmodularIBFS<> sf;
+        TestDirtyCliques(sf);
+    }
+    BOOST_AUTO_TEST_CASE(Dynamic) {
+        SubmodularIBFSParams params;
+        params.dynamic = true;
+        SubmodularIBFS<> sf {params};
+        TestDynamic(sf);
+    }
+    BOOST_AUTO_TEST_CASE(CompactCliques) {
+        SubmodularIBFSParams params;
+        params.compactCliques = true;
+        SubmodularIBFS<> sf {params};
+        TestCompactCliques(sf);
+    }
+    BOOST_AUTO_TEST_CASE(IdenticalToHigherOrderCached) {
+        SubmodularIBFSParams params;
+        params.cacheCapacities = true;
+        SubmodularIBFS<> sf {params};
         TestIdenticalToHigherOrder(sf);
     }
+    BOOST_AUTO_TEST_CASE(IdenticalToHigherOrderThreads) {
+        SubmodularIBFSParams params;
+        params.threads = 4;
+        SubmodularIBFS<> sf {params};
+        TestIdenticalToHigherOrder(sf);
+    }
+    BOOST_AUTO_TEST_CASE(DynamicThreads) {
+        SubmodularIBFSParams params;
+        params.dynamic = true;
+        params.threads = 4;
+        SubmodularIBFS<> sf {params};
+        TestDynamic(sf);
+    }
+    BOOST_AUTO_TEST_CASE(Components) {
+        SubmodularIBFSParams params;
+        params.components = true;
+        SubmodularIBFS<> sf {params};
+        TestComponents(sf);
+    }
+    BOOST_AUTO_TEST_CASE(ComponentsThreads) {
+        SubmodularIBFSParams params;
+        params.components = true;
+        params.threads = 4;
+        SubmodularIBFS<> sf {params};
+        TestComponents(sf);
+    }
+    BOOST_AUTO_TEST_CASE(Stats) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::bidirectional };
+        SubmodularIBFS<> sf {params};
+        TestStats(sf);
+    }
 BOOST_AUTO_TEST_SUITE_END()
 
 BOOST_AUTO_TEST_SUITE(TestSource)
     BOOST_AUTO_TEST_CASE(Constructor) {
         SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::source };
-        SubmodularIBFS sf {params};
+        SubmodularIBFS<> sf {params};
         TestConstructor(sf);
     }
     BOOST_AUTO_TEST_CASE(MinimalFlowSetup) {
         SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::source };
-        SubmodularIBFS sf {params};
+        SubmodularIBFS<> sf {params};
         TestMinimalFlowSetup(sf);
     }
     BOOST_AUTO_TEST_CASE(RandomFlowSetup) {
         SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::source };
-        SubmodularIBFS sf {params};
+        SubmodularIBFS<> sf {params};
         TestRandomFlowSetup(sf);
     }
     BOOST_AUTO_TEST_CASE(RandomFlowNormalized) {
         SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::source };
-        SubmodularIBFS sf {params};
+        SubmodularIBFS<> sf {params};
         TestRandomFlowNormalized(sf);
     }
     BOOST_AUTO_TEST_CASE(MinimalFlow) {
         SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::source };
-        SubmodularIBFS sf {params};
+        SubmodularIBFS<> sf {params};
         TestMinimalFlow(sf);
     }
     BOOST_AUTO_TEST_CASE(SearchSource) {
         SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::source };
-        SubmodularIBFS sf {params};
+        SubmodularIBFS<> sf {params};
         TestSearchSource(sf);
     }
     BOOST_AUTO_TEST_CASE(IdenticalToHigherOrder) {
         SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::source };
-        SubmodularIBFS sf {params};
+        SubmodularIBFS<> sf {params};
         TestIdenticalToHigherOrder(sf);
     }
+    BOOST_AUTO_TEST_CASE(Potts) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::source };
+        SubmodularIBFS<> sf {params};
+        TestPotts(sf);
+    }
+    BOOST_AUTO_TEST_CASE(Pairwise) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::source };
+        SubmodularIBFS<> sf {params};
+        TestPairwise(sf);
+    }
+    BOOST_AUTO_TEST_CASE(Cardinality) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::source };
+        SubmodularIBFS<> sf {params};
+        TestCardinality(sf);
+    }
+    BOOST_AUTO_TEST_CASE(Dynamic) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::source };
+        params.dynamic = true;
+        SubmodularIBFS<> sf {params};
+        TestDynamic(sf);
+    }
+    BOOST_AUTO_TEST_CASE(Stats) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::source };
+        SubmodularIBFS<> sf {params};
+        TestStats(sf);
+    }
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(TestParametric)
+    BOOST_AUTO_TEST_CASE(MinimalFlow) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::parametric };
+        SubmodularIBFS<> sf {params};
+        TestMinimalFlow(sf);
+    }
+    BOOST_AUTO_TEST_CASE(IdenticalToHigherOrder) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::parametric };
+        SubmodularIBFS<> sf {params};
+        TestIdenticalToHigherOrder(sf);
+    }
+    BOOST_AUTO_TEST_CASE(Potts) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::parametric };
+        SubmodularIBFS<> sf {params};
+        TestPotts(sf);
+    }
+    BOOST_AUTO_TEST_CASE(Pairwise) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::parametric };
+        SubmodularIBFS<> sf {params};
+        TestPairwise(sf);
+    }
+    BOOST_AUTO_TEST_CASE(Cardinality) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::parametric };
+        SubmodularIBFS<> sf {params};
+        TestCardinality(sf);
+    }
+    BOOST_AUTO_TEST_CASE(ParametricSweep) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::parametric };
+        SubmodularIBFS<> sf {params};
+        TestParametricSweep(sf);
+    }
+    BOOST_AUTO_TEST_CASE(ParametricSweepDynamic) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::parametric };
+        params.dynamic = true;
+        SubmodularIBFS<> sf {params};
+        TestParametricSweep(sf);
+    }
+    BOOST_AUTO_TEST_CASE(Stats) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::parametric };
+        SubmodularIBFS<> sf {params};
+        TestStats(sf);
+    }
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(TestExcess)
+    BOOST_AUTO_TEST_CASE(Constructor) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::excess };
+        SubmodularIBFS<> sf {params};
+        TestConstructor(sf);
+    }
+    BOOST_AUTO_TEST_CASE(MinimalFlowSetup) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::excess };
+        SubmodularIBFS<> sf {params};
+        TestMinimalFlowSetup(sf);
+    }
+    BOOST_AUTO_TEST_CASE(RandomFlowSetup) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::excess };
+        SubmodularIBFS<> sf {params};
+        TestRandomFlowSetup(sf);
+    }
+    BOOST_AUTO_TEST_CASE(RandomFlowNormalized) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::excess };
+        SubmodularIBFS<> sf {params};
+        TestRandomFlowNormalized(sf);
+    }
+    BOOST_AUTO_TEST_CASE(MinimalFlow) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::excess };
+        SubmodularIBFS<> sf {params};
+        TestMinimalFlow(sf);
+    }
+    BOOST_AUTO_TEST_CASE(SearchSource) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::excess };
+        SubmodularIBFS<> sf {params};
+        TestSearchSource(sf);
+    }
+    BOOST_AUTO_TEST_CASE(IdenticalToHigherOrder) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::excess };
+        SubmodularIBFS<> sf {params};
+        TestIdenticalToHigherOrder(sf);
+    }
+    BOOST_AUTO_TEST_CASE(Potts) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::excess };
+        SubmodularIBFS<> sf {params};
+        TestPotts(sf);
+    }
+    BOOST_AUTO_TEST_CASE(Pairwise) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::excess };
+        SubmodularIBFS<> sf {params};
+        TestPairwise(sf);
+    }
+    BOOST_AUTO_TEST_CASE(Cardinality) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::excess };
+        SubmodularIBFS<> sf {params};
+        TestCardinality(sf);
+    }
+    BOOST_AUTO_TEST_CASE(Dynamic) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::excess };
+        params.dynamic = true;
+        SubmodularIBFS<> sf {params};
+        TestDynamic(sf);
+    }
+    BOOST_AUTO_TEST_CASE(Stats) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::excess };
+        SubmodularIBFS<> sf {params};
+        TestStats(sf);
+    }
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(TestPushRelabel)
+    BOOST_AUTO_TEST_CASE(Constructor) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::pushRelabel };
+        SubmodularIBFS<> sf {params};
+        TestConstructor(sf);
+    }
+    BOOST_AUTO_TEST_CASE(MinimalFlowSetup) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::pushRelabel };
+        SubmodularIBFS<> sf {params};
+        TestMinimalFlowSetup(sf);
+    }
+    BOOST_AUTO_TEST_CASE(RandomFlowSetup) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::pushRelabel };
+        SubmodularIBFS<> sf {params};
+        TestRandomFlowSetup(sf);
+    }
+    BOOST_AUTO_TEST_CASE(RandomFlowNormalized) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::pushRelabel };
+        SubmodularIBFS<> sf {params};
+        TestRandomFlowNormalized(sf);
+    }
+    BOOST_AUTO_TEST_CASE(MinimalFlow) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::pushRelabel };
+        SubmodularIBFS<> sf {params};
+        TestMinimalFlow(sf);
+    }
+    BOOST_AUTO_TEST_CASE(SearchSource) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::pushRelabel };
+        SubmodularIBFS<> sf {params};
+        TestSearchSource(sf);
+    }
+    BOOST_AUTO_TEST_CASE(IdenticalToHigherOrder) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::pushRelabel };
+        SubmodularIBFS<> sf {params};
+        TestIdenticalToHigherOrder(sf);
+    }
+    BOOST_AUTO_TEST_CASE(Potts) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::pushRelabel };
+        SubmodularIBFS<> sf {params};
+        TestPotts(sf);
+    }
+    BOOST_AUTO_TEST_CASE(Pairwise) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::pushRelabel };
+        SubmodularIBFS<> sf {params};
+        TestPairwise(sf);
+    }
+    BOOST_AUTO_TEST_CASE(Cardinality) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::pushRelabel };
+        SubmodularIBFS<> sf {params};
+        TestCardinality(sf);
+    }
+    BOOST_AUTO_TEST_CASE(Dynamic) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::pushRelabel };
+        params.dynamic = true;
+        SubmodularIBFS<> sf {params};
+        TestDynamic(sf);
+    }
+    BOOST_AUTO_TEST_CASE(Components) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::pushRelabel };
+        params.components = true;
+        SubmodularIBFS<> sf {params};
+        TestComponents(sf);
+    }
+    BOOST_AUTO_TEST_CASE(Stats) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::pushRelabel };
+        SubmodularIBFS<> sf {params};
+        TestStats(sf);
+    }
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(TestRegion)
+    BOOST_AUTO_TEST_CASE(Constructor) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::region };
+        params.regions = 8;
+        SubmodularIBFS<> sf {params};
+        TestConstructor(sf);
+    }
+    BOOST_AUTO_TEST_CASE(MinimalFlowSetup) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::region };
+        params.regions = 8;
+        SubmodularIBFS<> sf {params};
+        TestMinimalFlowSetup(sf);
+    }
+    BOOST_AUTO_TEST_CASE(RandomFlowSetup) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::region };
+        params.regions = 8;
+        SubmodularIBFS<> sf {params};
+        TestRandomFlowSetup(sf);
+    }
+    BOOST_AUTO_TEST_CASE(RandomFlowNormalized) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::region };
+        params.regions = 8;
+        SubmodularIBFS<> sf {params};
+        TestRandomFlowNormalized(sf);
+    }
+    BOOST_AUTO_TEST_CASE(MinimalFlow) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::region };
+        params.regions = 8;
+        SubmodularIBFS<> sf {params};
+        TestMinimalFlow(sf);
+    }
+    BOOST_AUTO_TEST_CASE(SearchSource) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::region };
+        params.regions = 8;
+        SubmodularIBFS<> sf {params};
+        TestSearchSource(sf);
+    }
+    BOOST_AUTO_TEST_CASE(IdenticalToHigherOrder) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::region };
+        params.regions = 8;
+        SubmodularIBFS<> sf {params};
+        TestIdenticalToHigherOrder(sf);
+    }
+    BOOST_AUTO_TEST_CASE(Potts) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::region };
+        params.regions = 8;
+        SubmodularIBFS<> sf {params};
+        TestPotts(sf);
+    }
+    BOOST_AUTO_TEST_CASE(Pairwise) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::region };
+        params.regions = 8;
+        SubmodularIBFS<> sf {params};
+        TestPairwise(sf);
+    }
+    BOOST_AUTO_TEST_CASE(Cardinality) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::region };
+        params.regions = 8;
+        SubmodularIBFS<> sf {params};
+        TestCardinality(sf);
+    }
+    BOOST_AUTO_TEST_CASE(Dynamic) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::region };
+        params.regions = 8;
+        params.dynamic = true;
+        SubmodularIBFS<> sf {params};
+        TestDynamic(sf);
+    }
+    BOOST_AUTO_TEST_CASE(IdenticalToHigherOrderThreads) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::region };
+        params.regions = 8;
+        params.threads = 4;
+        params.cacheCapacities = true;
+        SubmodularIBFS<> sf {params};
+        TestIdenticalToHigherOrder(sf);
+    }
+    BOOST_AUTO_TEST_CASE(Stats) {
+        SubmodularIBFSParams params{ SubmodularIBFSParams::FlowAlgorithm::region };
+        params.regions = 8;
+        SubmodularIBFS<> sf {params};
+        TestStats(sf);
+    }
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(TestCapacityType)
+    BOOST_AUTO_TEST_CASE(Int32MatchesInt64) {
+        for (const auto& alg : SubmodularIBFSParams::algNames)
+            TestCapacityWidths(SubmodularIBFSParams{ alg.first });
+    }
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,206 @@
+#include <boost/test/unit_test.hpp>
+#include <random>
+#include <vector>
+#include "subset-kernels.hpp"
+#include "sos-graph.hpp"
+
+/* Reference implementations, iterating over all subsets one at a time */
+template <typename R>
+static R ReferenceMin(const std::vector<R>& table, int n, int u, int v) {
+    R min_energy = std::numeric_limits<R>::max();
+    for (uint32_t a = 0; a < table.size(); ++a) {
+        if ((a & (1 << u)) && !(a & (1 << v)))
+            min_energy = std::min(min_energy, table[a]);
+    }
+    return min_energy;
+}
+
+template <typename R>
+static void ReferencePush(std::vector<R>& table, int n, int u, int v, R delta) {
+    for (uint32_t a = 0; a < table.size(); ++a) {
+        if ((a & (1 << u)) && !(a & (1 << v))) {
+            table[a] -= delta;
+            table[a ^ (1 << u) ^ (1 << v)] += delta;
+        }
+    }
+}
+
+/* Check every kernel supported by this CPU against the reference, including
+ * clique sizes above the precomputed table limit. 32 bit tables get twice
+ * the lanes per register, so they take different paths through the kernels.
+ */
+template <typename R>
+static void CheckKernels(SimdLevel level) {
+    SetSimdLevel(level);
+    BOOST_REQUIRE(GetSimdLevel() == level);
+    std::mt19937 random_gen(0);
+    std::uniform_int_distribution<R> energy_dist(-1000, 1000);
+    for (int n = 2; n <= 14; ++n) {
+        std::vector<R> table(1 << n);
+        for (auto& e : table)
+            e = energy_dist(random_gen);
+        for (int u = 0; u < n; ++u) {
+            for (int v = 0; v < n; ++v) {
+                if (u == v) continue;
+                BOOST_REQUIRE_EQUAL(SubsetMin(table.data(), n, u, v), ReferenceMin(table, n, u, v));
+                std::vector<R> expected = table;
+                ReferencePush<R>(expected, n, u, v, 17);
+                SubsetPush<R>(table.data(), n, u, v, 17);
+                BOOST_REQUIRE(table == expected);
+            }
+        }
+    }
+}
+
+/* The fixed-size clique operations must agree with the runtime-size ones.
+ * Pushes keep the two tables identical, so check every arc after each one.
+ * The fixed-size side caches its capacities, the generic side doesn't.
+ */
+template <typename R, int K>
+static void CheckFixedSize() {
+    std::mt19937 random_gen(K);
+    std::uniform_int_distribution<R> energy_dist(0, 20);
+    std::vector<SoSGraphBase::NodeId> nodes(K);
+    std::vector<R> table(1 << K);
+    for (auto& e : table)
+        e = energy_dist(random_gen);
+    table[0] = table[(1 << K) - 1] = 0;
+    SoSGraph<R> fixed_graph, generic_graph;
+    fixed_graph.AddNode(K);
+    generic_graph.AddNode(K);
+    for (int i = 0; i < K; ++i)
+        nodes[i] = i;
+    auto& fixed = fixed_graph.AddClique(nodes, table);
+    auto& generic = generic_graph.AddClique(nodes, table);
+    // Also exercise the capacity cache and its invalidation on Push
+    fixed_graph.SetCapacityCache(true);
+    fixed_graph.ResetFlow();
+    generic_graph.ResetFlow();
+    for (int u = 0; u < K; ++u) {
+        for (int v = 0; v < K; ++v) {
+            if (u == v) continue;
+            for (int i = 0; i < K; ++i) {
+                for (int j = 0; j < K; ++j) {
+                    if (i == j) continue;
+                    BOOST_REQUIRE_EQUAL(fixed.template ExchangeCapacity<K>(i, j), generic.ExchangeCapacity(i, j));
+                    BOOST_REQUIRE_EQUAL(fixed.template NonzeroCapacity<K>(i, j), generic.NonzeroCapacity(i, j));
+                }
+                // The residual bitmasks are the rows and columns of
+                // NonzeroCapacity, without the diagonal
+                uint32_t out_arcs = 0, in_arcs = 0;
+                for (int j = 0; j < K; ++j) {
+                    if (i == j) continue;
+                    out_arcs |= uint32_t(generic.NonzeroCapacity(i, j)) << j;
+                    in_arcs |= uint32_t(generic.NonzeroCapacity(j, i)) << j;
+                }
+                BOOST_REQUIRE_EQUAL(fixed.template ResidualArcs<K>(i, true), out_arcs);
+                BOOST_REQUIRE_EQUAL(fixed.template ResidualArcs<K>(i, false), in_arcs);
+                BOOST_REQUIRE_EQUAL(generic.ResidualArcs(i, true), out_arcs);
+                BOOST_REQUIRE_EQUAL(generic.ResidualArcs(i, false), in_arcs);
+            }
+            fixed.template Push<K>(u, v, 3);
+            generic.Push(u, v, 3);
+            auto fixed_energy = fixed.AlphaEnergy();
+            auto generic_energy = generic.AlphaEnergy();
+            BOOST_REQUIRE(std::equal(fixed_energy.begin(), fixed_energy.end(), generic_energy.begin()));
+            auto fixed_alpha = fixed.AlphaCi();
+            auto generic_alpha = generic.AlphaCi();
+            BOOST_REQUIRE(std::equal(fixed_alpha.begin(), fixed_alpha.end(), generic_alpha.begin()));
+        }
+    }
+}
+
+/* Cardinality cliques must agree with the same energy stored as a table.
+ * Push along arcs with positive capacity, and check every arc after each
+ * push, both directions of NextResidual included.
+ */
+template <typename R>
+static void CheckCardinality(int k) {
+    std::mt19937 random_gen(k);
+    std::uniform_int_distribution<R> energy_dist(0, 20);
+    std::uniform_int_distribution<int> slot_dist(0, k-1);
+    std::vector<R> increments(k);
+    for (auto& d : increments)
+        d = energy_dist(random_gen) - 10;
+    std::sort(increments.rbegin(), increments.rend());
+    std::vector<R> h(k+1, 0);
+    for (int c = 0; c < k; ++c)
+        h[c+1] = h[c] + increments[c];
+    std::vector<R> table(1 << k);
+    for (uint32_t a = 0; a < table.size(); ++a)
+        table[a] = h[__builtin_popcount(a)];
+    std::vector<SoSGraphBase::NodeId> nodes(k);
+    for (int i = 0; i < k; ++i)
+        nodes[i] = i;
+    SoSGraph<R> table_graph, card_graph;
+    table_graph.AddNode(k);
+    card_graph.AddNode(k);
+    auto& table_clique = table_graph.AddClique(nodes, table);
+    auto& card_clique = card_graph.AddCardinalityClique(nodes.data(), k, h.data());
+    table_graph.ResetFlow();
+    card_graph.ResetFlow();
+    for (int step = 0; step < 50; ++step) {
+        for (int i = 0; i < k; ++i) {
+            for (int j = 0; j < k; ++j) {
+                if (i == j) continue;
+                BOOST_REQUIRE_EQUAL(card_clique.ExchangeCapacity(i, j), table_clique.ExchangeCapacity(i, j));
+            }
+            for (bool forward : { true, false }) {
+                size_t expected = k;
+                for (int from = k-1; from >= 0; --from) {
+                    if (from != i && table_clique.ExchangeCapacity(forward ? i : from, forward ? from : i) > 0)
+                        expected = from;
+                    BOOST_REQUIRE_EQUAL(card_clique.NextResidual(i, from, forward), expected);
+                }
+            }
+        }
+        const int u = slot_dist(random_gen);
+        const int v = (u + 1 + slot_dist(random_gen) % (k-1)) % k;
+        const R delta = std::min(table_clique.ExchangeCapacity(u, v), R(3));
+        if (delta > 0) {
+            table_clique.Push(u, v, delta);
+            card_clique.Push(u, v, delta);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(SubsetKernels)
+
+BOOST_AUTO_TEST_CASE(FixedSizeMatchesGeneric) {
+    CheckFixedSize<int64_t, 2>();
+    CheckFixedSize<int64_t, 3>();
+    CheckFixedSize<int64_t, 4>();
+    CheckFixedSize<int64_t, 9>();
+}
+
+BOOST_AUTO_TEST_CASE(FixedSizeMatchesGeneric32) {
+    CheckFixedSize<int32_t, 2>();
+    CheckFixedSize<int32_t, 3>();
+    CheckFixedSize<int32_t, 4>();
+    CheckFixedSize<int32_t, 9>();
+}
+
+BOOST_AUTO_TEST_CASE(CardinalityMatchesTable) {
+    for (int k : { 2, 3, 5, 8 })
+        CheckCardinality<int64_t>(k);
+}
+
+BOOST_AUTO_TEST_CASE(AllLevelsMatchReference) {
+    const SimdLevel original = GetSimdLevel();
+    for (SimdLevel level : { SimdLevel::scalar, SimdLevel::sse4, SimdLevel::avx2 }) {
+        if (level <= SupportedSimdLevel())
+            CheckKernels<int64_t>(level);
+    }
+    SetSimdLevel(original);
+}
+
+BOOST_AUTO_TEST_CASE(AllLevelsMatchReference32) {
+    const SimdLevel original = GetSimdLevel();
+    for (SimdLevel level : { SimdLevel::scalar, SimdLevel::sse4, SimdLevel::avx2 }) {
+        if (level <= SupportedSimdLevel())
+            CheckKernels<int32_t>(level);
+    }
+    SetSimdLevel(original);
+}
+
+BOOST_AUTO_TEST_SUITE_END()